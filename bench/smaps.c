@@ -0,0 +1,199 @@
+/*
+ * Compare the smaps_rollup parsers
+ *
+ * The fgets() parser mstat used before the table-driven mstat_parse_smaps
+ * is kept here, unchanged, so both can be timed on the same input. The
+ * old parser reads a rewound fmemopen() stream, the new one the buffer,
+ * so neither pays for the read from /proc.
+ *
+ *   mstat_bench_smaps [-n COUNT] [FILE]
+ *
+ * FILE defaults to /proc/self/smaps_rollup. Any smaps_rollup (or a copy
+ * saved from a large process) can be given instead.
+ */
+#include "common.h"
+
+extern char *mstat_field_names[];
+
+// Parses per run when -n is not given
+#define BENCH_SMAPS_COUNT 200000
+
+/**
+ * Convert smaps_rollup data string to integer (old parser)
+ * @param data value from smaps_rollup key pair
+ * @return integer value on success. -1 on error
+ */
+static ssize_t old_get_value_smaps(char *data) {
+    ssize_t result = -1;
+    char *ptr = NULL;
+
+    ptr = strchr(data, ':');
+    if (ptr) {
+        ptr++;
+        result = strtol(ptr, NULL, 10);
+    }
+    return result;
+}
+
+/**
+ * Extract value (as string) from smaps_rollup key pair (old parser)
+ * @param data smaps_rollup line
+ * @param key name to read
+ * @return data from key on success. NULL on error
+ */
+static char *old_get_key_smaps(char *data, const char *key) {
+    char buf[255] = {0};
+    snprintf(buf, sizeof(buf) - 1, "%s:", key);
+    if (!strncmp(data, buf, strlen(buf))) {
+        return data;
+    }
+    return NULL;
+}
+
+/**
+ * Consume smaps_rollup stream (old parser)
+ * @param p pointer to MSTAT record
+ * @param fp pointer to file stream
+ */
+static void old_read_smaps(struct mstat_record_t *p, FILE *fp) {
+    char data[1024] = {0};
+    for (size_t i = 0; fgets(data, sizeof(data) - 1, fp) != NULL; i++) {
+        if (old_get_key_smaps(data, "Rss")) {
+            p->rss = old_get_value_smaps(data);
+        }
+        if (old_get_key_smaps(data, "Pss")) {
+            p->pss = old_get_value_smaps(data);
+        }
+        if (old_get_key_smaps(data, "Pss_Anon")) {
+            p->pss_anon = old_get_value_smaps(data);
+        }
+        if (old_get_key_smaps(data, "Pss_File")) {
+            p->pss_file = old_get_value_smaps(data);
+        }
+        if (old_get_key_smaps(data, "Pss_Shmem")) {
+            p->pss_shmem = old_get_value_smaps(data);
+        }
+        if (old_get_key_smaps(data, "Shared_Clean")) {
+            p->shared_clean = old_get_value_smaps(data);
+        }
+        if (old_get_key_smaps(data, "Shared_Dirty")) {
+            p->shared_dirty = old_get_value_smaps(data);
+        }
+        if (old_get_key_smaps(data, "Private_Clean")) {
+            p->private_clean = old_get_value_smaps(data);
+        }
+        if (old_get_key_smaps(data, "Private_Dirty")) {
+            p->private_dirty = old_get_value_smaps(data);
+        }
+        if (old_get_key_smaps(data, "Referenced")) {
+            p->referenced = old_get_value_smaps(data);
+        }
+        if (old_get_key_smaps(data, "Anonymous")) {
+            p->anonymous = old_get_value_smaps(data);
+        }
+        if (old_get_key_smaps(data, "LazyFree")) {
+            p->lazy_free = old_get_value_smaps(data);
+        }
+        if (old_get_key_smaps(data, "AnonHugePages")) {
+            p->anon_huge_pages = old_get_value_smaps(data);
+        }
+        if (old_get_key_smaps(data, "ShmemPmdMapped")) {
+            p->shmem_pmd_mapped = old_get_value_smaps(data);
+        }
+        if (old_get_key_smaps(data, "FilePmdMapped")) {
+            p->file_pmd_mapped = old_get_value_smaps(data);
+        }
+        if (old_get_key_smaps(data, "Shared_Hugetlb")) {
+            p->shared_hugetlb = old_get_value_smaps(data);
+        }
+        if (old_get_key_smaps(data, "Private_Hugetlb")) {
+            p->private_hugetlb = old_get_value_smaps(data);
+        }
+        if (old_get_key_smaps(data, "Swap")) {
+            p->swap = old_get_value_smaps(data);
+        }
+        if (old_get_key_smaps(data, "SwapPss")) {
+            p->swap_pss = old_get_value_smaps(data);
+        }
+        if (old_get_key_smaps(data, "Locked")) {
+            p->locked = old_get_value_smaps(data);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *filename = "/proc/self/smaps_rollup";
+    size_t count = BENCH_SMAPS_COUNT;
+    char data[BUFSIZ] = {0};
+    struct mstat_record_t old_record;
+    struct mstat_record_t new_record;
+    struct timespec t0, t1, t2;
+    double old_us, new_us;
+    size_t len;
+    FILE *fp;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            count = strtoul(argv[++i], NULL, 10);
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "usage: %s [-n COUNT] [FILE]\n", argv[0]);
+            exit(1);
+        } else {
+            filename = argv[i];
+        }
+    }
+    if (!count) {
+        fprintf(stderr, "COUNT must be at least 1\n");
+        exit(1);
+    }
+
+    fp = fopen(filename, "r");
+    if (!fp) {
+        perror(filename);
+        exit(1);
+    }
+    len = fread(data, 1, sizeof(data) - 1, fp);
+    fclose(fp);
+    if (!len) {
+        fprintf(stderr, "%s: no data\n", filename);
+        exit(1);
+    }
+
+    fp = fmemopen(data, len, "r");
+    if (!fp) {
+        perror("fmemopen");
+        exit(1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t i = 0; i < count; i++) {
+        memset(&old_record, 0, sizeof(old_record));
+        rewind(fp);
+        old_read_smaps(&old_record, fp);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for (size_t i = 0; i < count; i++) {
+        memset(&new_record, 0, sizeof(new_record));
+        mstat_parse_smaps(&new_record, data, len);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    fclose(fp);
+
+    old_us = mstat_difftimespec(t1, t0) * 1e6 / (double) count;
+    new_us = mstat_difftimespec(t2, t1) * 1e6 / (double) count;
+    printf("input:  %s (%zu bytes)\n", filename, len);
+    printf("parses: %zu\n", count);
+    printf("fgets:  %10.3f us/parse\n", old_us);
+    printf("table:  %10.3f us/parse\n", new_us);
+    printf("speedup: %.1fx\n", new_us > 0 ? old_us / new_us : 0.0);
+
+    if (memcmp(&old_record, &new_record, sizeof(old_record))) {
+        fprintf(stderr, "The parsers disagree\n");
+        for (size_t i = 0; mstat_field_names[i] != NULL; i++) {
+            fprintf(stderr, "  %-20s %zu %zu\n", mstat_field_names[i],
+                    ((size_t *) &old_record)[i], ((size_t *) &new_record)[i]);
+        }
+        exit(1);
+    }
+    return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * Compare io_uring batches against pread() workers in system mode
+ *
+ * Spawns PROCS target processes, each with VMAS private mappings of one
+ * touched page (smaps_rollup costs grow with the number of mappings),
+ * then samples all of them for TICKS ticks with each backend of
+ * mstat_system_sample and reports the tick time:
+ *
+ *   mstat_bench_system [-n PROCS] [-m VMAS] [-t TICKS] [-j JOBS]
+ *
+ * JOBS (default: online CPUs) is the number of pread() threads, as with
+ * `mstat -j`. Run it on the hosts where the choice matters; the number
+ * of online CPUs is printed with the results.
+ */
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "common.h"
+#include "hist.h"
+#include "system.h"
+
+// Defaults of -n, -m and -t
+#define BENCH_SYSTEM_PROCS 200
+#define BENCH_SYSTEM_VMAS 64
+#define BENCH_SYSTEM_TICKS 100
+
+/**
+ * Body of a target process: map and touch memory, report, wait to be killed
+ * @param vmas number of mappings
+ * @param ready write end of the readiness pipe
+ */
+static void target(size_t vmas, int ready) {
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    for (size_t i = 0; i < vmas; i++) {
+        // Alternate protections so neighbouring mappings are not merged
+        int prot = i % 2 ? PROT_READ | PROT_WRITE : PROT_READ;
+        char *p = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            break;
+        }
+        p[0] = 1;
+        mprotect(p, page_size, prot);
+    }
+    if (write(ready, "", 1) < 0) {
+        _exit(1);
+    }
+    close(ready);
+    while (1) {
+        pause();
+    }
+}
+
+/**
+ * Sort PIDs (qsort callback)
+ */
+static int compare_pid(const void *a, const void *b) {
+    pid_t x = *(const pid_t *) a;
+    pid_t y = *(const pid_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Time the ticks of one backend
+ * @param name label printed with the results
+ * @param pids processes to sample (sorted)
+ * @param count number of processes
+ * @param workers pread() threads
+ * @param uring use io_uring batches
+ * @param ticks number of timed ticks
+ * @return 0 on success. -1 on error
+ */
+static int run(const char *name, const pid_t *pids, size_t count, size_t workers, int uring, size_t ticks) {
+    struct mstat_system_t s;
+    struct mstat_record_t tick;
+    struct mstat_hist_t h;
+    unsigned long long total = 0;
+
+    if (mstat_system_open(&s, workers, uring) < 0) {
+        perror("mstat_system_open");
+        return -1;
+    }
+    if (uring && s.uring.fd < 0) {
+        printf("%-6s  io_uring is not available\n", name);
+        mstat_system_close(&s);
+        return 0;
+    }
+    if (mstat_system_set(&s, pids, count) < 0 || mstat_hist_init(&h) < 0) {
+        perror(name);
+        mstat_system_close(&s);
+        return -1;
+    }
+
+    memset(&tick, 0, sizeof(tick));
+    // The first tick opens every sampler
+    mstat_system_sample(&s, &tick);
+    for (size_t i = 0; i < ticks; i++) {
+        struct timespec t0, t1;
+        unsigned long long elapsed;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        mstat_system_sample(&s, &tick);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        elapsed = mstat_difftimespec_ns(t1, t0);
+        mstat_hist_add(&h, elapsed);
+        total += elapsed;
+    }
+    printf("%-6s  %10.3f %10.3f %10.3f %10.3f  %zu\n", name,
+           (double) total / (double) ticks / 1e6,
+           (double) mstat_hist_quantile(&h, 0.5) / 1e6,
+           (double) mstat_hist_quantile(&h, 0.9) / 1e6,
+           (double) mstat_hist_quantile(&h, 0.99) / 1e6,
+           s.skipped);
+    mstat_hist_free(&h);
+    mstat_system_close(&s);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t procs = BENCH_SYSTEM_PROCS;
+    size_t vmas = BENCH_SYSTEM_VMAS;
+    size_t ticks = BENCH_SYSTEM_TICKS;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t workers = cpus > 0 ? (size_t) cpus : 1;
+    int ready[2];
+    pid_t *pids;
+    size_t count = 0;
+    int status = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && !strcmp(argv[i], "-n")) {
+            procs = strtoul(argv[++i], NULL, 10);
+        } else if (i + 1 < argc && !strcmp(argv[i], "-m")) {
+            vmas = strtoul(argv[++i], NULL, 10);
+        } else if (i + 1 < argc && !strcmp(argv[i], "-t")) {
+            ticks = strtoul(argv[++i], NULL, 10);
+        } else if (i + 1 < argc && !strcmp(argv[i], "-j")) {
+            workers = strtoul(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "usage: %s [-n PROCS] [-m VMAS] [-t TICKS] [-j JOBS]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (!procs || !ticks || !workers) {
+        fprintf(stderr, "PROCS, TICKS and JOBS must be at least 1\n");
+        exit(1);
+    }
+
+    pids = calloc(procs, sizeof(*pids));
+    if (!pids || pipe(ready) < 0) {
+        perror("bench");
+        exit(1);
+    }
+    for (; count < procs; count++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            status = 1;
+            break;
+        }
+        if (!pid) {
+            close(ready[0]);
+            target(vmas, ready[1]);
+        }
+        pids[count] = pid;
+    }
+    close(ready[1]);
+    for (size_t i = 0; i < count; i++) {
+        char c;
+        if (read(ready[0], &c, 1) != 1) {
+            fprintf(stderr, "A target process failed to start\n");
+            status = 1;
+            break;
+        }
+    }
+    close(ready[0]);
+    qsort(pids, count, sizeof(*pids), compare_pid);
+
+    if (!status) {
+        printf("targets: %zu processes, %zu mappings each\n", count, vmas);
+        printf("cpus:    %ld online, %zu pread() threads\n", cpus, workers);
+        printf("ticks:   %zu\n\n", ticks);
+        printf("%-6s  %10s %10s %10s %10s  %s\n", "", "mean ms", "p50 ms", "p90 ms", "p99 ms", "skipped");
+        if (run("pread", pids, count, workers, 0, ticks) < 0
+            || run("uring", pids, count, workers, 1, ticks) < 0) {
+            status = 1;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        kill(pids[i], SIGKILL);
+    }
+    for (size_t i = 0; i < count; i++) {
+        waitpid(pids[i], NULL, 0);
+    }
+    free(pids);
+    return status;
+}
@@ -0,0 +1,201 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include "cgroup.h"
+
+/*
+ * Cgroup sampling reads three files of a cgroup v2 directory:
+ *
+ *   memory.current  total memory charged to the cgroup (bytes)
+ *   memory.stat     breakdown of the charge, one "key value" line each (bytes)
+ *   memory.events   event counters, one "key value" line each
+ *
+ * These are plain counters the kernel already maintains, so reading them
+ * is far cheaper than walking page tables for smaps_rollup. Like the
+ * process sampler, the files stay open and are re-read with pread().
+ */
+
+static const char *mstat_cgroup_files[MSTAT_CGROUP_FILE_MAX] = {
+        "memory.current",
+        "memory.stat",
+        "memory.events",
+};
+
+struct mstat_cgroup_key_t {
+    /** MSTAT_CGROUP_FILE_* */
+    int file;
+    /** Key in file (NULL = the whole file is the value) */
+    const char *key;
+    /** Offset of the cgroup record field */
+    size_t offset;
+    /** Values are bytes and are stored in kB */
+    int bytes;
+};
+
+/**
+ * Fields read from the cgroup directory
+ */
+static const struct mstat_cgroup_key_t mstat_cgroup_keys[] = {
+#define MSTAT_X(id, name, ctype, file, key, type) \
+        {file, key, offsetof(struct mstat_cgroup_record_t, name), file != MSTAT_CGROUP_FILE_EVENTS},
+        MSTAT_CGROUP_SCHEMA(MSTAT_X)
+#undef MSTAT_X
+};
+
+/**
+ * Open the memory files of a cgroup v2 directory for repeated sampling
+ * @param c pointer to cgroup sampler
+ * @param path cgroup directory (e.g. /sys/fs/cgroup/system.slice/foo.service)
+ * @return 0 on success. -1 on error (errno is set)
+ */
+int mstat_cgroup_open(struct mstat_cgroup_t *c, const char *path) {
+    struct stat st;
+
+    memset(c, 0, sizeof(*c));
+    for (int i = 0; i < MSTAT_CGROUP_FILE_MAX; i++) {
+        c->fd[i] = -1;
+    }
+    if (stat(path, &st) < 0) {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    c->id = (size_t) st.st_ino;
+
+    for (int i = 0; i < MSTAT_CGROUP_FILE_MAX; i++) {
+        char filename[PATH_MAX] = {0};
+        snprintf(filename, sizeof(filename) - 1, "%s/%s", path, mstat_cgroup_files[i]);
+        c->fd[i] = open(filename, O_RDONLY | O_CLOEXEC);
+        if (c->fd[i] < 0) {
+            int error = errno;
+            mstat_cgroup_close(c);
+            errno = error;
+            return -1;
+        }
+    }
+
+    c->size = BUFSIZ;
+    c->data = malloc(c->size);
+    if (!c->data) {
+        mstat_cgroup_close(c);
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Consume the contents of one cgroup file
+ * @param p pointer to cgroup record (modified)
+ * @param file MSTAT_CGROUP_FILE_*
+ * @param data file contents
+ * @param len length of data
+ */
+void mstat_cgroup_parse(struct mstat_cgroup_record_t *p, int file, const char *data, size_t len) {
+    const char *pos = data;
+    const char *end = data + len;
+
+    while (pos < end) {
+        const char *key = pos;
+        size_t key_len = 0;
+        size_t value = 0;
+
+        if (file != MSTAT_CGROUP_FILE_CURRENT) {
+            while (pos < end && *pos != ' ' && *pos != '\n') {
+                pos++;
+            }
+            key_len = pos - key;
+            while (pos < end && *pos == ' ') {
+                pos++;
+            }
+        }
+        while (pos < end && (unsigned) (*pos - '0') < 10) {
+            value = value * 10 + (size_t) (*pos - '0');
+            pos++;
+        }
+        while (pos < end && *pos++ != '\n');
+
+        for (size_t i = 0; i < MSTAT_CGROUP_FIELD_MAX; i++) {
+            const struct mstat_cgroup_key_t *k = &mstat_cgroup_keys[i];
+            if (k->file != file) {
+                continue;
+            }
+            if (k->key && (strlen(k->key) != key_len || memcmp(k->key, key, key_len) != 0)) {
+                continue;
+            }
+            *(size_t *) ((char *) p + k->offset) = k->bytes ? value / 1024 : value;
+            break;
+        }
+    }
+}
+
+/**
+ * Sample the memory values of a cgroup
+ *
+ * Keys a kernel does not provide (memory.stat "kernel" is recent) stay zero.
+ *
+ * @param c pointer to cgroup sampler
+ * @param p pointer to cgroup record (modified)
+ * @return 0 on success. -1 on error (errno is ENODEV once the cgroup is removed)
+ */
+int mstat_cgroup_read(struct mstat_cgroup_t *c, struct mstat_cgroup_record_t *p) {
+    size_t offset[MSTAT_CGROUP_FILE_MAX];
+    size_t length[MSTAT_CGROUP_FILE_MAX];
+    struct timespec t0, t1, t2;
+    size_t used = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < MSTAT_CGROUP_FILE_MAX; i++) {
+        ssize_t len;
+
+        while ((len = pread(c->fd[i], c->data + used, c->size - used, 0)) == (ssize_t) (c->size - used)) {
+            // The buffer may have truncated the data. Grow it and read again.
+            char *tmp = realloc(c->data, c->size * 2);
+            if (!tmp) {
+                return -1;
+            }
+            c->data = tmp;
+            c->size *= 2;
+        }
+        if (len < 0) {
+            return -1;
+        }
+        if (len == 0) {
+            // Files of a removed cgroup read empty
+            errno = ENODEV;
+            return -1;
+        }
+        offset[i] = used;
+        length[i] = (size_t) len;
+        used += (size_t) len;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    p->id = c->id;
+    for (int i = 0; i < MSTAT_CGROUP_FILE_MAX; i++) {
+        mstat_cgroup_parse(p, i, c->data + offset[i], length[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    c->read_time = mstat_difftimespec_ns(t1, t0);
+    c->parse_time = mstat_difftimespec_ns(t2, t1);
+    return 0;
+}
+
+/**
+ * Release resources held by a cgroup sampler
+ * @param c pointer to cgroup sampler
+ */
+void mstat_cgroup_close(struct mstat_cgroup_t *c) {
+    for (int i = 0; i < MSTAT_CGROUP_FILE_MAX; i++) {
+        if (c->fd[i] >= 0) {
+            close(c->fd[i]);
+        }
+        c->fd[i] = -1;
+    }
+    free(c->data);
+    c->data = NULL;
+    c->size = 0;
+}
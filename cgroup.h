@@ -0,0 +1,36 @@
+#ifndef MSTAT_CGROUP_H
+#define MSTAT_CGROUP_H
+#include "common.h"
+
+// Files of a cgroup directory read by each sample (see MSTAT_CGROUP_SCHEMA)
+enum {
+    MSTAT_CGROUP_FILE_NONE = -1,
+    MSTAT_CGROUP_FILE_CURRENT = 0,
+    MSTAT_CGROUP_FILE_STAT,
+    MSTAT_CGROUP_FILE_EVENTS,
+    MSTAT_CGROUP_FILE_MAX,
+};
+
+struct mstat_cgroup_t {
+    /** Inode of the cgroup directory (the cgroup id) */
+    size_t id;
+    /** Descriptors of memory.current, memory.stat and memory.events (MSTAT_CGROUP_FILE_*) */
+    int fd[MSTAT_CGROUP_FILE_MAX];
+    /** Read buffer */
+    char *data;
+    /** Size of read buffer */
+    size_t size;
+    /** Nanoseconds spent reading by the last mstat_cgroup_read */
+    unsigned long long read_time;
+    /** Nanoseconds spent parsing by the last mstat_cgroup_read */
+    unsigned long long parse_time;
+};
+
+extern char *mstat_cgroup_field_names[];
+extern const char mstat_cgroup_field_types[];
+int mstat_cgroup_open(struct mstat_cgroup_t *c, const char *path);
+int mstat_cgroup_read(struct mstat_cgroup_t *c, struct mstat_cgroup_record_t *p);
+void mstat_cgroup_parse(struct mstat_cgroup_record_t *p, int file, const char *data, size_t len);
+void mstat_cgroup_close(struct mstat_cgroup_t *c);
+
+#endif //MSTAT_CGROUP_H
@@ -0,0 +1,167 @@
+#include <math.h>
+#include "common.h"
+#include "codec.h"
+
+/*
+ * Compressed blocks store each field as a column. Every value is the
+ * difference to the previous record (the timestamp, which advances at a
+ * near constant rate, stores the difference of differences). Floating
+ * point columns (MSTAT_TYPE_F64) are converted to fixed point first, in
+ * units of 1e-9 (nanoseconds for the timestamp), so a small change gives
+ * a small difference rather than one of the raw bit patterns.
+ * Differences are zigzag encoded so small negative numbers stay small,
+ * then written as base-128 varints. A zero is followed by the number of
+ * additional zeros, so fields that do not change cost two bytes per
+ * block. Each block starts from zero and decodes on its own.
+ */
+
+/**
+ * Return a field of a packed record as an integer
+ * @param records packed records (one 8-byte slot per field)
+ * @param fields fields per record
+ * @param i record index
+ * @param f field index
+ * @param fixed convert the field from double to fixed point
+ * @return integer value (units of 1e-9 for fixed point)
+ */
+static inline long long mstat_codec_value(const char *records, int fields, size_t i, int f, int fixed) {
+    const char *slot = records + (i * fields + f) * sizeof(long long);
+    long long value;
+    if (fixed) {
+        double real;
+        memcpy(&real, slot, sizeof(real));
+        return llround(real * 1e9);
+    }
+    memcpy(&value, slot, sizeof(value));
+    return value;
+}
+
+/**
+ * Return the largest number of bytes a block can encode to
+ * @param count records in block
+ * @param fields fields per record
+ * @return bytes
+ */
+size_t mstat_codec_bound(size_t count, int fields) {
+    // Worst case: a 10-byte varint per value plus a run length after each zero
+    return count * fields * 20;
+}
+
+/**
+ * Encode a block of records
+ * @param dest destination (at least mstat_codec_bound() bytes)
+ * @param records packed records (one 8-byte slot per field)
+ * @param count number of records
+ * @param fields fields per record
+ * @param time_field index of the timestamp field (-1 for none)
+ * @param types storage type of each field (MSTAT_TYPE_*)
+ * @return number of bytes written to dest
+ */
+size_t mstat_codec_encode(char *dest, const char *records, size_t count, int fields, int time_field,
+                          const char *types) {
+    size_t len = 0;
+
+    for (int f = 0; f < fields; f++) {
+        int fixed = types[f] == MSTAT_TYPE_F64;
+        long long prev = 0;
+        long long prev_delta = 0;
+        size_t zeros = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            long long value = mstat_codec_value(records, fields, i, f, fixed);
+            long long delta = (long long) ((unsigned long long) value - (unsigned long long) prev);
+            long long out = delta;
+
+            if (f == time_field) {
+                out = (long long) ((unsigned long long) delta - (unsigned long long) prev_delta);
+                prev_delta = delta;
+            }
+            prev = value;
+
+            if (!out) {
+                zeros++;
+                continue;
+            }
+            if (zeros) {
+                len += mstat_varint_put(dest + len, 0);
+                len += mstat_varint_put(dest + len, zeros - 1);
+                zeros = 0;
+            }
+            len += mstat_varint_put(dest + len, mstat_zigzag(out));
+        }
+        if (zeros) {
+            len += mstat_varint_put(dest + len, 0);
+            len += mstat_varint_put(dest + len, zeros - 1);
+        }
+    }
+    return len;
+}
+
+/**
+ * Decode a block of records
+ *
+ * Floating point values are restored from fixed point: timestamps to the
+ * nanosecond they were sampled at, other columns to 1e-9.
+ *
+ * @param records destination for packed records (count * fields 8-byte slots)
+ * @param src encoded block
+ * @param len size of encoded block
+ * @param count number of records
+ * @param fields fields per record
+ * @param time_field index of the timestamp field (-1 for none)
+ * @param types storage type of each field (MSTAT_TYPE_*)
+ * @return 0 on success. -1 if the block is damaged
+ */
+int mstat_codec_decode(char *records, const char *src, size_t len, size_t count, int fields, int time_field,
+                       const char *types) {
+    const unsigned char *pos = (const unsigned char *) src;
+    const unsigned char *end = pos + len;
+
+    for (int f = 0; f < fields; f++) {
+        int fixed = types[f] == MSTAT_TYPE_F64;
+        long long prev = 0;
+        long long prev_delta = 0;
+        size_t zeros = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            char *slot = records + (i * fields + f) * sizeof(long long);
+            long long out = 0;
+            long long delta;
+
+            if (zeros) {
+                zeros--;
+            } else {
+                unsigned long long raw;
+                if (mstat_varint_get(&pos, end, &raw) < 0) {
+                    return -1;
+                }
+                if (!raw) {
+                    if (mstat_varint_get(&pos, end, &raw) < 0) {
+                        return -1;
+                    }
+                    zeros = raw;
+                } else {
+                    out = mstat_unzigzag(raw);
+                }
+            }
+
+            delta = out;
+            if (f == time_field) {
+                delta = (long long) ((unsigned long long) prev_delta + (unsigned long long) out);
+                prev_delta = delta;
+            }
+            prev = (long long) ((unsigned long long) prev + (unsigned long long) delta);
+
+            if (fixed) {
+                double real = (double) prev / 1e9;
+                memcpy(slot, &real, sizeof(real));
+            } else {
+                memcpy(slot, &prev, sizeof(prev));
+            }
+        }
+        if (zeros) {
+            return -1;
+        }
+    }
+    return pos == end ? 0 : -1;
+}
@@ -0,0 +1,75 @@
+#ifndef MSTAT_CODEC_H
+#define MSTAT_CODEC_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Records per compressed block
+#define MSTAT_CODEC_BLOCK 256
+// Bytes preceding each block: record count, payload size (2 x 4 bytes)
+#define MSTAT_CODEC_BLOCK_HEADER 0x08
+#define MSTAT_CODEC_INDEX_MAGIC "MSTATIDX"
+
+/**
+ * Map a signed integer onto an unsigned one, interleaving the signs
+ * @param value signed integer
+ * @return zigzag encoded value
+ */
+static inline unsigned long long mstat_zigzag(long long value) {
+    return ((unsigned long long) value << 1) ^ (unsigned long long) (value >> 63);
+}
+
+/**
+ * Reverse mstat_zigzag()
+ * @param value zigzag encoded value
+ * @return signed integer
+ */
+static inline long long mstat_unzigzag(unsigned long long value) {
+    return (long long) (value >> 1) ^ -(long long) (value & 1);
+}
+
+/**
+ * Append a varint
+ * @param dest destination (at least 10 bytes)
+ * @param value integer to encode
+ * @return number of bytes written
+ */
+static inline size_t mstat_varint_put(char *dest, unsigned long long value) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        dest[len++] = (char) (value | 0x80);
+        value >>= 7;
+    }
+    dest[len++] = (char) value;
+    return len;
+}
+
+/**
+ * Read a varint
+ * @param pos pointer to read position (advanced)
+ * @param end end of input
+ * @param value pointer to decoded integer (modified)
+ * @return 0 on success. -1 if the input ends early
+ */
+static inline int mstat_varint_get(const unsigned char **pos, const unsigned char *end, unsigned long long *value) {
+    unsigned long long result = 0;
+    unsigned shift = 0;
+    while (*pos < end && shift < 64) {
+        unsigned char byte = *(*pos)++;
+        result |= (unsigned long long) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return 0;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+size_t mstat_codec_bound(size_t count, int fields);
+size_t mstat_codec_encode(char *dest, const char *records, size_t count, int fields, int time_field,
+                          const char *types);
+int mstat_codec_decode(char *records, const char *src, size_t len, size_t count, int fields, int time_field,
+                       const char *types);
+
+#endif //MSTAT_CODEC_H
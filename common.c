@@ -1,36 +1,79 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
 #include "common.h"
+#include "codec.h"
 
 // Globals
 const char mstat_magic_bytes[] = MSTAT_MAGIC;
 char *mstat_field_names[] = {
-        "pid",
-        "timestamp",
-        "rss",
-        "pss",
-        "pss_anon",
-        "pss_file",
-        "pss_shmem",
-        "shared_clean",
-        "shared_dirty",
-        "private_clean",
-        "private_dirty",
-        "referenced",
-        "anonymous",
-        "lazy_free",
-        "anon_huge_pages",
-        "shmem_pmd_mapped",
-        "file_pmd_mapped",
-        "shared_hugetlb",
-        "private_hugetlb",
-        "swap",
-        "swap_pss",
-        "locked",
+#define MSTAT_X(id, name, ctype, key, type) #name,
+        MSTAT_SCHEMA(MSTAT_X)
+#undef MSTAT_X
         NULL,
 };
 
+char *mstat_cgroup_field_names[] = {
+#define MSTAT_X(id, name, ctype, file, key, type) #name,
+        MSTAT_CGROUP_SCHEMA(MSTAT_X)
+#undef MSTAT_X
+        NULL,
+};
+
+/**
+ * Storage type of each cgroup field, indexed by MSTAT_CGROUP_FIELD_* id
+ */
+const char mstat_cgroup_field_types[] = {
+#define MSTAT_X(id, name, ctype, file, key, type) type,
+        MSTAT_CGROUP_SCHEMA(MSTAT_X)
+#undef MSTAT_X
+};
+
+/**
+ * Location of each field in a MSTAT record, indexed by MSTAT_FIELD_* id
+ */
+static const size_t mstat_field_offsets[] = {
+#define MSTAT_X(id, name, ctype, key, type) offsetof(struct mstat_record_t, name),
+        MSTAT_SCHEMA(MSTAT_X)
+#undef MSTAT_X
+};
+
+/**
+ * Size of each field in a MSTAT record, indexed by MSTAT_FIELD_* id
+ */
+static const size_t mstat_field_sizes[] = {
+#define MSTAT_X(id, name, ctype, key, type) sizeof(ctype),
+        MSTAT_SCHEMA(MSTAT_X)
+#undef MSTAT_X
+};
+
+/**
+ * Bits of an 8-byte load that belong to each field, indexed by MSTAT_FIELD_* id.
+ * Narrower fields (the pid) are followed by padding, so a full load stays
+ * inside the record and the mask clears whatever the padding holds.
+ */
+static const unsigned long long mstat_field_masks[] = {
+#define MSTAT_X(id, name, ctype, key, type) sizeof(ctype) < 8 ? (1ULL << (sizeof(ctype) * 8)) - 1 : ~0ULL,
+        MSTAT_SCHEMA(MSTAT_X)
+#undef MSTAT_X
+};
+
+/**
+ * Storage type of each field, indexed by MSTAT_FIELD_* id
+ */
+const char mstat_field_types[] = {
+#define MSTAT_X(id, name, ctype, key, type) type,
+        MSTAT_SCHEMA(MSTAT_X)
+#undef MSTAT_X
+};
+
 /**
  * Get total number of fields stored in MSTAT file header
  * @param fp pointer to MSTAT file stream
@@ -64,10 +107,16 @@ int mstat_get_field_count(FILE *fp) {
  */
 char **mstat_read_fields(FILE *fp) {
     char **fields;
+    unsigned short version = 0;
     int total;
 
     total = mstat_get_field_count(fp);
-    fseek(fp, MSTAT_MAGIC_SIZE, SEEK_SET);
+    if (total < 0) {
+        return NULL;
+    }
+    fseek(fp, MSTAT_VERSION_OFFSET, SEEK_SET);
+    fread(&version, sizeof(version), 1, fp);
+    fseek(fp, version >= 2 ? MSTAT_HEADER_SIZE : MSTAT_MAGIC_SIZE, SEEK_SET);
     fields = calloc(total + 1, sizeof(*fields));
     if (!fields) {
         perror("Unable to allocate memory for fields");
@@ -75,9 +124,16 @@ char **mstat_read_fields(FILE *fp) {
     }
     for (int i = 0; i < total; i++) {
         char buf[255] = {0};
-        unsigned len;
+        unsigned len = 0;
         fread(&len, sizeof(len), 1, fp);
+        if (len >= sizeof(buf)) {
+            len = sizeof(buf) - 1;
+        }
         fread(buf, len, 1, fp);
+        if (version >= 2) {
+            // Skip field type
+            fgetc(fp);
+        }
         fields[i] = strdup(buf);
     }
     return fields;
@@ -98,6 +154,53 @@ int mstat_is_valid_field(char **fields, const char *name) {
     return 1;
 }
 
+#define MSTAT_FIELD_HASH_SIZE 64
+static signed char mstat_field_hash[MSTAT_FIELD_HASH_SIZE];
+
+/**
+ * Hash a field name (FNV-1a)
+ * @param name field name
+ * @return slot in `mstat_field_hash`
+ */
+static inline size_t mstat_field_hash_name(const char *name) {
+    unsigned int hash = 2166136261U;
+    while (*name) {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619U;
+    }
+    return hash & (MSTAT_FIELD_HASH_SIZE - 1);
+}
+
+/**
+ * Return the identifier of a field
+ * @param name field name
+ * @return MSTAT_FIELD_* constant. -1 if there is no such field
+ */
+int mstat_get_field_id(const char *name) {
+    size_t slot;
+
+    // Slots hold id + 1 so zero marks an empty slot
+    if (!mstat_field_hash[mstat_field_hash_name(mstat_field_names[0])]) {
+        for (int id = 0; id < MSTAT_FIELD_MAX; id++) {
+            slot = mstat_field_hash_name(mstat_field_names[id]);
+            while (mstat_field_hash[slot]) {
+                slot = (slot + 1) & (MSTAT_FIELD_HASH_SIZE - 1);
+            }
+            mstat_field_hash[slot] = (signed char) (id + 1);
+        }
+    }
+
+    slot = mstat_field_hash_name(name);
+    while (mstat_field_hash[slot]) {
+        int id = mstat_field_hash[slot] - 1;
+        if (!strcmp(mstat_field_names[id], name)) {
+            return id;
+        }
+        slot = (slot + 1) & (MSTAT_FIELD_HASH_SIZE - 1);
+    }
+    return -1;
+}
+
 /**
  * Return record value by field name
  * @param p pointer to MSTAT record
@@ -106,55 +209,13 @@ int mstat_is_valid_field(char **fields, const char *name) {
  */
 union mstat_field_t mstat_get_field_by_name(const struct mstat_record_t *p, const char *name) {
     union mstat_field_t result;
-    result.u64 = ULLONG_MAX;
-
-    if (!strcmp(name, "pid")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_PID);
-    } else if (!strcmp(name, "timestamp")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_TIMESTAMP);
-    } else if (!strcmp(name, "rss")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_RSS);
-    } else if (!strcmp(name, "pss")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_PSS);
-    } else if (!strcmp(name, "pss_anon")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_PSS_ANON);
-    } else if (!strcmp(name, "pss_file")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_PSS_FILE);
-    } else if (!strcmp(name, "pss_shmem")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_PSS_SHMEM);
-    } else if (!strcmp(name, "shared_clean")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_SHARED_CLEAN);
-    } else if (!strcmp(name, "shared_dirty")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_SHARED_DIRTY);
-    } else if (!strcmp(name, "private_clean")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_PRIVATE_CLEAN);
-    } else if (!strcmp(name, "private_dirty")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_PRIVATE_DIRTY);
-    } else if (!strcmp(name, "referenced")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_REFERENCED);
-    } else if (!strcmp(name, "anonymous")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_ANONYMOUS);
-    } else if (!strcmp(name, "lazy_free")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_LAZY_FREE);
-    } else if (!strcmp(name, "anon_huge_pages")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_ANON_HUGE_PAGES);
-    } else if (!strcmp(name, "shmem_pmd_mapped")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_SHMEM_PMD_MAPPED);
-    } else if (!strcmp(name, "file_pmd_mapped")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_FILE_PMD_MAPPED);
-    } else if (!strcmp(name, "shared_hugetlb")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_SHARED_HUGETLB);
-    } else if (!strcmp(name, "private_hugetlb")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_PRIVATE_HUGETLB);
-    } else if (!strcmp(name, "swap")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_SWAP);
-    } else if (!strcmp(name, "swap_pss")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_SWAP_PSS);
-    } else if (!strcmp(name, "locked")) {
-        result = mstat_get_field_by_id(p, MSTAT_FIELD_LOCKED);
-    }
+    int id = mstat_get_field_id(name);
 
-    return result;
+    if (id < 0) {
+        result.u64 = ULLONG_MAX;
+        return result;
+    }
+    return mstat_get_field_by_id(p, (unsigned) id);
 }
 
 /**
@@ -165,80 +226,15 @@ union mstat_field_t mstat_get_field_by_name(const struct mstat_record_t *p, cons
  */
 union mstat_field_t mstat_get_field_by_id(const struct mstat_record_t *record, unsigned id) {
     union mstat_field_t result;
-    result.u64 = ULLONG_MAX;
 
-    switch (id) {
-        case MSTAT_FIELD_PID:
-            result.u64 = record->pid;
-            break;
-        case MSTAT_FIELD_TIMESTAMP:
-            result.d64 = record->timestamp;
-            break;
-        case MSTAT_FIELD_RSS:
-            result.u64 = record->rss;
-            break;
-        case MSTAT_FIELD_PSS:
-            result.u64 = record->pss;
-            break;
-        case MSTAT_FIELD_PSS_ANON:
-            result.u64 = record->pss_anon;
-            break;
-        case MSTAT_FIELD_PSS_FILE:
-            result.u64 = record->pss_file;
-            break;
-        case MSTAT_FIELD_PSS_SHMEM:
-            result.u64 = record->pss_shmem;
-            break;
-        case MSTAT_FIELD_SHARED_CLEAN:
-            result.u64 = record->shared_clean;
-            break;
-        case MSTAT_FIELD_SHARED_DIRTY:
-            result.u64 = record->shared_dirty;
-            break;
-        case MSTAT_FIELD_PRIVATE_CLEAN:
-            result.u64 = record->private_clean;
-            break;
-        case MSTAT_FIELD_PRIVATE_DIRTY:
-            result.u64 = record->private_dirty;
-            break;
-        case MSTAT_FIELD_REFERENCED:
-            result.u64 = record->referenced;
-            break;
-        case MSTAT_FIELD_ANONYMOUS:
-            result.u64 = record->anonymous;
-            break;
-        case MSTAT_FIELD_LAZY_FREE:
-            result.u64 = record->lazy_free;
-            break;
-        case MSTAT_FIELD_ANON_HUGE_PAGES:
-            result.u64 = record->anon_huge_pages;
-            break;
-        case MSTAT_FIELD_SHMEM_PMD_MAPPED:
-            result.u64 = record->shmem_pmd_mapped;
-            break;
-        case MSTAT_FIELD_FILE_PMD_MAPPED:
-            result.u64 = record->file_pmd_mapped;
-            break;
-        case MSTAT_FIELD_SHARED_HUGETLB:
-            result.u64 = record->shared_hugetlb;
-            break;
-        case MSTAT_FIELD_PRIVATE_HUGETLB:
-            result.u64 = record->private_hugetlb;
-            break;
-        case MSTAT_FIELD_SWAP:
-            result.u64 = record->swap;
-            break;
-        case MSTAT_FIELD_SWAP_PSS:
-            result.u64 = record->swap_pss;
-            break;
-        case MSTAT_FIELD_LOCKED:
-            result.u64 = record->locked;
-            break;
-        default:
-            fprintf(stderr, "%s: unknown id id: %u\n", __FUNCTION__, id);
-            break;
+    if (id >= MSTAT_FIELD_MAX) {
+        fprintf(stderr, "%s: unknown id id: %u\n", __FUNCTION__, id);
+        result.u64 = ULLONG_MAX;
+        return result;
     }
-
+    // Narrower integers (the pid) are zero extended
+    memcpy(&result, (const char *) record + mstat_field_offsets[id], sizeof(result));
+    result.u64 &= mstat_field_masks[id];
     return result;
 }
 
@@ -284,290 +280,2182 @@ FILE *mstat_open(const char *filename) {
         fprintf(stderr, "unable to write header to mstat database\n");
         return NULL;
     } else {
+        struct mstat_header_t hdr;
         if (mstat_check_header(fp)) {
             fprintf(stderr, "%s is not an mstat database\n", filename);
             fclose(fp);
             return NULL;
         }
+        if (mstat_read_header(fp, &hdr) < 0) {
+            fprintf(stderr, "%s has a damaged header\n", filename);
+            fclose(fp);
+            return NULL;
+        }
+        if (hdr.version > MSTAT_FORMAT_VERSION) {
+            fprintf(stderr, "%s: unsupported format version %u\n", filename, hdr.version);
+            fclose(fp);
+            return NULL;
+        }
+        if (hdr.byte_order != MSTAT_BOM) {
+            fprintf(stderr, "%s was written on a host with a different byte order\n", filename);
+            fclose(fp);
+            return NULL;
+        }
     }
     mstat_rewind(fp);
     return fp;
 }
 
 /**
- * Rewind MSTAT file to the start of the data region
+ * Locate the compressed blocks of a MSTAT file
+ *
+ * A closed file ends its blocks with an index; otherwise the block headers
+ * are walked and a partially written last block is ignored.
+ *
  * @param fp pointer to MSTAT file stream
- * @return
+ * @param hdr pointer to header (data_end must exclude the trailer, modified)
+ * @return 0 on success. -1 on error
  */
-int mstat_rewind(FILE *fp) {
-    int fields_end;
-    fseek(fp, MSTAT_EOH, SEEK_SET);
-    fread(&fields_end, sizeof(fields_end), 1, fp);
-    return fseek(fp, fields_end, SEEK_SET);
+static int mstat_read_block_layout(FILE *fp, struct mstat_header_t *hdr) {
+    char magic[MSTAT_TRAILER_MAGIC_SIZE];
+    unsigned long long footer[2];
+    size_t pos;
+    size_t records;
+
+    // Index footer: entries (u64), index offset (u64), identifier (8 bytes)
+    if (hdr->data_end >= hdr->data_start + sizeof(footer) + sizeof(magic)
+        && !fseek(fp, (long) (hdr->data_end - sizeof(footer) - sizeof(magic)), SEEK_SET)
+        && fread(footer, sizeof(footer), 1, fp)
+        && fread(magic, sizeof(magic), 1, fp)
+        && !memcmp(magic, MSTAT_CODEC_INDEX_MAGIC, sizeof(magic))
+        && footer[1] >= (unsigned long long) hdr->data_start && footer[1] < hdr->data_end) {
+        hdr->index_count = footer[0];
+        hdr->index_offset = footer[1];
+        hdr->data_end = footer[1];
+    }
+    if (hdr->flags & MSTAT_FLAG_CLOSED) {
+        return 0;
+    }
+
+    records = 0;
+    pos = hdr->data_start;
+    while (pos + MSTAT_CODEC_BLOCK_HEADER <= hdr->data_end) {
+        unsigned int block[2];
+        if (fseek(fp, (long) pos, SEEK_SET) < 0 || !fread(block, sizeof(block), 1, fp)
+            || pos + MSTAT_CODEC_BLOCK_HEADER + block[1] > hdr->data_end) {
+            break;
+        }
+        records += block[0];
+        pos += MSTAT_CODEC_BLOCK_HEADER + block[1];
+    }
+    hdr->records = records;
+    hdr->data_end = pos;
+    return 0;
 }
 
 /**
- * Return one record from a MSTAT file per call, until EOF
+ * Read the MSTAT file header
+ *
+ * Version 1 headers only describe the fields. Their record size and count
+ * are derived from the field count and the file size.
+ *
  * @param fp pointer to MSTAT file stream
- * @param record pointer to MSTAT record
+ * @param hdr pointer to header (modified)
  * @return 0 on success. -1 on error
  */
-int mstat_iter(FILE *fp, struct mstat_record_t *record) {
-    if (feof(fp))
-        return -1;
-    if (!fread(&record->pid, sizeof(record->pid), 1, fp)) return -1;
-    if (!fread(&record->timestamp, sizeof(record->timestamp), 1, fp)) return -1;
-    if (!fread(&record->rss, sizeof(record->rss), 1, fp)) return -1;
-    if (!fread(&record->pss, sizeof(record->pss), 1, fp)) return -1;
-    if (!fread(&record->pss_anon, sizeof(record->pss_anon), 1, fp)) return -1;
-    if (!fread(&record->pss_file, sizeof(record->pss_file), 1, fp)) return -1;
-    if (!fread(&record->pss_shmem, sizeof(record->pss_shmem), 1, fp)) return -1;
-    if (!fread(&record->shared_clean, sizeof(record->shared_clean), 1, fp)) return -1;
-    if (!fread(&record->shared_dirty, sizeof(record->shared_dirty), 1, fp)) return -1;
-    if (!fread(&record->private_clean, sizeof(record->private_clean), 1, fp)) return -1;
-    if (!fread(&record->private_dirty, sizeof(record->private_dirty), 1, fp)) return -1;
-    if (!fread(&record->referenced, sizeof(record->referenced), 1, fp)) return -1;
-    if (!fread(&record->anonymous, sizeof(record->anonymous), 1, fp)) return -1;
-    if (!fread(&record->lazy_free, sizeof(record->lazy_free), 1, fp)) return -1;
-    if (!fread(&record->anon_huge_pages, sizeof(record->anon_huge_pages), 1, fp)) return -1;
-    if (!fread(&record->shmem_pmd_mapped, sizeof(record->shmem_pmd_mapped), 1, fp)) return -1;
-    if (!fread(&record->file_pmd_mapped, sizeof(record->file_pmd_mapped), 1, fp)) return -1;
-    if (!fread(&record->shared_hugetlb, sizeof(record->shared_hugetlb), 1, fp)) return -1;
-    if (!fread(&record->private_hugetlb, sizeof(record->private_hugetlb), 1, fp)) return -1;
-    if (!fread(&record->swap, sizeof(record->swap), 1, fp)) return -1;
-    if (!fread(&record->swap_pss, sizeof(record->swap_pss), 1, fp)) return -1;
-    if (!fread(&record->locked, sizeof(record->locked), 1, fp)) return -1;
+int mstat_read_header(FILE *fp, struct mstat_header_t *hdr) {
+    char buf[MSTAT_HEADER_SIZE] = {0};
+    char tail[sizeof(long long) + MSTAT_TRAILER_MAGIC_SIZE];
+    long long trailer_offset;
+    long long start_sec, start_nsec;
+    ssize_t pos;
+    size_t size;
+
+    memset(hdr, 0, sizeof(*hdr));
+    pos = ftell(fp);
+    if (pos < 0) {
+        return -1;
+    }
+    if (fseek(fp, 0, SEEK_END) < 0) {
+        return -1;
+    }
+    size = ftell(fp);
+    if (size < MSTAT_MAGIC_SIZE || fseek(fp, 0, SEEK_SET) < 0) {
+        fseek(fp, pos, SEEK_SET);
+        return -1;
+    }
+    if (!fread(buf, size < sizeof(buf) ? size : sizeof(buf), 1, fp)) {
+        fseek(fp, pos, SEEK_SET);
+        return -1;
+    }
+
+    memcpy(&hdr->version, buf + MSTAT_VERSION_OFFSET, sizeof(hdr->version));
+    memcpy(&hdr->fields, buf + MSTAT_FIELD_COUNT, sizeof(hdr->fields));
+    memcpy(&hdr->data_start, buf + MSTAT_EOH, sizeof(hdr->data_start));
+    if (!hdr->version) {
+        hdr->version = 1;
+        hdr->byte_order = MSTAT_BOM;
+        hdr->record_size = sizeof(pid_t) + (hdr->fields - 1) * sizeof(size_t);
+    } else {
+        memcpy(&hdr->record_size, buf + MSTAT_RECORD_STRIDE, sizeof(hdr->record_size));
+        memcpy(&hdr->byte_order, buf + MSTAT_BYTE_ORDER, sizeof(hdr->byte_order));
+        memcpy(&hdr->sample_rate, buf + MSTAT_SAMPLE_RATE, sizeof(hdr->sample_rate));
+        memcpy(&start_sec, buf + MSTAT_START_TIME, sizeof(start_sec));
+        memcpy(&start_nsec, buf + MSTAT_START_TIME + sizeof(start_sec), sizeof(start_nsec));
+        memcpy(&hdr->records, buf + MSTAT_RECORD_COUNT, sizeof(hdr->records));
+        memcpy(&hdr->flags, buf + MSTAT_FLAGS, sizeof(hdr->flags));
+        hdr->start.tv_sec = (time_t) start_sec;
+        hdr->start.tv_nsec = (long) start_nsec;
+    }
+
+    // Records end where the trailer begins
+    hdr->data_end = size;
+    if (size >= sizeof(tail) && !fseek(fp, -(long) sizeof(tail), SEEK_END)
+        && fread(tail, sizeof(tail), 1, fp)
+        && !memcmp(tail + sizeof(trailer_offset), MSTAT_TRAILER_END, MSTAT_TRAILER_MAGIC_SIZE)) {
+        memcpy(&trailer_offset, tail, sizeof(trailer_offset));
+        if (trailer_offset >= hdr->data_start && (size_t) trailer_offset < size) {
+            hdr->data_end = trailer_offset;
+        }
+    }
+
+    if (hdr->data_start < 0 || (size_t) hdr->data_start > hdr->data_end || !hdr->record_size) {
+        fseek(fp, pos, SEEK_SET);
+        return -1;
+    }
+    if (hdr->flags & MSTAT_FLAG_COMPRESSED) {
+        int status = mstat_read_block_layout(fp, hdr);
+        fseek(fp, pos, SEEK_SET);
+        return status;
+    }
+    fseek(fp, pos, SEEK_SET);
+
+    if (hdr->flags & MSTAT_FLAG_CLOSED) {
+        hdr->data_end = hdr->data_start + hdr->records * hdr->record_size;
+    } else {
+        // Still being written, or the writer died. Trust the file size.
+        hdr->records = (hdr->data_end - hdr->data_start) / hdr->record_size;
+    }
     return 0;
 }
 
 /**
- * Convert smaps_rollup data string to integer
- * @param data value from smaps_rollup key pair
- * @return integer value on success. -1 on error
+ * Header and read position of open MSTAT streams, indexed by descriptor.
+ * Lets mstat_iter() decode any supported format through a plain FILE.
  */
-ssize_t mstat_get_value_smaps(char *data) {
-    ssize_t result = -1;
-    char *ptr = NULL;
-
-    ptr = strchr(data, ':');
-    if (ptr) {
-        ptr++;
-        result = strtol(ptr, NULL, 10);
-    }
-    return result;
-}
+#define MSTAT_STREAM_MAX 1024
+static struct mstat_stream_t {
+    struct mstat_header_t hdr;
+    size_t index;
+    /** Records decoded from the current compressed block */
+    char *block;
+    /** Records in the current compressed block */
+    size_t block_count;
+    /** Next record of the current compressed block */
+    size_t block_pos;
+} mstat_streams[MSTAT_STREAM_MAX];
 
 /**
- * Extract value (as string) from smaps_rollup key pair
- * @param data smaps_rollup line
- * @param key name to read
- * @return data from key on success. NULL on error
+ * Return the stream state of a MSTAT file, loading its header on first use
+ * @param fp pointer to MSTAT file stream
+ * @return pointer to stream state. NULL on error
  */
-char *mstat_get_key_smaps(char *data, const char *key) {
-    char buf[255] = {0};
-    snprintf(buf, sizeof(buf) - 1, "%s:", key);
-    if (!strncmp(data, buf, strlen(buf))) {
-        return data;
+static struct mstat_stream_t *mstat_stream_get(FILE *fp) {
+    int fd = fileno(fp);
+    if (fd < 0 || fd >= MSTAT_STREAM_MAX) {
+        return NULL;
     }
-    return NULL;
+    if (!mstat_streams[fd].hdr.record_size && mstat_read_header(fp, &mstat_streams[fd].hdr) < 0) {
+        return NULL;
+    }
+    return &mstat_streams[fd];
 }
 
 /**
- * Consume /proc/`pid`/smaps_rollup stream
- * @param p pointer to MSTAT record
- * @param fp pointer to file stream
- * @return TODO
+ * Forget the stream state of a MSTAT file so it is reloaded on next use
+ * @param fp pointer to MSTAT file stream
  */
-void mstat_read_smaps(struct mstat_record_t *p, FILE *fp) {
-    char data[1024] = {0};
-    for (size_t i = 0; fgets(data, sizeof(data) - 1, fp) != NULL; i++) {
-        if (mstat_get_key_smaps(data, "Rss")) {
-            p->rss = mstat_get_value_smaps(data);
-        }
-        if (mstat_get_key_smaps(data, "Pss")) {
-            p->pss = mstat_get_value_smaps(data);
-        }
-        if (mstat_get_key_smaps(data, "Pss_Anon")) {
-            p->pss_anon = mstat_get_value_smaps(data);
-        }
-        if (mstat_get_key_smaps(data, "Pss_File")) {
-            p->pss_file = mstat_get_value_smaps(data);
-        }
-        if (mstat_get_key_smaps(data, "Pss_Shmem")) {
-            p->pss_shmem = mstat_get_value_smaps(data);
-        }
-        if (mstat_get_key_smaps(data, "Shared_Clean")) {
-            p->shared_clean = mstat_get_value_smaps(data);
-        }
-        if (mstat_get_key_smaps(data, "Shared_Dirty")) {
-            p->shared_dirty = mstat_get_value_smaps(data);
-        }
-        if (mstat_get_key_smaps(data, "Private_Clean")) {
-            p->private_clean = mstat_get_value_smaps(data);
-        }
-        if (mstat_get_key_smaps(data, "Private_Dirty")) {
-            p->private_dirty = mstat_get_value_smaps(data);
-        }
-        if (mstat_get_key_smaps(data, "Referenced")) {
-            p->referenced = mstat_get_value_smaps(data);
-        }
-        if (mstat_get_key_smaps(data, "Anonymous")) {
-            p->anonymous = mstat_get_value_smaps(data);
-        }
-        if (mstat_get_key_smaps(data, "LazyFree")) {
-            p->lazy_free = mstat_get_value_smaps(data);
-        }
-        if (mstat_get_key_smaps(data, "AnonHugePages")) {
-            p->anon_huge_pages = mstat_get_value_smaps(data);
-        }
-        if (mstat_get_key_smaps(data, "ShmemPmdMapped")) {
-            p->shmem_pmd_mapped = mstat_get_value_smaps(data);
-        }
-        if (mstat_get_key_smaps(data, "FilePmdMapped")) {
-            p->file_pmd_mapped = mstat_get_value_smaps(data);
-        }
-        if (mstat_get_key_smaps(data, "Shared_Hugetlb")) {
-            p->shared_hugetlb = mstat_get_value_smaps(data);
-        }
-        if (mstat_get_key_smaps(data, "Private_Hugetlb")) {
-            p->private_hugetlb = mstat_get_value_smaps(data);
-        }
-        if (mstat_get_key_smaps(data, "Swap")) {
-            p->swap = mstat_get_value_smaps(data);
-        }
-        if (mstat_get_key_smaps(data, "SwapPss")) {
-            p->swap_pss = mstat_get_value_smaps(data);
-        }
-        if (mstat_get_key_smaps(data, "Locked")) {
-            p->locked = mstat_get_value_smaps(data);
-        }
+static void mstat_stream_reset(FILE *fp) {
+    int fd = fileno(fp);
+    if (fd >= 0 && fd < MSTAT_STREAM_MAX) {
+        free(mstat_streams[fd].block);
+        memset(&mstat_streams[fd], 0, sizeof(mstat_streams[fd]));
     }
 }
 
 /**
- *
- * @param p pointer to MSTAT record
- * @param pid of target process
- * @return 0 on success, -1 on error
+ * Decode the compressed block at the current position of a stream
+ * @param fp pointer to MSTAT file stream
+ * @param stream pointer to stream state
+ * @return 0 on success. -1 on error
  */
-int mstat_attach(struct mstat_record_t *p, pid_t pid) {
-    FILE *fp;
-    char path[PATH_MAX] = {0};
+static int mstat_stream_load_block(FILE *fp, struct mstat_stream_t *stream) {
+    unsigned int block[2];
+    char *payload;
+    int status;
 
-    snprintf(path, PATH_MAX, "/proc/%d/smaps_rollup", pid);
-    if (access(path, F_OK) < 0) {
+    if (!fread(block, sizeof(block), 1, fp) || !block[0] || block[0] > MSTAT_CODEC_BLOCK) {
         return -1;
     }
-    fp = fopen(path, "r");
-    if (!fp) {
+    if (!stream->block) {
+        stream->block = malloc(MSTAT_CODEC_BLOCK * stream->hdr.record_size);
+        if (!stream->block) {
+            return -1;
+        }
+    }
+    payload = malloc(block[1] ? block[1] : 1);
+    if (!payload) {
         return -1;
     }
-
-    mstat_read_smaps(p, fp);
-    fclose(fp);
-
-    return 0;
+    status = -1;
+    // Streams decode with the built-in field types. Fields are only ever
+    // appended to the schema, so this covers every file up to this version.
+    if ((int) (stream->hdr.record_size / sizeof(size_t)) <= MSTAT_FIELD_MAX
+        && (!block[1] || fread(payload, block[1], 1, fp))) {
+        status = mstat_codec_decode(stream->block, payload, block[1], block[0],
+                                    (int) (stream->hdr.record_size / sizeof(size_t)), MSTAT_FIELD_TIMESTAMP,
+                                    mstat_field_types);
+    }
+    free(payload);
+    stream->block_count = status < 0 ? 0 : block[0];
+    stream->block_pos = 0;
+    return status;
 }
 
 /**
- * Write MSTAT header to data file
+ * Position a compressed MSTAT stream at a record
  *
- * HEADER FORMAT
- * 0x00 - 0x07 = file identifier (8 bytes)
- * 0x08 - 0x0B = total field records (4 bytes)
- * 0x0C - 0x0F = EOH offset (4 bytes)
- * 0x10 - EOH = field_length (unsigned int), field (string) (n... bytes)
+ * The block index, when present, is binary searched. Otherwise block
+ * headers are skipped from the first block onward.
  *
- * @param fp pointer to stream
- * @return 0 on success, -1 on error
+ * @param fp pointer to MSTAT file stream
+ * @param stream pointer to stream state
+ * @param index of record
+ * @return 0 on success. -1 on error
  */
-int mstat_write_header(FILE *fp) {
-    fwrite(mstat_magic_bytes, 6, 1, fp);
-    for (int i = 0; i < (int)(MSTAT_MAGIC_SIZE - sizeof(mstat_magic_bytes)); i++) {
-        if (!fwrite("\0", 1, 1, fp)) {
-            return -1;
-        }
-    }
-    int rec;
-    ssize_t fields_end;
+static int mstat_stream_seek_block(FILE *fp, struct mstat_stream_t *stream, size_t index) {
+    size_t pos = stream->hdr.data_start;
+    size_t first = 0;
 
-    for (rec = 0; mstat_field_names[rec] != NULL; rec++) {
-        unsigned int len = strlen(mstat_field_names[rec]);
-        fwrite(&len, sizeof(len), 1, fp);
-        fwrite(mstat_field_names[rec], sizeof(char), len, fp);
+    stream->block_count = 0;
+    stream->block_pos = 0;
+    if (index >= stream->hdr.records) {
+        return fseek(fp, (long) stream->hdr.data_end, SEEK_SET);
     }
-    fields_end = ftell(fp);
 
-    fseek(fp, MSTAT_FIELD_COUNT, SEEK_SET);
-    fwrite(&rec, sizeof(rec), 1, fp);
+    if (stream->hdr.index_count) {
+        // Entries: block offset (u64), first record of block (u64)
+        size_t lo = 0;
+        size_t hi = stream->hdr.index_count;
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            unsigned long long entry[2];
+            if (fseek(fp, (long) (stream->hdr.index_offset + mid * sizeof(entry)), SEEK_SET) < 0
+                || !fread(entry, sizeof(entry), 1, fp)) {
+                return -1;
+            }
+            if (entry[1] <= index) {
+                lo = mid;
+                pos = entry[0];
+                first = entry[1];
+            } else {
+                hi = mid;
+            }
+        }
+    }
 
-    fseek(fp, MSTAT_EOH, SEEK_SET);
-    fwrite(&fields_end, sizeof(int), 1, fp);
-    fseek(fp, fields_end, SEEK_SET);
+    while (1) {
+        unsigned int block[2];
+        if (fseek(fp, (long) pos, SEEK_SET) < 0 || !fread(block, sizeof(block), 1, fp)) {
+            return -1;
+        }
+        if (index < first + block[0]) {
+            break;
+        }
+        first += block[0];
+        pos += MSTAT_CODEC_BLOCK_HEADER + block[1];
+    }
+    if (fseek(fp, (long) pos, SEEK_SET) < 0 || mstat_stream_load_block(fp, stream) < 0) {
+        return -1;
+    }
+    stream->block_pos = index - first;
     return 0;
 }
 
 /**
- * Write a MSTAT record to data file
+ * Return the number of records in a MSTAT file without reading them
  * @param fp pointer to MSTAT file stream
- * @param record pointer to MSTAT record
+ * @return number of records. -1 on error
+ */
+ssize_t mstat_get_record_count(FILE *fp) {
+    struct mstat_stream_t *stream = mstat_stream_get(fp);
+    if (!stream) {
+        return -1;
+    }
+    return (ssize_t) stream->hdr.records;
+}
+
+/**
+ * Position a MSTAT file at a record
+ * @param fp pointer to MSTAT file stream
+ * @param index of record (0 = first)
  * @return 0 on success. -1 on error
  */
-int mstat_write(FILE *fp, struct mstat_record_t *record) {
-    if (!fwrite(&record->pid, sizeof(record->pid), 1, fp)) return -1;
-    if (!fwrite(&record->timestamp, sizeof(record->timestamp), 1, fp)) return -1;
-    if (!fwrite(&record->rss, sizeof(record->rss), 1, fp)) return -1;
-    if (!fwrite(&record->pss, sizeof(record->pss), 1, fp)) return -1;
-    if (!fwrite(&record->pss_anon, sizeof(record->pss_anon), 1, fp)) return -1;
-    if (!fwrite(&record->pss_file, sizeof(record->pss_file), 1, fp)) return -1;
-    if (!fwrite(&record->pss_shmem, sizeof(record->pss_shmem), 1, fp)) return -1;
-    if (!fwrite(&record->shared_clean, sizeof(record->shared_clean), 1, fp)) return -1;
-    if (!fwrite(&record->shared_dirty, sizeof(record->shared_dirty), 1, fp)) return -1;
-    if (!fwrite(&record->private_clean, sizeof(record->private_clean), 1, fp)) return -1;
-    if (!fwrite(&record->private_dirty, sizeof(record->private_dirty), 1, fp)) return -1;
-    if (!fwrite(&record->referenced, sizeof(record->referenced), 1, fp)) return -1;
-    if (!fwrite(&record->anonymous, sizeof(record->anonymous), 1, fp)) return -1;
-    if (!fwrite(&record->lazy_free, sizeof(record->lazy_free), 1, fp)) return -1;
-    if (!fwrite(&record->anon_huge_pages, sizeof(record->anon_huge_pages), 1, fp)) return -1;
-    if (!fwrite(&record->shmem_pmd_mapped, sizeof(record->shmem_pmd_mapped), 1, fp)) return -1;
-    if (!fwrite(&record->file_pmd_mapped, sizeof(record->file_pmd_mapped), 1, fp)) return -1;
-    if (!fwrite(&record->shared_hugetlb, sizeof(record->shared_hugetlb), 1, fp)) return -1;
-    if (!fwrite(&record->private_hugetlb, sizeof(record->private_hugetlb), 1, fp)) return -1;
-    if (!fwrite(&record->swap, sizeof(record->swap), 1, fp)) return -1;
-    if (!fwrite(&record->swap_pss, sizeof(record->swap_pss), 1, fp)) return -1;
-    if (!fwrite(&record->locked, sizeof(record->locked), 1, fp)) return -1;
-    return 0;
+int mstat_seek(FILE *fp, size_t index) {
+    struct mstat_stream_t *stream = mstat_stream_get(fp);
+    if (!stream || index > stream->hdr.records) {
+        return -1;
+    }
+    stream->index = index;
+    if (stream->hdr.flags & MSTAT_FLAG_COMPRESSED) {
+        return mstat_stream_seek_block(fp, stream, index);
+    }
+    return fseek(fp, stream->hdr.data_start + (long) (index * stream->hdr.record_size), SEEK_SET);
 }
 
 /**
- * Compute difference between timespec structures
- * @param end timespec
- * @param start timespec
- * @return seconds
+ * Rewind MSTAT file to the start of the data region
+ * @param fp pointer to MSTAT file stream
+ * @return
  */
-double mstat_difftimespec(const struct timespec end, const struct timespec start) {
-    return (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+int mstat_rewind(FILE *fp) {
+    mstat_stream_reset(fp);
+    return mstat_seek(fp, 0);
 }
 
 /**
- * Compute the min/max of an array
- * @param a input data
- * @param size size of input data
- * @param min pointer to return variable (modified)
- * @param max pointer to return variable (modified)
+ * Return one record from a MSTAT file per call, until EOF
+ * @param fp pointer to MSTAT file stream
+ * @param record pointer to MSTAT record
+ * @return 0 on success. -1 on error
  */
-void mstat_get_mmax(const double a[], size_t size, double *min, double *max) {
-    *min = a[0];
-    *max = 0;
+int mstat_iter(FILE *fp, struct mstat_record_t *record) {
+    struct mstat_stream_t *stream;
+    char buf[MSTAT_RECORD_SIZE * 4];
 
-    for (size_t i = 0; i < size; i++) {
-        if (a[i] > *max) {
-            *max = a[i];
-        }
-        if (a[i] < *min) {
-            *min = a[i];
+    stream = mstat_stream_get(fp);
+    if (!stream || stream->index >= stream->hdr.records || stream->hdr.record_size > sizeof(buf)) {
+        return -1;
+    }
+    if (stream->hdr.flags & MSTAT_FLAG_COMPRESSED) {
+        if (stream->block_pos >= stream->block_count && mstat_stream_load_block(fp, stream) < 0) {
+            return -1;
         }
+        mstat_unpack(record, stream->block + stream->block_pos * stream->hdr.record_size, &stream->hdr);
+        stream->block_pos++;
+        stream->index++;
+        return 0;
+    }
+    if (!fread(buf, stream->hdr.record_size, 1, fp)) {
+        return -1;
     }
+    stream->index++;
+    mstat_unpack(record, buf, &stream->hdr);
+    return 0;
+}
+
+/**
+ * Decode the compressed blocks of a mapped file
+ *
+ * The records land in one buffer with the same layout as an uncompressed
+ * file, so record and column access do not care how the file was stored.
+ * Decoding starts at map->next_block and stops at map->hdr.records.
+ *
+ * @param map pointer to map
+ * @param first number of records already decoded
+ * @return 0 on success. -1 on error
+ */
+static int mstat_map_decode(struct mstat_map_t *map, size_t first) {
+    const char *pos = map->base + map->next_block;
+    const char *end = map->base + map->hdr.data_end;
+
+    if (map->hdr.records > map->decoded_capacity) {
+        size_t capacity = map->decoded_capacity ? map->decoded_capacity : MSTAT_CODEC_BLOCK;
+        char *decoded;
+        while (capacity < map->hdr.records) {
+            capacity *= 2;
+        }
+        decoded = realloc(map->decoded, capacity * map->hdr.record_size + 1);
+        if (!decoded) {
+            perror("Unable to allocate memory for decoded records");
+            return -1;
+        }
+        map->decoded = decoded;
+        map->decoded_capacity = capacity;
+    }
+    map->data = map->decoded;
+
+    while (first < map->hdr.records && pos + MSTAT_CODEC_BLOCK_HEADER <= end) {
+        unsigned int block[2];
+        memcpy(block, pos, sizeof(block));
+        pos += MSTAT_CODEC_BLOCK_HEADER;
+        if (pos + block[1] > end || first + block[0] > map->hdr.records) {
+            return -1;
+        }
+        if (mstat_codec_decode(map->decoded + first * map->hdr.record_size, pos, block[1], block[0],
+                               (int) (map->hdr.record_size / sizeof(size_t)), MSTAT_FIELD_TIMESTAMP,
+                               map->types) < 0) {
+            return -1;
+        }
+        first += block[0];
+        pos += block[1];
+    }
+    map->next_block = pos - map->base;
+    return first == map->hdr.records ? 0 : -1;
+}
+
+/**
+ * Map a MSTAT file into memory for reading
+ *
+ * Records are read in place: nothing is copied until a caller asks for a
+ * decoded record, and column views walk the mapping directly. The kernel
+ * is told the file will be read sequentially so it reads ahead
+ * aggressively.
+ *
+ * @param filename path to MSTAT file
+ * @return pointer to map on success. NULL on error
+ */
+struct mstat_map_t *mstat_map_open(const char *filename) {
+    struct mstat_map_t *map;
+    const char *pos;
+    const char *end;
+
+    if (access(filename, F_OK) < 0) {
+        perror(filename);
+        return NULL;
+    }
+
+    map = calloc(1, sizeof(*map));
+    if (!map) {
+        perror("Unable to allocate memory for map");
+        return NULL;
+    }
+
+    map->fp = mstat_open(filename);
+    if (!map->fp) {
+        free(map);
+        return NULL;
+    }
+    if (mstat_read_header(map->fp, &map->hdr) < 0) {
+        fprintf(stderr, "%s has a damaged header\n", filename);
+        mstat_map_close(map);
+        return NULL;
+    }
+
+    map->size = map->hdr.data_end;
+    map->base = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fileno(map->fp), 0);
+    if (map->base == MAP_FAILED) {
+        perror(filename);
+        map->base = NULL;
+        mstat_map_close(map);
+        return NULL;
+    }
+    madvise(map->base, map->size, MADV_SEQUENTIAL);
+    map->data = map->base + map->hdr.data_start;
+
+    map->fields = calloc(map->hdr.fields + 1, sizeof(*map->fields));
+    map->types = calloc(map->hdr.fields + 1, sizeof(*map->types));
+    if (!map->fields || !map->types) {
+        perror("Unable to allocate memory for fields");
+        mstat_map_close(map);
+        return NULL;
+    }
+
+    pos = map->base + (map->hdr.version >= 2 ? MSTAT_HEADER_SIZE : MSTAT_MAGIC_SIZE);
+    end = map->base + map->hdr.data_start;
+    for (int i = 0; i < map->hdr.fields; i++) {
+        unsigned int len;
+        if (pos + sizeof(len) > end) {
+            break;
+        }
+        memcpy(&len, pos, sizeof(len));
+        pos += sizeof(len);
+        if (pos + len > end) {
+            break;
+        }
+        map->fields[i] = strndup(pos, len);
+        pos += len;
+        if (map->hdr.version >= 2) {
+            map->types[i] = *pos++;
+        } else {
+            map->types[i] = mstat_get_field_type(i);
+        }
+    }
+
+    map->next_block = map->hdr.data_start;
+    if ((map->hdr.flags & MSTAT_FLAG_COMPRESSED) && mstat_map_decode(map, 0) < 0) {
+        fprintf(stderr, "%s: compressed data is damaged\n", filename);
+        mstat_map_close(map);
+        return NULL;
+    }
+    return map;
+}
+
+/**
+ * Unmap a MSTAT file and release its resources
+ * @param map pointer to map
+ */
+void mstat_map_close(struct mstat_map_t *map) {
+    if (!map) {
+        return;
+    }
+    if (map->base) {
+        munmap(map->base, map->size);
+    }
+    if (map->fields) {
+        for (size_t i = 0; map->fields[i] != NULL; i++) {
+            free(map->fields[i]);
+        }
+    }
+    free(map->fields);
+    free(map->types);
+    free(map->decoded);
+    if (map->fp) {
+        fclose(map->fp);
+    }
+    free(map);
+}
+
+/**
+ * Pick up records appended to a mapped file
+ *
+ * Only the part of the file written since the last call is examined:
+ * uncompressed files are measured by their size, and compressed files
+ * decode the blocks completed since then. A partially written record or
+ * block is left for the next call. Once the writer closes the file
+ * (MSTAT_FLAG_CLOSED) no more records appear.
+ *
+ * The mapping may move. Record pointers and column views taken before
+ * the call are invalid afterwards.
+ *
+ * @param map pointer to map
+ * @return number of new records. -1 on error
+ */
+ssize_t mstat_map_refresh(struct mstat_map_t *map) {
+    struct mstat_header_t hdr;
+    struct stat st;
+    unsigned long long flags = 0;
+    size_t before = map->hdr.records;
+    int fd = fileno(map->fp);
+    char *base;
+
+    if (map->hdr.flags & MSTAT_FLAG_CLOSED) {
+        return 0;
+    }
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    if (map->hdr.version >= 2
+        && pread(fd, &flags, sizeof(flags), MSTAT_FLAGS) != (ssize_t) sizeof(flags)) {
+        return -1;
+    }
+
+    hdr = map->hdr;
+    if (flags & MSTAT_FLAG_CLOSED) {
+        // The writer is done. Its final header, index and trailer are authoritative.
+        if (mstat_read_header(map->fp, &hdr) < 0) {
+            return -1;
+        }
+    } else if ((size_t) st.st_size <= map->size) {
+        return 0;
+    } else {
+        hdr.data_end = st.st_size;
+    }
+
+    // Map the grown file. Pages already read stay in the page cache.
+    base = mmap(NULL, hdr.data_end, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    munmap(map->base, map->size);
+    map->base = base;
+    map->size = hdr.data_end;
+    madvise(map->base, map->size, MADV_SEQUENTIAL);
+
+    if (hdr.flags & MSTAT_FLAG_COMPRESSED) {
+        if (!(flags & MSTAT_FLAG_CLOSED)) {
+            // Count the blocks completed since the last call
+            size_t pos = map->next_block;
+            hdr.records = before;
+            while (pos + MSTAT_CODEC_BLOCK_HEADER <= hdr.data_end) {
+                unsigned int block[2];
+                memcpy(block, map->base + pos, sizeof(block));
+                if (pos + MSTAT_CODEC_BLOCK_HEADER + block[1] > hdr.data_end) {
+                    break;
+                }
+                hdr.records += block[0];
+                pos += MSTAT_CODEC_BLOCK_HEADER + block[1];
+            }
+        }
+        map->hdr = hdr;
+        if (mstat_map_decode(map, before) < 0) {
+            return -1;
+        }
+    } else {
+        if (!(flags & MSTAT_FLAG_CLOSED)) {
+            hdr.records = (hdr.data_end - hdr.data_start) / hdr.record_size;
+        }
+        map->hdr = hdr;
+        map->data = map->base + map->hdr.data_start;
+    }
+    return map->hdr.records > before ? (ssize_t) (map->hdr.records - before) : 0;
+}
+
+/**
+ * Return the position of a field in the records of a mapped file
+ * @param map pointer to map
+ * @param name field name
+ * @return field index. -1 if the file does not store the field
+ */
+int mstat_map_find_field(const struct mstat_map_t *map, const char *name) {
+    int id = mstat_get_field_id(name);
+
+    // Files store the schema in order, so the field is usually at its id
+    if (id >= 0 && id < map->hdr.fields && !strcmp(map->fields[id], name)) {
+        return id;
+    }
+    for (int i = 0; map->fields[i] != NULL; i++) {
+        if (!strcmp(map->fields[i], name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Return the fields shown when none are requested
+ * @param map pointer to map
+ * @return field names (NULL terminated): rss, pss and swap, or current, anon and file for cgroup files
+ */
+char **mstat_map_default_fields(const struct mstat_map_t *map) {
+    static char *process[] = {"rss", "pss", "swap", NULL};
+    static char *cgroup[] = {"current", "anon", "file", NULL};
+
+    if (mstat_map_find_field(map, "rss") < 0 && mstat_map_find_field(map, "current") >= 0) {
+        return cgroup;
+    }
+    return process;
+}
+
+/**
+ * Return a record of a mapped file in its on-disk layout
+ * @param map pointer to map
+ * @param index of record
+ * @return pointer into the mapping. NULL if index is out of range
+ */
+const char *mstat_map_record(const struct mstat_map_t *map, size_t index) {
+    if (index >= map->hdr.records) {
+        return NULL;
+    }
+    return map->data + index * map->hdr.record_size;
+}
+
+/**
+ * Decode a record of a mapped file
+ * @param map pointer to map
+ * @param index of record
+ * @param record pointer to MSTAT record (modified)
+ * @return 0 on success. -1 if index is out of range
+ */
+int mstat_map_get(const struct mstat_map_t *map, size_t index, struct mstat_record_t *record) {
+    const char *data = mstat_map_record(map, index);
+    if (!data) {
+        return -1;
+    }
+    mstat_unpack(record, data, &map->hdr);
+    return 0;
+}
+
+/**
+ * Return a view of one field across all records of a mapped file
+ * @param map pointer to map
+ * @param field index of field (see mstat_map_find_field)
+ * @param column pointer to column view (modified)
+ * @return 0 on success. -1 if the field does not exist
+ */
+int mstat_map_column(const struct mstat_map_t *map, int field, struct mstat_column_t *column) {
+    size_t offset;
+
+    if (field < 0 || field >= map->hdr.fields) {
+        return -1;
+    }
+    offset = field * sizeof(size_t);
+    column->width = sizeof(size_t);
+    if (map->hdr.version < 2) {
+        // Version 1 stores a 4-byte pid ahead of the 8-byte values
+        if (field == MSTAT_FIELD_PID) {
+            column->width = sizeof(pid_t);
+        } else {
+            offset -= sizeof(size_t) - sizeof(pid_t);
+        }
+    }
+    column->data = map->data + offset;
+    column->stride = map->hdr.record_size;
+    column->count = map->hdr.records;
+    column->type = map->types[field];
+    return 0;
+}
+
+/**
+ * Copy values of one field of a mapped file into an array of doubles
+ *
+ * Walks the column directly, so plotting and statistics can load a
+ * series without decoding whole records.
+ *
+ * @param map pointer to map
+ * @param field index of field (see mstat_map_find_field)
+ * @param first first record
+ * @param count maximum number of values
+ * @param dest destination (at least count values)
+ * @return number of values copied
+ */
+size_t mstat_map_gather(const struct mstat_map_t *map, int field, size_t first, size_t count, double *dest) {
+    struct mstat_column_t column;
+
+    if (mstat_map_column(map, field, &column) < 0 || first >= column.count) {
+        return 0;
+    }
+    if (count > column.count - first) {
+        count = column.count - first;
+    }
+    if (column.type == MSTAT_TYPE_F64) {
+        for (size_t i = 0; i < count; i++) {
+            memcpy(&dest[i], column.data + (first + i) * column.stride, sizeof(*dest));
+        }
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            dest[i] = (double) mstat_column_u64(&column, first + i);
+        }
+    }
+    return count;
+}
+
+/**
+ * Prepare to walk all records of a mapped file
+ * @param cursor pointer to cursor (modified)
+ * @param map pointer to map
+ */
+void mstat_cursor_init(struct mstat_cursor_t *cursor, const struct mstat_map_t *map) {
+    cursor->map = map;
+    cursor->index = 0;
+    cursor->end = map->hdr.records;
+}
+
+/**
+ * Decode the next record of a mapped file
+ * @param cursor pointer to cursor
+ * @param record pointer to MSTAT record (modified)
+ * @return 0 on success. -1 when no records remain
+ */
+int mstat_cursor_next(struct mstat_cursor_t *cursor, struct mstat_record_t *record) {
+    if (cursor->index >= cursor->end) {
+        return -1;
+    }
+    return mstat_map_get(cursor->map, cursor->index++, record);
+}
+
+/**
+ * smaps key of each field, indexed by MSTAT_FIELD_* and MSTAT_SMAPS_KEY_* id (NULL = not read from smaps)
+ */
+static const struct mstat_smaps_key_t mstat_smaps_keys[] = {
+#define MSTAT_X(id, name, ctype, key, type) {key, MSTAT_FIELD_##id, offsetof(struct mstat_record_t, name)},
+        MSTAT_SCHEMA(MSTAT_X)
+#undef MSTAT_X
+        {"Size", MSTAT_SMAPS_KEY_SIZE, 0},
+};
+
+#define MSTAT_SMAPS_HASH_SIZE 64
+static const struct mstat_smaps_key_t *mstat_smaps_hash[MSTAT_SMAPS_HASH_SIZE];
+
+/**
+ * Hash a smaps key
+ *
+ * Length, first and last character give every smaps_rollup key its own
+ * slot. "Size", which only the full smaps has, shares slot 9 with
+ * "ShmemPmdMapped" and is found by probing the next one.
+ *
+ * @param key smaps key (not terminated)
+ * @param len length of key
+ * @return slot in `mstat_smaps_hash`
+ */
+static inline size_t mstat_smaps_hash_key(const char *key, size_t len) {
+    return (len + (unsigned char) key[0] + (unsigned char) key[len - 1] * 10) & (MSTAT_SMAPS_HASH_SIZE - 1);
+}
+
+/**
+ * Populate the smaps key lookup table
+ */
+void mstat_smaps_init() {
+    if (mstat_smaps_hash[mstat_smaps_hash_key("Rss", 3)]) {
+        return;
+    }
+    for (const struct mstat_smaps_key_t *k = mstat_smaps_keys; k < mstat_smaps_keys + MSTAT_SMAPS_KEY_MAX; k++) {
+        size_t slot;
+        if (!k->key) {
+            continue;
+        }
+        slot = mstat_smaps_hash_key(k->key, strlen(k->key));
+        // Linear probing keeps the table correct if a new key collides
+        while (mstat_smaps_hash[slot]) {
+            slot = (slot + 1) & (MSTAT_SMAPS_HASH_SIZE - 1);
+        }
+        mstat_smaps_hash[slot] = k;
+    }
+}
+
+/**
+ * Find a smaps key (call mstat_smaps_init first)
+ * @param key smaps key (not terminated)
+ * @param len length of key
+ * @return pointer to key descriptor. NULL if the key is not known
+ */
+const struct mstat_smaps_key_t *mstat_smaps_lookup(const char *key, size_t len) {
+    size_t slot = mstat_smaps_hash_key(key, len);
+    const struct mstat_smaps_key_t *k;
+
+    while ((k = mstat_smaps_hash[slot]) != NULL) {
+        if (!strncmp(k->key, key, len) && k->key[len] == '\0') {
+            return k;
+        }
+        slot = (slot + 1) & (MSTAT_SMAPS_HASH_SIZE - 1);
+    }
+    return NULL;
+}
+
+/**
+ * Consume smaps_rollup data held in memory
+ *
+ * Each line is visited once: the key is hashed straight to its record
+ * offset and the decimal value is accumulated in place. Values are added
+ * to the record, so the full smaps of a process (one block per mapping)
+ * sums up to its totals.
+ *
+ * @param p pointer to MSTAT record (fields must start at zero)
+ * @param data smaps_rollup text
+ * @param len length of data
+ */
+void mstat_parse_smaps(struct mstat_record_t *p, const char *data, size_t len) {
+    const char *pos = data;
+    const char *end = data + len;
+
+    mstat_smaps_init();
+    while (pos < end) {
+        const char *key = pos;
+        const struct mstat_smaps_key_t *k;
+
+        // Key ends at the colon. Lines without one (the mapping header) are skipped.
+        while (pos < end && *pos != ':' && *pos != ' ' && *pos != '\n') {
+            pos++;
+        }
+        if (pos < end && *pos == ':' && pos > key && (k = mstat_smaps_lookup(key, pos - key)) != NULL
+            && k->id < MSTAT_FIELD_MAX) {
+            size_t value = 0;
+            pos++;
+            while (pos < end && *pos == ' ') {
+                pos++;
+            }
+            while (pos < end && (unsigned) (*pos - '0') < 10) {
+                value = value * 10 + (size_t) (*pos - '0');
+                pos++;
+            }
+            *(size_t *) ((char *) p + k->offset) += value;
+        }
+
+        pos = memchr(pos, '\n', end - pos);
+        if (!pos) {
+            break;
+        }
+        pos++;
+    }
+}
+
+/**
+ * Consume /proc/`pid`/smaps_rollup stream
+ * @param p pointer to MSTAT record
+ * @param fp pointer to file stream
+ */
+void mstat_read_smaps(struct mstat_record_t *p, FILE *fp) {
+    char data[BUFSIZ];
+    size_t len;
+
+    len = fread(data, 1, sizeof(data), fp);
+    mstat_parse_smaps(p, data, len);
+}
+
+/**
+ * Open the smaps file a sampler reads
+ * @param s pointer to sampler
+ * @return file descriptor. -1 on error
+ */
+static int mstat_sampler_open_smaps(const struct mstat_sampler_t *s) {
+    char path[PATH_MAX] = {0};
+
+    snprintf(path, sizeof(path) - 1, "/proc/%d/%s", s->pid,
+             s->source == MSTAT_SOURCE_SMAPS ? "smaps" : "smaps_rollup");
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/**
+ * Open /proc/`pid`/smaps_rollup for repeated sampling
+ *
+ * The descriptor stays open for the life of the sampler. Each sample
+ * re-reads it from offset zero with pread(), avoiding the path lookup,
+ * open, stdio buffer and close a fresh fopen() costs.
+ *
+ * Kernels older than 4.14 have no smaps_rollup. The sampler then reads
+ * /proc/`pid`/smaps and sums the values of every mapping, and `source`
+ * is set to MSTAT_SOURCE_SMAPS.
+ *
+ * @param s pointer to sampler
+ * @param pid of target process
+ * @return 0 on success. -1 on error (errno is set)
+ */
+int mstat_sampler_open(struct mstat_sampler_t *s, pid_t pid) {
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+    s->fd_statm = -1;
+    s->pid = pid;
+    s->source = MSTAT_SOURCE_SMAPS_ROLLUP;
+    s->page_size = sysconf(_SC_PAGESIZE) / 1024;
+    s->fd = mstat_sampler_open_smaps(s);
+    if (s->fd < 0 && errno == ENOENT) {
+        char path[PATH_MAX] = {0};
+
+        // Tell a missing file apart from a missing process
+        snprintf(path, sizeof(path) - 1, "/proc/%d", pid);
+        if (access(path, F_OK) == 0) {
+            s->source = MSTAT_SOURCE_SMAPS;
+            s->fd = mstat_sampler_open_smaps(s);
+        }
+    }
+    if (s->fd < 0) {
+        return -1;
+    }
+
+    s->size = BUFSIZ;
+    s->data = malloc(s->size);
+    if (!s->data) {
+        close(s->fd);
+        s->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read /proc/`pid`/smaps_rollup (or smaps) into the sampler buffer
+ * @param s pointer to sampler
+ * @return bytes read. 0 when the process has no address space. -1 on error
+ */
+static ssize_t mstat_sampler_fill(struct mstat_sampler_t *s) {
+    ssize_t len;
+
+    while ((len = pread(s->fd, s->data, s->size, 0)) == (ssize_t) s->size) {
+        // The buffer may have truncated the data. Grow it and read again.
+        char *tmp = realloc(s->data, s->size * 2);
+        if (!tmp) {
+            return -1;
+        }
+        s->data = tmp;
+        s->size *= 2;
+    }
+    return len;
+}
+
+/**
+ * Sample memory values of the process
+ *
+ * The kernel binds smaps_rollup to the address space present when it was
+ * opened, so after an exec() reads fail with ESRCH. The file is reopened
+ * once in that case; a process that is really gone fails again.
+ *
+ * @param s pointer to sampler
+ * @param p pointer to MSTAT record
+ * @return 0 on success. -1 on error (errno is ESRCH when the process has exited)
+ */
+int mstat_sampler_read(struct mstat_sampler_t *s, struct mstat_record_t *p) {
+    struct timespec t0, t1, t2;
+    ssize_t len;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    len = mstat_sampler_fill(s);
+    if (len <= 0 && (len == 0 || errno == ESRCH)) {
+        int fd;
+
+        fd = mstat_sampler_open_smaps(s);
+        if (fd < 0) {
+            errno = ESRCH;
+            return -1;
+        }
+        close(s->fd);
+        s->fd = fd;
+        len = mstat_sampler_fill(s);
+    }
+    if (len == 0) {
+        errno = ESRCH;
+        return -1;
+    }
+    if (len < 0) {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    mstat_parse_smaps(p, s->data, len);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    s->read_time = mstat_difftimespec_ns(t1, t0);
+    s->parse_time = mstat_difftimespec_ns(t2, t1);
+    return 0;
+}
+
+/**
+ * Consume the contents of /proc/`pid`/statm
+ * @param s pointer to sampler
+ * @param p pointer to MSTAT record (`rss` and `vm_size` are written)
+ * @param data statm text (NUL terminated)
+ * @return 0 on success. -1 on error (errno is ESRCH when the process has exited)
+ */
+int mstat_sampler_parse_statm(const struct mstat_sampler_t *s, struct mstat_record_t *p, const char *data) {
+    const char *pos;
+    size_t value[2] = {0};
+
+    // Format: size resident shared text lib data dt (in pages)
+    pos = data;
+    for (size_t i = 0; i < sizeof(value) / sizeof(*value); i++) {
+        while (*pos == ' ') {
+            pos++;
+        }
+        while ((unsigned) (*pos - '0') < 10) {
+            value[i] = value[i] * 10 + (size_t) (*pos - '0');
+            pos++;
+        }
+    }
+    if (!value[0]) {
+        // Exited processes report an empty address space
+        errno = ESRCH;
+        return -1;
+    }
+
+    p->vm_size = value[0] * s->page_size;
+    p->rss = value[1] * s->page_size;
+    return 0;
+}
+
+/**
+ * Sample RSS and VM size of the process from /proc/`pid`/statm
+ *
+ * statm is computed from counters the kernel already maintains, so it is
+ * cheap enough to read between full smaps_rollup samples. Only `rss` and
+ * `vm_size` are written to the record.
+ *
+ * @param s pointer to sampler
+ * @param p pointer to MSTAT record
+ * @return 0 on success. -1 on error (errno is ESRCH when the process has exited)
+ */
+int mstat_sampler_probe(struct mstat_sampler_t *s, struct mstat_record_t *p) {
+    char data[255] = {0};
+    struct timespec t0, t1;
+    ssize_t len;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (s->fd_statm < 0) {
+        char path[PATH_MAX] = {0};
+        snprintf(path, sizeof(path) - 1, "/proc/%d/statm", s->pid);
+        s->fd_statm = open(path, O_RDONLY | O_CLOEXEC);
+        if (s->fd_statm < 0) {
+            return -1;
+        }
+    }
+
+    len = pread(s->fd_statm, data, sizeof(data) - 1, 0);
+    if (len < 0) {
+        return -1;
+    }
+    if (mstat_sampler_parse_statm(s, p, data) < 0) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    s->probe_time = mstat_difftimespec_ns(t1, t0);
+    return 0;
+}
+
+/**
+ * Release resources held by a sampler
+ * @param s pointer to sampler
+ */
+void mstat_sampler_close(struct mstat_sampler_t *s) {
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    if (s->fd_statm >= 0) {
+        close(s->fd_statm);
+    }
+    free(s->data);
+    s->data = NULL;
+    s->size = 0;
+    s->fd = -1;
+    s->fd_statm = -1;
+}
+
+/**
+ * Complete a statm probe record with the values of the last full sample
+ *
+ * Fields statm does not provide keep their last known value, so a series
+ * mixing both sources can be plotted without dropping to zero.
+ *
+ * @param p pointer to MSTAT record (modified when it is a statm probe)
+ * @param full pointer to the last smaps_rollup record
+ */
+void mstat_merge_probe(struct mstat_record_t *p, const struct mstat_record_t *full) {
+    struct mstat_record_t tmp;
+
+    if (p->source != MSTAT_SOURCE_STATM) {
+        return;
+    }
+    tmp = *full;
+    tmp.pid = p->pid;
+    tmp.timestamp = p->timestamp;
+    tmp.rss = p->rss;
+    tmp.vm_size = p->vm_size;
+    tmp.source = p->source;
+    tmp.rate = p->rate;
+    tmp.start_time = p->start_time;
+    tmp.psi_some = p->psi_some;
+    tmp.psi_full = p->psi_full;
+    tmp.psi_some_total = p->psi_some_total;
+    tmp.psi_full_total = p->psi_full_total;
+    *p = tmp;
+}
+
+/**
+ * Add the memory values of a process to a total
+ *
+ * Fields read from smaps_rollup and the VM size are summed. PSS splits
+ * shared pages between the processes mapping them, so the PSS of a group
+ * of processes is the sum of their PSS. RSS counts shared pages in every
+ * process.
+ *
+ * @param total pointer to MSTAT record (modified)
+ * @param p pointer to MSTAT record to add
+ */
+void mstat_record_add(struct mstat_record_t *total, const struct mstat_record_t *p) {
+#define MSTAT_X(id, name, ctype, key, type) \
+    if (key) { \
+        total->name += p->name; \
+    }
+    MSTAT_SCHEMA(MSTAT_X)
+#undef MSTAT_X
+    total->vm_size += p->vm_size;
+}
+
+/**
+ * Sample memory values of a process once
+ * @param p pointer to MSTAT record
+ * @param pid of target process
+ * @return 0 on success, -1 on error
+ */
+int mstat_attach(struct mstat_record_t *p, pid_t pid) {
+    struct mstat_sampler_t s;
+    int status;
+
+    if (mstat_sampler_open(&s, pid) < 0) {
+        return -1;
+    }
+    status = mstat_sampler_read(&s, p);
+    mstat_sampler_close(&s);
+    return status;
+}
+
+/**
+ * Return when a process started
+ *
+ * PIDs are reused, so the pid and the start time together identify a
+ * process over a long recording.
+ *
+ * @param pid of target process
+ * @return clock ticks since boot (field 22 of /proc/`pid`/stat). 0 on error
+ */
+size_t mstat_get_start_time(pid_t pid) {
+    char path[PATH_MAX] = {0};
+    char data[1024] = {0};
+    const char *pos;
+    size_t value = 0;
+    ssize_t len;
+    int fd;
+
+    snprintf(path, sizeof(path) - 1, "/proc/%d/stat", pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    len = read(fd, data, sizeof(data) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+
+    // The command name may hold spaces and parentheses. Fields resume after the last ')'.
+    pos = strrchr(data, ')');
+    if (!pos) {
+        return 0;
+    }
+    // Skip state (3) through delayacct/itrealvalue (21)
+    for (int field = 2; field < 22 && *pos; field++) {
+        pos = strchr(pos + 1, ' ');
+        if (!pos) {
+            return 0;
+        }
+    }
+    pos++;
+    while ((unsigned) (*pos - '0') < 10) {
+        value = value * 10 + (size_t) (*pos - '0');
+        pos++;
+    }
+    return value;
+}
+
+/**
+ * Return the storage type of a field
+ * @param id MSTAT_FIELD_* constant
+ * @return MSTAT_TYPE_* constant
+ */
+char mstat_get_field_type(unsigned id) {
+    return id < MSTAT_FIELD_MAX ? mstat_field_types[id] : MSTAT_TYPE_U64;
+}
+
+/**
+ * Write MSTAT header to data file
+ *
+ * HEADER FORMAT (version 2)
+ * 0x00 - 0x05 = file identifier (6 bytes)
+ * 0x06 - 0x07 = format version (2 bytes, 0 in version 1 files)
+ * 0x08 - 0x0B = total field records (4 bytes)
+ * 0x0C - 0x0F = EOH offset (4 bytes)
+ * 0x10 - 0x13 = record size (4 bytes)
+ * 0x14 - 0x17 = byte order mark, 0x01020304 (4 bytes)
+ * 0x18 - 0x1F = samples per second (double)
+ * 0x20 - 0x2F = wall clock start time, seconds and nanoseconds (2 x 8 bytes)
+ * 0x30 - 0x37 = total records, updated on flush and close (8 bytes)
+ * 0x38 - 0x3F = flags (8 bytes)
+ * 0x40 - EOH = field_length (unsigned int), field (string), type (char) (n... bytes),
+ *               zero padding to an 8-byte boundary
+ *
+ * Version 1 files store the fields from 0x10 without a type, and records
+ * with a 4-byte pid. Each version 2 record is one 8-byte slot per field.
+ *
+ * @param fp pointer to stream
+ * @return 0 on success, -1 on error
+ */
+int mstat_write_header(FILE *fp) {
+    return mstat_write_header_fields(fp, mstat_field_names, mstat_field_types);
+}
+
+/**
+ * Write MSTAT file header describing any record schema
+ *
+ * Every field takes one 8-byte slot. The first two fields must be an
+ * identifier and the timestamp (see MSTAT_CGROUP_SCHEMA). Anything the
+ * file held past the new header is discarded.
+ *
+ * @param fp pointer to stream
+ * @param names field names (NULL terminated)
+ * @param types storage type of each field (MSTAT_TYPE_*)
+ * @return 0 on success, -1 on error
+ */
+int mstat_write_header_fields(FILE *fp, char **names, const char *types) {
+    char buf[MSTAT_HEADER_SIZE] = {0};
+    unsigned short version = MSTAT_FORMAT_VERSION;
+    unsigned int record_size;
+    unsigned int byte_order = MSTAT_BOM;
+    int rec;
+    int fields_end;
+
+    for (rec = 0; names[rec] != NULL; rec++);
+    record_size = (unsigned int) (rec * sizeof(size_t));
+
+    memcpy(buf, mstat_magic_bytes, sizeof(mstat_magic_bytes));
+    memcpy(buf + MSTAT_VERSION_OFFSET, &version, sizeof(version));
+    memcpy(buf + MSTAT_RECORD_STRIDE, &record_size, sizeof(record_size));
+    memcpy(buf + MSTAT_BYTE_ORDER, &byte_order, sizeof(byte_order));
+    if (fseek(fp, 0, SEEK_SET) < 0 || !fwrite(buf, sizeof(buf), 1, fp)) {
+        return -1;
+    }
+
+    for (rec = 0; names[rec] != NULL; rec++) {
+        unsigned int len = strlen(names[rec]);
+        char type = types[rec];
+        fwrite(&len, sizeof(len), 1, fp);
+        fwrite(names[rec], sizeof(char), len, fp);
+        if (!fwrite(&type, sizeof(type), 1, fp)) {
+            return -1;
+        }
+    }
+    // Align records so mapped readers can load values directly
+    fields_end = (int) ftell(fp);
+    while (fields_end % sizeof(size_t)) {
+        fputc('\0', fp);
+        fields_end++;
+    }
+
+    fseek(fp, MSTAT_FIELD_COUNT, SEEK_SET);
+    fwrite(&rec, sizeof(rec), 1, fp);
+
+    fseek(fp, MSTAT_EOH, SEEK_SET);
+    fwrite(&fields_end, sizeof(fields_end), 1, fp);
+    fseek(fp, fields_end, SEEK_SET);
+    if (fflush(fp) || ftruncate(fileno(fp), fields_end) < 0) {
+        return -1;
+    }
+    mstat_stream_reset(fp);
+    return 0;
+}
+
+/**
+ * Store a value in the header of a MSTAT file being written
+ * @param fp pointer to MSTAT file stream
+ * @param offset header offset
+ * @param data value
+ * @param size size of value
+ * @return 0 on success. -1 on error
+ */
+static int mstat_set_header_value(FILE *fp, long offset, const void *data, size_t size) {
+    // Buffered records go first so the header never describes more than the file holds
+    if (fflush(fp)) {
+        return -1;
+    }
+    if (pwrite(fileno(fp), data, size, offset) != (ssize_t) size) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Record how and when sampling started in the header
+ * @param fp pointer to MSTAT file stream
+ * @param sample_rate samples per second
+ * @param start wall clock time of the first sample
+ * @return 0 on success. -1 on error
+ */
+int mstat_set_sample_info(FILE *fp, double sample_rate, const struct timespec *start) {
+    long long value[2] = {(long long) start->tv_sec, (long long) start->tv_nsec};
+    if (mstat_set_header_value(fp, MSTAT_SAMPLE_RATE, &sample_rate, sizeof(sample_rate)) < 0) {
+        return -1;
+    }
+    return mstat_set_header_value(fp, MSTAT_START_TIME, value, sizeof(value));
+}
+
+/**
+ * Record the number of records written in the header
+ * @param fp pointer to MSTAT file stream
+ * @param count total records
+ * @param flags MSTAT_FLAG_* bits (MSTAT_FLAG_CLOSED once no more records follow)
+ * @return 0 on success. -1 on error
+ */
+int mstat_set_record_count(FILE *fp, size_t count, unsigned long long flags) {
+    if (mstat_set_header_value(fp, MSTAT_RECORD_COUNT, &count, sizeof(count)) < 0) {
+        return -1;
+    }
+    return mstat_set_header_value(fp, MSTAT_FLAGS, &flags, sizeof(flags));
+}
+
+/**
+ * Serialize a MSTAT record in its on-disk layout
+ * @param buf destination (at least MSTAT_RECORD_SIZE bytes)
+ * @param record pointer to MSTAT record
+ * @return number of bytes written to buf
+ */
+size_t mstat_pack(char *buf, const struct mstat_record_t *record) {
+    // Narrower integers (the pid) are zero extended to a full slot
+    for (size_t i = 0; i < MSTAT_FIELD_MAX; i++) {
+        unsigned long long value;
+        memcpy(&value, (const char *) record + mstat_field_offsets[i], sizeof(value));
+        value &= mstat_field_masks[i];
+        memcpy(buf + i * sizeof(value), &value, sizeof(value));
+    }
+    return MSTAT_RECORD_SIZE;
+}
+
+/**
+ * Deserialize a MSTAT record from its on-disk layout
+ *
+ * Fields missing from older files are zero.
+ *
+ * @param record pointer to MSTAT record (modified)
+ * @param buf one record as stored in the file
+ * @param hdr pointer to header describing the file
+ */
+void mstat_unpack(struct mstat_record_t *record, const char *buf, const struct mstat_header_t *hdr) {
+    size_t fields = hdr->fields < MSTAT_FIELD_MAX ? (size_t) hdr->fields : MSTAT_FIELD_MAX;
+
+    memset(record, 0, sizeof(*record));
+    memcpy(&record->pid, buf, sizeof(record->pid));
+    // Version 1 stores a 4-byte pid, version 2 an 8-byte slot
+    buf += hdr->version < 2 ? sizeof(record->pid) : sizeof(size_t);
+    for (size_t i = MSTAT_FIELD_TIMESTAMP; i < fields; i++) {
+        memcpy((char *) record + mstat_field_offsets[i], buf, mstat_field_sizes[i]);
+        buf += sizeof(size_t);
+    }
+}
+
+/**
+ * Write a MSTAT record to data file
+ * @param fp pointer to MSTAT file stream
+ * @param record pointer to MSTAT record
+ * @return 0 on success. -1 on error
+ */
+int mstat_write(FILE *fp, struct mstat_record_t *record) {
+    char buf[MSTAT_RECORD_SIZE];
+    size_t len;
+
+    len = mstat_pack(buf, record);
+    if (!fwrite(buf, len, 1, fp)) return -1;
+    return 0;
+}
+
+/**
+ * Write a block of records in compressed form
+ *
+ * BLOCK FORMAT
+ * 0x00 - 0x03 = total records (4 bytes)
+ * 0x04 - 0x07 = payload size (4 bytes)
+ * 0x08 - ... = payload (see codec.c)
+ *
+ * @param fp pointer to MSTAT file stream
+ * @param records packed records (see mstat_pack)
+ * @param count number of records (at most MSTAT_CODEC_BLOCK)
+ * @param fields fields per record
+ * @param types storage type of each field (MSTAT_TYPE_*)
+ * @param scratch buffer of at least mstat_codec_bound(MSTAT_CODEC_BLOCK, fields) bytes
+ * @return 0 on success. -1 on error
+ */
+int mstat_write_block(FILE *fp, const char *records, size_t count, int fields, const char *types, char *scratch) {
+    unsigned int block[2];
+
+    block[0] = (unsigned int) count;
+    block[1] = (unsigned int) mstat_codec_encode(scratch, records, count, fields, MSTAT_FIELD_TIMESTAMP, types);
+    if (!fwrite(block, sizeof(block), 1, fp)) return -1;
+    if (block[1] && !fwrite(scratch, block[1], 1, fp)) return -1;
+    return 0;
+}
+
+/**
+ * Write the index of compressed blocks
+ *
+ * INDEX FORMAT
+ * 0x00 - ... = block offset (8 bytes), first record of block (8 bytes) (n... bytes)
+ * END - 0x18 = total entries (8 bytes)
+ * END - 0x10 = index offset (8 bytes)
+ * END - 0x08 = index identifier (8 bytes)
+ *
+ * @param fp pointer to MSTAT file stream (positioned after the last block)
+ * @param offsets pairs of block offset and first record, one per block
+ * @param count number of blocks
+ * @return 0 on success. -1 on error
+ */
+int mstat_write_index(FILE *fp, const size_t *offsets, size_t count) {
+    unsigned long long footer[2];
+    long offset;
+
+    offset = ftell(fp);
+    if (offset < 0) {
+        return -1;
+    }
+    footer[0] = count;
+    footer[1] = (unsigned long long) offset;
+    if (count && !fwrite(offsets, sizeof(*offsets) * 2, count, fp)) return -1;
+    if (!fwrite(footer, sizeof(footer), 1, fp)) return -1;
+    if (!fwrite(MSTAT_CODEC_INDEX_MAGIC, MSTAT_TRAILER_MAGIC_SIZE, 1, fp)) return -1;
+    return 0;
+}
+
+/**
+ * Compute difference between timespec structures
+ * @param end timespec
+ * @param start timespec
+ * @return seconds
+ */
+double mstat_difftimespec(const struct timespec end, const struct timespec start) {
+    return (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/**
+ * Compute difference between timespec structures
+ * @param end timespec
+ * @param start timespec
+ * @return nanoseconds (0 when end is before start)
+ */
+unsigned long long mstat_difftimespec_ns(const struct timespec end, const struct timespec start) {
+    long long ns = (long long) (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+    return ns > 0 ? (unsigned long long) ns : 0;
+}
+
+/**
+ * Add nanoseconds to a timespec
+ * @param ts pointer to timespec (modified)
+ * @param ns nanoseconds to add
+ */
+static void mstat_timespec_add(struct timespec *ts, long long ns) {
+    ns += ts->tv_nsec;
+    ts->tv_sec += (time_t) (ns / 1000000000LL);
+    ts->tv_nsec = (long) (ns % 1000000000LL);
+}
+
+/**
+ * Initialize a sample scheduler
+ *
+ * Deadlines are kept on an absolute grid (start + n * period) so the time
+ * spent sampling never accumulates into drift.
+ *
+ * @param s pointer to scheduler
+ * @param rate samples per second
+ */
+void mstat_sched_init(struct mstat_sched_t *s, double rate) {
+    memset(s, 0, sizeof(*s));
+    s->period = (long long) (1e9 / rate);
+    if (s->period < 1) {
+        s->period = 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &s->start);
+    s->deadline = s->start;
+}
+
+/**
+ * Move to the next deadline
+ *
+ * When a sample ran past one or more deadlines they are counted as missed
+ * and the scheduler resumes on the next deadline still in the future.
+ *
+ * @param s pointer to scheduler (deadline is the time to wake up)
+ */
+void mstat_sched_next(struct mstat_sched_t *s) {
+    struct timespec now;
+    double late;
+
+    mstat_timespec_add(&s->deadline, s->period);
+    s->ticks++;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    late = mstat_difftimespec(now, s->deadline);
+    if (late >= 0) {
+        long long skip = (long long) (late * 1e9) / s->period + 1;
+        s->overruns++;
+        s->missed += skip;
+        if (late > s->overrun_max) {
+            s->overrun_max = late;
+        }
+        mstat_timespec_add(&s->deadline, skip * s->period);
+    }
+}
+
+/**
+ * Sleep until the next deadline (see mstat_sched_next)
+ * @param s pointer to scheduler
+ * @return 0 on success. -1 on error
+ */
+int mstat_sched_wait(struct mstat_sched_t *s) {
+    struct timespec now;
+    int status;
+
+    mstat_sched_next(s);
+    while ((status = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &s->deadline, NULL)) == EINTR);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    s->wake_late = mstat_difftimespec_ns(now, s->deadline);
+    return status ? -1 : 0;
+}
+
+/**
+ * Change the rate of a scheduler
+ * The next deadline is one new period after the previous one.
+ * @param s pointer to scheduler
+ * @param rate deadlines per second
+ */
+void mstat_sched_set_rate(struct mstat_sched_t *s, double rate) {
+    s->period = (long long) (1e9 / rate);
+    if (s->period < 1) {
+        s->period = 1;
+    }
+}
+
+/**
+ * Prepare an adaptive sample rate
+ * The rate starts at the floor.
+ * @param a pointer to adaptive rate (modified)
+ * @param low lowest rate (samples per second)
+ * @param high highest rate (samples per second)
+ * @param threshold change of RSS or PSS that raises the rate (kB per second)
+ */
+void mstat_adapt_init(struct mstat_adapt_t *a, double low, double high, double threshold) {
+    memset(a, 0, sizeof(*a));
+    a->floor = low;
+    a->ceiling = high;
+    a->threshold = threshold;
+    a->rate = low;
+}
+
+/**
+ * Update an adaptive sample rate with a new record
+ *
+ * RSS is compared with the previous record. PSS is compared with the
+ * previous full sample, because statm probes do not read it.
+ *
+ * @param a pointer to adaptive rate (modified)
+ * @param p pointer to MSTAT record
+ * @return 1 when the rate changed. 0 if not
+ */
+int mstat_adapt_update(struct mstat_adapt_t *a, const struct mstat_record_t *p) {
+    double speed = 0.0;
+    double rate = a->rate;
+
+    if (a->primed && p->timestamp > a->last_time) {
+        speed = fabs((double) p->rss - (double) a->last_rss) / (p->timestamp - a->last_time);
+    }
+    a->last_time = p->timestamp;
+    a->last_rss = p->rss;
+    a->primed = 1;
+
+    if (p->source != MSTAT_SOURCE_STATM) {
+        if (a->primed_full && p->timestamp > a->last_full_time) {
+            double pss = fabs((double) p->pss - (double) a->last_pss) / (p->timestamp - a->last_full_time);
+            if (pss > speed) {
+                speed = pss;
+            }
+        }
+        a->last_full_time = p->timestamp;
+        a->last_pss = p->pss;
+        a->primed_full = 1;
+    }
+
+    if (speed >= a->threshold) {
+        a->quiet = 0;
+        if (rate < a->ceiling) {
+            a->bursts++;
+        }
+        rate = a->ceiling;
+    } else if (++a->quiet >= MSTAT_ADAPT_HOLD) {
+        a->quiet = 0;
+        rate /= 2;
+        if (rate < a->floor) {
+            rate = a->floor;
+        }
+    }
+
+    if (rate == a->rate) {
+        return 0;
+    }
+    a->rate = rate;
+    return 1;
+}
+
+/**
+ * Prepare a duty cycle limit
+ * @param t pointer to throttle (modified)
+ * @param budget largest fraction of wall time spent reading (0.0 - 1.0)
+ */
+void mstat_throttle_init(struct mstat_throttle_t *t, double budget) {
+    memset(t, 0, sizeof(*t));
+    t->budget = budget;
+    t->limit = HUGE_VAL;
+}
+
+/**
+ * Update a duty cycle limit with the duration of a read
+ * @param t pointer to throttle (modified)
+ * @param seconds duration of the read
+ * @return highest sample rate within budget (samples per second)
+ */
+double mstat_throttle_update(struct mstat_throttle_t *t, double seconds) {
+    if (!t->reads++) {
+        t->read_time = seconds;
+    } else {
+        t->read_time += (seconds - t->read_time) * MSTAT_THROTTLE_WEIGHT;
+    }
+    t->limit = t->read_time > 0 ? t->budget / t->read_time : HUGE_VAL;
+    return t->limit;
+}
+
+/**
+ * Append a trailer of named values to MSTAT file
+ *
+ * TRAILER FORMAT
+ * 0x00 - 0x07 = trailer identifier (8 bytes)
+ * 0x08 - 0x0B = total values (4 bytes)
+ * 0x0C - ... = key_length (unsigned int), key (string), value (double) (n... bytes)
+ * EOF - 0x10 = trailer offset (8 bytes)
+ * EOF - 0x08 = end of trailer identifier (8 bytes)
+ *
+ * @param fp pointer to MSTAT file stream (positioned after the last record)
+ * @param keys array of value names
+ * @param values array of values
+ * @param count number of keys and values
+ * @return 0 on success. -1 on error
+ */
+int mstat_write_trailer(FILE *fp, char **keys, const double *values, size_t count) {
+    long long offset;
+    unsigned int total;
+
+    offset = ftell(fp);
+    if (offset < 0) {
+        return -1;
+    }
+    total = (unsigned int) count;
+    if (!fwrite(MSTAT_TRAILER_MAGIC, MSTAT_TRAILER_MAGIC_SIZE, 1, fp)) return -1;
+    if (!fwrite(&total, sizeof(total), 1, fp)) return -1;
+    for (size_t i = 0; i < count; i++) {
+        unsigned int len = strlen(keys[i]);
+        if (!fwrite(&len, sizeof(len), 1, fp)) return -1;
+        if (!fwrite(keys[i], sizeof(char), len, fp)) return -1;
+        if (!fwrite(&values[i], sizeof(values[i]), 1, fp)) return -1;
+    }
+    if (!fwrite(&offset, sizeof(offset), 1, fp)) return -1;
+    if (!fwrite(MSTAT_TRAILER_END, MSTAT_TRAILER_MAGIC_SIZE, 1, fp)) return -1;
+    return 0;
+}
+
+/**
+ * Read the trailer of a MSTAT file
+ * @param fp pointer to MSTAT file stream
+ * @param keys pointer to array of value names (allocated, caller frees each element and the array)
+ * @param values pointer to array of values (allocated, caller frees)
+ * @return number of values on success. -1 when the file has no trailer, or on error
+ */
+int mstat_read_trailer(FILE *fp, char ***keys, double **values) {
+    char magic[MSTAT_TRAILER_MAGIC_SIZE];
+    long long offset;
+    unsigned int total;
+    ssize_t pos;
+
+    *keys = NULL;
+    *values = NULL;
+    pos = ftell(fp);
+    if (pos < 0) {
+        return -1;
+    }
+    if (fseek(fp, -(long) (sizeof(offset) + sizeof(magic)), SEEK_END) < 0
+        || !fread(&offset, sizeof(offset), 1, fp)
+        || !fread(magic, sizeof(magic), 1, fp)
+        || memcmp(magic, MSTAT_TRAILER_END, sizeof(magic)) != 0
+        || fseek(fp, offset, SEEK_SET) < 0
+        || !fread(magic, sizeof(magic), 1, fp)
+        || memcmp(magic, MSTAT_TRAILER_MAGIC, sizeof(magic)) != 0
+        || !fread(&total, sizeof(total), 1, fp)) {
+        fseek(fp, pos, SEEK_SET);
+        return -1;
+    }
+
+    *keys = calloc(total + 1, sizeof(**keys));
+    *values = calloc(total + 1, sizeof(**values));
+    if (!*keys || !*values) {
+        perror("Unable to allocate memory for trailer");
+        free(*keys);
+        free(*values);
+        fseek(fp, pos, SEEK_SET);
+        return -1;
+    }
+    for (unsigned int i = 0; i < total; i++) {
+        char buf[255] = {0};
+        unsigned int len = 0;
+        if (!fread(&len, sizeof(len), 1, fp) || len >= sizeof(buf)
+            || (len && !fread(buf, len, 1, fp))
+            || !fread(&(*values)[i], sizeof(**values), 1, fp)) {
+            total = i;
+            break;
+        }
+        (*keys)[i] = strdup(buf);
+    }
+    fseek(fp, pos, SEEK_SET);
+    return (int) total;
+}
+
+/**
+ * Determine whether statm probes sample a field
+ * Probes only read rss and vm_size, and the sample loop records the rate,
+ * start time and memory pressure of every record. Other fields of a probe
+ * record hold the value of the last full sample (see mstat_merge_probe).
+ * @param id field id (MSTAT_FIELD_*)
+ * @return 1 if probes sample the field. 0 if not
+ */
+int mstat_field_is_probed(int id) {
+    return id == MSTAT_FIELD_PID || id == MSTAT_FIELD_TIMESTAMP || id == MSTAT_FIELD_RSS
+           || id == MSTAT_FIELD_VM_SIZE || id == MSTAT_FIELD_SOURCE || id == MSTAT_FIELD_RATE
+           || id == MSTAT_FIELD_START_TIME || id == MSTAT_FIELD_PSI_SOME || id == MSTAT_FIELD_PSI_FULL
+           || id == MSTAT_FIELD_PSI_SOME_TOTAL || id == MSTAT_FIELD_PSI_FULL_TOTAL;
+}
+
+/**
+ * Prepare empty statistics
+ * @param s pointer to statistics (modified)
+ * @param threshold time is counted while values are above this (HUGE_VAL = never)
+ * @return 0 on success. -1 on error
+ */
+int mstat_stats_init(struct mstat_stats_t *s, double threshold) {
+    memset(s, 0, sizeof(*s));
+    s->min = HUGE_VAL;
+    s->max = -HUGE_VAL;
+    s->threshold = threshold;
+    return mstat_hist_init(&s->hist);
+}
+
+/**
+ * Compute the min, max and sum of an array
+ * Four independent accumulators keep the loop free of dependencies
+ * between iterations, so it vectorizes.
+ * @param a input data
+ * @param size size of input data
+ * @param min pointer to return variable (modified)
+ * @param max pointer to return variable (modified)
+ * @param sum pointer to return variable (modified)
+ */
+static void mstat_block_summary(const double *a, size_t size, double *min, double *max, double *sum) {
+    double lo[4] = {HUGE_VAL, HUGE_VAL, HUGE_VAL, HUGE_VAL};
+    double hi[4] = {-HUGE_VAL, -HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+    double total[4] = {0.0, 0.0, 0.0, 0.0};
+    size_t i;
+
+    for (i = 0; i + 4 <= size; i += 4) {
+        for (size_t lane = 0; lane < 4; lane++) {
+            double v = a[i + lane];
+            lo[lane] = v < lo[lane] ? v : lo[lane];
+            hi[lane] = v > hi[lane] ? v : hi[lane];
+            total[lane] += v;
+        }
+    }
+    for (; i < size; i++) {
+        lo[0] = a[i] < lo[0] ? a[i] : lo[0];
+        hi[0] = a[i] > hi[0] ? a[i] : hi[0];
+        total[0] += a[i];
+    }
+    for (size_t lane = 1; lane < 4; lane++) {
+        lo[0] = lo[lane] < lo[0] ? lo[lane] : lo[0];
+        hi[0] = hi[lane] > hi[0] ? hi[lane] : hi[0];
+    }
+    *min = lo[0];
+    *max = hi[0];
+    *sum = (total[0] + total[1]) + (total[2] + total[3]);
+}
+
+/**
+ * Return the time spent above a threshold
+ * A value holds until the timestamp of the next one.
+ * @param values input data
+ * @param timestamps time of each value (seconds)
+ * @param size size of input data
+ * @param threshold threshold
+ * @return seconds
+ */
+static double mstat_block_above(const double *values, const double *timestamps, size_t size, double threshold) {
+    double total = 0.0;
+    for (size_t i = 1; i < size; i++) {
+        total += values[i - 1] > threshold ? timestamps[i] - timestamps[i - 1] : 0.0;
+    }
+    return total;
+}
+
+/**
+ * Add values to statistics
+ * @param s pointer to statistics (modified)
+ * @param values input data (non-negative)
+ * @param timestamps time of each value (seconds, ascending)
+ * @param count size of input data
+ */
+void mstat_stats_add(struct mstat_stats_t *s, const double *values, const double *timestamps, size_t count) {
+    double min, max, sum;
+
+    if (!count) {
+        return;
+    }
+    mstat_block_summary(values, count, &min, &max, &sum);
+    if (min < s->min) {
+        s->min = min;
+    }
+    if (max > s->max) {
+        s->max = max;
+    }
+    s->sum += sum;
+
+    for (size_t i = 0; i < count; i++) {
+        mstat_hist_add(&s->hist, values[i] > 0.0 ? (unsigned long long) values[i] : 0);
+    }
+
+    // Close the interval left open by the previous block
+    if (s->count) {
+        double dt = timestamps[0] - s->last_time;
+        s->duration += dt;
+        if (s->last_value > s->threshold) {
+            s->above += dt;
+        }
+    }
+    s->duration += timestamps[count - 1] - timestamps[0];
+    s->above += mstat_block_above(values, timestamps, count, s->threshold);
+    s->last_value = values[count - 1];
+    s->last_time = timestamps[count - 1];
+    s->count += count;
+}
+
+/**
+ * Add statistics to other statistics
+ * The durations of separate recordings are added together.
+ * @param dest pointer to statistics (modified)
+ * @param src pointer to statistics
+ * @return 0 on success. -1 if the thresholds differ
+ */
+int mstat_stats_merge(struct mstat_stats_t *dest, const struct mstat_stats_t *src) {
+    if (dest->threshold != src->threshold) {
+        return -1;
+    }
+    if (src->min < dest->min) {
+        dest->min = src->min;
+    }
+    if (src->max > dest->max) {
+        dest->max = src->max;
+    }
+    dest->sum += src->sum;
+    dest->duration += src->duration;
+    dest->above += src->above;
+    dest->count += src->count;
+    mstat_hist_merge(&dest->hist, &src->hist);
+    return 0;
+}
+
+/**
+ * Return a quantile
+ * @param s pointer to statistics
+ * @param q quantile (0.0 - 1.0)
+ * @return value (0 when empty)
+ */
+double mstat_stats_quantile(const struct mstat_stats_t *s, double q) {
+    double value;
+
+    if (!s->count) {
+        return 0.0;
+    }
+    value = (double) mstat_hist_quantile(&s->hist, q);
+    // The bucket may reach past the values actually seen
+    if (value < s->min) {
+        value = s->min;
+    }
+    if (value > s->max) {
+        value = s->max;
+    }
+    return value;
+}
+
+/**
+ * Add every value of a field in a mapped file to statistics
+ * Fields not sampled by statm probes hold the value of the last full
+ * sample on probe records.
+ * @param map pointer to map
+ * @param field index of field (see mstat_map_find_field)
+ * @param s pointer to statistics (modified)
+ * @return 0 on success. -1 on error
+ */
+int mstat_stats_map(const struct mstat_map_t *map, int field, struct mstat_stats_t *s) {
+    double values[MSTAT_STATS_BLOCK];
+    double timestamps[MSTAT_STATS_BLOCK];
+    double sources[MSTAT_STATS_BLOCK];
+    int timestamp_field;
+    int source_field;
+    int hold;
+    double held = 0.0;
+
+    if (field < 0 || field >= map->hdr.fields) {
+        return -1;
+    }
+    timestamp_field = mstat_map_find_field(map, "timestamp");
+    if (timestamp_field < 0) {
+        return -1;
+    }
+    source_field = mstat_map_find_field(map, "source");
+    hold = source_field >= 0 && !mstat_field_is_probed(mstat_get_field_id(map->fields[field]));
+
+    for (size_t first = 0; first < map->hdr.records; first += MSTAT_STATS_BLOCK) {
+        size_t count = mstat_map_gather(map, field, first, MSTAT_STATS_BLOCK, values);
+        mstat_map_gather(map, timestamp_field, first, count, timestamps);
+        if (hold) {
+            mstat_map_gather(map, source_field, first, count, sources);
+            for (size_t i = 0; i < count; i++) {
+                if (sources[i] == MSTAT_SOURCE_STATM) {
+                    values[i] = held;
+                } else {
+                    held = values[i];
+                }
+            }
+        }
+        mstat_stats_add(s, values, timestamps, count);
+    }
+    return 0;
+}
+
+/**
+ * Release resources held by statistics
+ * @param s pointer to statistics
+ */
+void mstat_stats_free(struct mstat_stats_t *s) {
+    mstat_hist_free(&s->hist);
+}
+
+/**
+ * Write statistics to a summary file
+ *
+ * 0x00 - 0x08 = MSTAT_SUMMARY_MAGIC (8 bytes)
+ * 0x08 - 0x0C = version (unsigned int)
+ * 0x0C - 0x10 = byte order (unsigned int)
+ * 0x10 - 0x14 = number of entries (unsigned int)
+ * 0x14 - ...  = name_length (unsigned int), name (string), count (8 bytes),
+ *               min, max, sum, threshold, duration, above (double),
+ *               histogram (see mstat_hist_write) (n... bytes)
+ *
+ * @param fp pointer to stream
+ * @param names array of field names
+ * @param stats array of statistics
+ * @param count number of names and statistics
+ * @return 0 on success. -1 on error
+ */
+int mstat_write_summary(FILE *fp, char **names, const struct mstat_stats_t *stats, size_t count) {
+    unsigned int version = MSTAT_SUMMARY_VERSION;
+    unsigned int byte_order = MSTAT_BOM;
+    unsigned int total = (unsigned int) count;
+
+    if (!fwrite(MSTAT_SUMMARY_MAGIC, MSTAT_SUMMARY_MAGIC_SIZE, 1, fp)) return -1;
+    if (!fwrite(&version, sizeof(version), 1, fp)) return -1;
+    if (!fwrite(&byte_order, sizeof(byte_order), 1, fp)) return -1;
+    if (!fwrite(&total, sizeof(total), 1, fp)) return -1;
+    for (size_t i = 0; i < count; i++) {
+        const struct mstat_stats_t *s = &stats[i];
+        unsigned int len = strlen(names[i]);
+        unsigned long long values = s->count;
+        double numbers[] = {s->min, s->max, s->sum, s->threshold, s->duration, s->above};
+        if (!fwrite(&len, sizeof(len), 1, fp)) return -1;
+        if (!fwrite(names[i], sizeof(char), len, fp)) return -1;
+        if (!fwrite(&values, sizeof(values), 1, fp)) return -1;
+        if (!fwrite(numbers, sizeof(numbers), 1, fp)) return -1;
+        if (mstat_hist_write(fp, &s->hist) < 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read one entry of a summary file
+ * @param fp pointer to stream
+ * @param name pointer to field name (allocated)
+ * @param s pointer to statistics (initialized)
+ * @return 0 on success. -1 on error
+ */
+static int mstat_read_summary_entry(FILE *fp, char **name, struct mstat_stats_t *s) {
+    unsigned int len;
+    unsigned long long values;
+    double numbers[6];
+
+    if (!fread(&len, sizeof(len), 1, fp) || len > PATH_MAX) {
+        return -1;
+    }
+    *name = calloc(len + 1, sizeof(char));
+    if (!*name || (len && !fread(*name, len, 1, fp))) {
+        return -1;
+    }
+    if (!fread(&values, sizeof(values), 1, fp) || !fread(numbers, sizeof(numbers), 1, fp)) {
+        return -1;
+    }
+    if (mstat_stats_init(s, numbers[3]) < 0) {
+        return -1;
+    }
+    s->count = values;
+    s->min = numbers[0];
+    s->max = numbers[1];
+    s->sum = numbers[2];
+    s->duration = numbers[4];
+    s->above = numbers[5];
+    return mstat_hist_read(fp, &s->hist);
+}
+
+/**
+ * Read a summary file written by mstat_write_summary
+ * @param fp pointer to stream
+ * @param names pointer to array of field names (allocated, caller frees each element and the array)
+ * @param stats pointer to array of statistics (allocated, caller frees each with mstat_stats_free, and the array)
+ * @return number of entries on success. -1 on error
+ */
+int mstat_read_summary(FILE *fp, char ***names, struct mstat_stats_t **stats) {
+    char magic[MSTAT_SUMMARY_MAGIC_SIZE];
+    unsigned int version;
+    unsigned int byte_order;
+    unsigned int total;
+
+    *names = NULL;
+    *stats = NULL;
+    if (!fread(magic, sizeof(magic), 1, fp)
+        || memcmp(magic, MSTAT_SUMMARY_MAGIC, sizeof(magic)) != 0
+        || !fread(&version, sizeof(version), 1, fp)
+        || version != MSTAT_SUMMARY_VERSION
+        || !fread(&byte_order, sizeof(byte_order), 1, fp)
+        || byte_order != MSTAT_BOM
+        || !fread(&total, sizeof(total), 1, fp)
+        || total > MSTAT_FIELD_MAX * 0x100) {
+        return -1;
+    }
+
+    *names = calloc(total + 1, sizeof(**names));
+    *stats = calloc(total + 1, sizeof(**stats));
+    if (!*names || !*stats) {
+        free(*names);
+        free(*stats);
+        *names = NULL;
+        *stats = NULL;
+        return -1;
+    }
+    for (unsigned int i = 0; i < total; i++) {
+        if (mstat_read_summary_entry(fp, &(*names)[i], &(*stats)[i]) < 0) {
+            for (unsigned int x = 0; x <= i; x++) {
+                mstat_stats_free(&(*stats)[x]);
+                free((*names)[x]);
+            }
+            free(*names);
+            free(*stats);
+            *names = NULL;
+            *stats = NULL;
+            return -1;
+        }
+    }
+    return (int) total;
+}
+
+/**
+ * Watch a file for changes made by its writer
+ * @param filename path to file
+ * @return inotify descriptor on success. -1 on error
+ */
+int mstat_watch_open(const char *filename) {
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (inotify_add_watch(fd, filename, IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Wait until a watched file changes
+ * All pending events are consumed, so a burst of writes wakes the caller once.
+ * @param fd inotify descriptor (see mstat_watch_open)
+ * @return 1 when the file was written to. 0 when it was removed or renamed. -1 on error (errno is set)
+ */
+int mstat_watch_wait(int fd) {
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    len = read(fd, buf, sizeof(buf));
+    if (len <= 0) {
+        return -1;
+    }
+    for (const char *pos = buf; pos < buf + len;) {
+        const struct inotify_event *event = (const struct inotify_event *) pos;
+        if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+            return 0;
+        }
+        pos += sizeof(*event) + event->len;
+    }
+    return 1;
 }
 
 /**
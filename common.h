@@ -7,60 +7,352 @@
 #include <unistd.h>
 #include <limits.h>
 #include <time.h>
+#include <sys/types.h>
+#include "hist.h"
 
 #define MSTAT_MAGIC "MSTAT"
+#define MSTAT_VERSION_OFFSET 0x06
 #define MSTAT_FIELD_COUNT 0x08
 #define MSTAT_EOH 0x0C
 #define MSTAT_MAGIC_SIZE 0x10
+#define MSTAT_RECORD_STRIDE 0x10
+#define MSTAT_BYTE_ORDER 0x14
+#define MSTAT_SAMPLE_RATE 0x18
+#define MSTAT_START_TIME 0x20
+#define MSTAT_RECORD_COUNT 0x30
+#define MSTAT_FLAGS 0x38
+#define MSTAT_HEADER_SIZE 0x40
+#define MSTAT_FORMAT_VERSION 2
+#define MSTAT_BOM 0x01020304
+#define MSTAT_FLAG_CLOSED 0x01
+#define MSTAT_FLAG_COMPRESSED 0x02
+#define MSTAT_TYPE_U64 'u'
+#define MSTAT_TYPE_F64 'f'
+#define MSTAT_TRAILER_MAGIC "MSTATTRL"
+#define MSTAT_TRAILER_END "MSTATEOF"
+#define MSTAT_TRAILER_MAGIC_SIZE 0x08
+#define MSTAT_SUMMARY_MAGIC "MSTATSUM"
+#define MSTAT_SUMMARY_MAGIC_SIZE 0x08
+#define MSTAT_SUMMARY_VERSION 1
+// Values processed at a time by the statistics kernels
+#define MSTAT_STATS_BLOCK 0x400
+// One 8-byte slot per field
+#define MSTAT_RECORD_SIZE (MSTAT_FIELD_MAX * sizeof(size_t))
+#define MSTAT_CGROUP_RECORD_SIZE (MSTAT_CGROUP_FIELD_MAX * sizeof(size_t))
+
+/*
+ * Record schema. One line per field:
+ *
+ *   X(ID, name, C type, smaps_rollup key (NULL = not read from smaps_rollup), MSTAT_TYPE_*)
+ *
+ * The record structure, the MSTAT_FIELD_* ids, the field names written
+ * to file headers and the smaps_rollup parser are generated from this
+ * list. Files store fields in this order, so new fields are appended.
+ */
+#define MSTAT_SCHEMA(X) \
+    X(PID, pid, pid_t, NULL, MSTAT_TYPE_U64) \
+    X(TIMESTAMP, timestamp, double, NULL, MSTAT_TYPE_F64) \
+    X(RSS, rss, size_t, "Rss", MSTAT_TYPE_U64) \
+    X(PSS, pss, size_t, "Pss", MSTAT_TYPE_U64) \
+    X(PSS_ANON, pss_anon, size_t, "Pss_Anon", MSTAT_TYPE_U64) \
+    X(PSS_FILE, pss_file, size_t, "Pss_File", MSTAT_TYPE_U64) \
+    X(PSS_SHMEM, pss_shmem, size_t, "Pss_Shmem", MSTAT_TYPE_U64) \
+    X(SHARED_CLEAN, shared_clean, size_t, "Shared_Clean", MSTAT_TYPE_U64) \
+    X(SHARED_DIRTY, shared_dirty, size_t, "Shared_Dirty", MSTAT_TYPE_U64) \
+    X(PRIVATE_CLEAN, private_clean, size_t, "Private_Clean", MSTAT_TYPE_U64) \
+    X(PRIVATE_DIRTY, private_dirty, size_t, "Private_Dirty", MSTAT_TYPE_U64) \
+    X(REFERENCED, referenced, size_t, "Referenced", MSTAT_TYPE_U64) \
+    X(ANONYMOUS, anonymous, size_t, "Anonymous", MSTAT_TYPE_U64) \
+    X(LAZY_FREE, lazy_free, size_t, "LazyFree", MSTAT_TYPE_U64) \
+    X(ANON_HUGE_PAGES, anon_huge_pages, size_t, "AnonHugePages", MSTAT_TYPE_U64) \
+    X(SHMEM_PMD_MAPPED, shmem_pmd_mapped, size_t, "ShmemPmdMapped", MSTAT_TYPE_U64) \
+    X(FILE_PMD_MAPPED, file_pmd_mapped, size_t, "FilePmdMapped", MSTAT_TYPE_U64) \
+    X(SHARED_HUGETLB, shared_hugetlb, size_t, "Shared_Hugetlb", MSTAT_TYPE_U64) \
+    X(PRIVATE_HUGETLB, private_hugetlb, size_t, "Private_Hugetlb", MSTAT_TYPE_U64) \
+    X(SWAP, swap, size_t, "Swap", MSTAT_TYPE_U64) \
+    X(SWAP_PSS, swap_pss, size_t, "SwapPss", MSTAT_TYPE_U64) \
+    X(LOCKED, locked, size_t, "Locked", MSTAT_TYPE_U64) \
+    X(VM_SIZE, vm_size, size_t, NULL, MSTAT_TYPE_U64) \
+    X(SOURCE, source, size_t, NULL, MSTAT_TYPE_U64) \
+    X(RATE, rate, double, NULL, MSTAT_TYPE_F64) \
+    X(START_TIME, start_time, size_t, NULL, MSTAT_TYPE_U64) \
+    X(PSI_SOME, psi_some, double, NULL, MSTAT_TYPE_F64) \
+    X(PSI_FULL, psi_full, double, NULL, MSTAT_TYPE_F64) \
+    X(PSI_SOME_TOTAL, psi_some_total, size_t, NULL, MSTAT_TYPE_U64) \
+    X(PSI_FULL_TOTAL, psi_full_total, size_t, NULL, MSTAT_TYPE_U64)
 
 struct mstat_record_t {
-    pid_t pid;
-    double timestamp;
-    size_t rss,
-            pss,
-            pss_anon,
-            pss_file,
-            pss_shmem,
-            shared_clean,
-            shared_dirty,
-            private_clean,
-            private_dirty,
-            referenced,
-            anonymous,
-            lazy_free,
-            anon_huge_pages,
-            shmem_pmd_mapped,
-            file_pmd_mapped,
-            shared_hugetlb,
-            private_hugetlb,
-            swap,
-            swap_pss,
-            locked;
+#define MSTAT_X(id, name, ctype, key, type) ctype name;
+    MSTAT_SCHEMA(MSTAT_X)
+#undef MSTAT_X
+};
+
+/*
+ * Cgroup record schema (mstat -g). One line per field:
+ *
+ *   X(ID, name, C type, MSTAT_CGROUP_FILE_*, key in that file (NULL = whole file), MSTAT_TYPE_*)
+ *
+ * Like process records, cgroup records start with an identifier (the
+ * inode of the cgroup directory) and the timestamp, so readers, the
+ * codec and the tools handle both. Sizes are in kB, events are counts.
+ * The psi_* fields hold memory pressure, as in process records (psi.h).
+ */
+#define MSTAT_CGROUP_SCHEMA(X) \
+    X(ID, id, size_t, MSTAT_CGROUP_FILE_NONE, NULL, MSTAT_TYPE_U64) \
+    X(TIMESTAMP, timestamp, double, MSTAT_CGROUP_FILE_NONE, NULL, MSTAT_TYPE_F64) \
+    X(CURRENT, current, size_t, MSTAT_CGROUP_FILE_CURRENT, NULL, MSTAT_TYPE_U64) \
+    X(ANON, anon, size_t, MSTAT_CGROUP_FILE_STAT, "anon", MSTAT_TYPE_U64) \
+    X(FILE, file, size_t, MSTAT_CGROUP_FILE_STAT, "file", MSTAT_TYPE_U64) \
+    X(KERNEL, kernel, size_t, MSTAT_CGROUP_FILE_STAT, "kernel", MSTAT_TYPE_U64) \
+    X(SOCK, sock, size_t, MSTAT_CGROUP_FILE_STAT, "sock", MSTAT_TYPE_U64) \
+    X(SHMEM, shmem, size_t, MSTAT_CGROUP_FILE_STAT, "shmem", MSTAT_TYPE_U64) \
+    X(SLAB, slab, size_t, MSTAT_CGROUP_FILE_STAT, "slab", MSTAT_TYPE_U64) \
+    X(EVENTS_LOW, events_low, size_t, MSTAT_CGROUP_FILE_EVENTS, "low", MSTAT_TYPE_U64) \
+    X(EVENTS_HIGH, events_high, size_t, MSTAT_CGROUP_FILE_EVENTS, "high", MSTAT_TYPE_U64) \
+    X(EVENTS_MAX, events_max, size_t, MSTAT_CGROUP_FILE_EVENTS, "max", MSTAT_TYPE_U64) \
+    X(EVENTS_OOM, events_oom, size_t, MSTAT_CGROUP_FILE_EVENTS, "oom", MSTAT_TYPE_U64) \
+    X(EVENTS_OOM_KILL, events_oom_kill, size_t, MSTAT_CGROUP_FILE_EVENTS, "oom_kill", MSTAT_TYPE_U64) \
+    X(RATE, rate, double, MSTAT_CGROUP_FILE_NONE, NULL, MSTAT_TYPE_F64) \
+    X(PSI_SOME, psi_some, double, MSTAT_CGROUP_FILE_NONE, NULL, MSTAT_TYPE_F64) \
+    X(PSI_FULL, psi_full, double, MSTAT_CGROUP_FILE_NONE, NULL, MSTAT_TYPE_F64) \
+    X(PSI_SOME_TOTAL, psi_some_total, size_t, MSTAT_CGROUP_FILE_NONE, NULL, MSTAT_TYPE_U64) \
+    X(PSI_FULL_TOTAL, psi_full_total, size_t, MSTAT_CGROUP_FILE_NONE, NULL, MSTAT_TYPE_U64)
+
+// Every field is one 8-byte slot, so a cgroup record is stored as it is
+struct mstat_cgroup_record_t {
+#define MSTAT_X(id, name, ctype, file, key, type) ctype name;
+    MSTAT_CGROUP_SCHEMA(MSTAT_X)
+#undef MSTAT_X
+};
+
+enum {
+#define MSTAT_X(id, name, ctype, file, key, type) MSTAT_CGROUP_FIELD_##id,
+    MSTAT_CGROUP_SCHEMA(MSTAT_X)
+#undef MSTAT_X
+    MSTAT_CGROUP_FIELD_MAX,
+};
+
+enum {
+    MSTAT_SOURCE_SMAPS_ROLLUP = 0,
+    MSTAT_SOURCE_STATM,
+    MSTAT_SOURCE_SMAPS,
+    /** Sum of a process tree (mstat -t) */
+    MSTAT_SOURCE_TREE,
 };
 
 enum {
-    MSTAT_FIELD_PID = 0,
-    MSTAT_FIELD_TIMESTAMP,
-    MSTAT_FIELD_RSS,
-    MSTAT_FIELD_PSS,
-    MSTAT_FIELD_PSS_ANON,
-    MSTAT_FIELD_PSS_FILE,
-    MSTAT_FIELD_PSS_SHMEM,
-    MSTAT_FIELD_SHARED_CLEAN,
-    MSTAT_FIELD_SHARED_DIRTY,
-    MSTAT_FIELD_PRIVATE_CLEAN,
-    MSTAT_FIELD_PRIVATE_DIRTY,
-    MSTAT_FIELD_REFERENCED,
-    MSTAT_FIELD_ANONYMOUS,
-    MSTAT_FIELD_LAZY_FREE,
-    MSTAT_FIELD_ANON_HUGE_PAGES,
-    MSTAT_FIELD_SHMEM_PMD_MAPPED,
-    MSTAT_FIELD_FILE_PMD_MAPPED,
-    MSTAT_FIELD_SHARED_HUGETLB,
-    MSTAT_FIELD_PRIVATE_HUGETLB,
-    MSTAT_FIELD_SWAP,
-    MSTAT_FIELD_SWAP_PSS,
-    MSTAT_FIELD_LOCKED,
+#define MSTAT_X(id, name, ctype, key, type) MSTAT_FIELD_##id,
+    MSTAT_SCHEMA(MSTAT_X)
+#undef MSTAT_X
+    MSTAT_FIELD_MAX,
+};
+
+// smaps keys that are not a record field are numbered after the MSTAT_FIELD_* ids
+enum {
+    /** "Size" (only in the full smaps, one line per mapping) */
+    MSTAT_SMAPS_KEY_SIZE = MSTAT_FIELD_MAX,
+    MSTAT_SMAPS_KEY_MAX,
+};
+
+struct mstat_smaps_key_t {
+    const char *key;
+    /** MSTAT_FIELD_* id, or MSTAT_SMAPS_KEY_* for keys without a record field */
+    unsigned id;
+    /** Offset of the record field (only for MSTAT_FIELD_* ids) */
+    size_t offset;
+};
+
+struct mstat_header_t {
+    /** Format version (1 or 2) */
+    unsigned short version;
+    /** Fields per record */
+    int fields;
+    /** Offset of the first record */
+    int data_start;
+    /** Offset past the last record */
+    size_t data_end;
+    /** Bytes per record */
+    unsigned int record_size;
+    /** Byte order mark (MSTAT_BOM when written on a host of the same byte order) */
+    unsigned int byte_order;
+    /** Samples per second requested (0 = unknown) */
+    double sample_rate;
+    /** Wall clock time sampling started (0 = unknown) */
+    struct timespec start;
+    /** Total records */
+    size_t records;
+    /** MSTAT_FLAG_* bits */
+    unsigned long long flags;
+    /** Offset of the compressed block index (0 = none) */
+    size_t index_offset;
+    /** Entries in the compressed block index */
+    size_t index_count;
+};
+
+struct mstat_sched_t {
+    /** Time of the first deadline */
+    struct timespec start;
+    /** Next absolute wake-up time */
+    struct timespec deadline;
+    /** Nanoseconds between deadlines */
+    long long period;
+    /** Deadlines reached */
+    size_t ticks;
+    /** Deadlines skipped because a sample ran past them */
+    size_t missed;
+    /** Samples that did not finish before the next deadline */
+    size_t overruns;
+    /** Longest overrun (seconds) */
+    double overrun_max;
+    /** Nanoseconds between the last deadline and waking up */
+    unsigned long long wake_late;
+};
+
+// Samples below the threshold before an adaptive rate is halved
+#define MSTAT_ADAPT_HOLD 8
+
+/*
+ * Adaptive sample rate. The rate jumps to the ceiling as soon as RSS or
+ * PSS changes faster than the threshold, and is halved after every
+ * MSTAT_ADAPT_HOLD quiet samples until it reaches the floor.
+ */
+struct mstat_adapt_t {
+    /** Lowest rate (samples per second) */
+    double floor;
+    /** Highest rate (samples per second) */
+    double ceiling;
+    /** Change of RSS or PSS that raises the rate (kB per second) */
+    double threshold;
+    /** Current rate (samples per second) */
+    double rate;
+    /** Consecutive samples below the threshold */
+    size_t quiet;
+    /** Times the rate was raised to the ceiling */
+    size_t bursts;
+    /** A previous sample is known */
+    int primed;
+    /** Time of the previous sample */
+    double last_time;
+    /** RSS of the previous sample */
+    size_t last_rss;
+    /** A previous full sample is known (statm probes do not read PSS) */
+    int primed_full;
+    /** Time of the previous full sample */
+    double last_full_time;
+    /** PSS of the previous full sample */
+    size_t last_pss;
+};
+
+// Weight of the newest read time in the throttle's moving average
+#define MSTAT_THROTTLE_WEIGHT 0.125
+
+/*
+ * Duty cycle limit. smaps_rollup holds the target's mmap_lock while it
+ * walks the page tables, so the time spent reading it is time the target
+ * may wait for page faults and mmap(). The throttle keeps a moving
+ * average of the read time and derives the highest sample rate that
+ * keeps reads within the budget.
+ */
+struct mstat_throttle_t {
+    /** Largest fraction of wall time spent reading (0.0 - 1.0) */
+    double budget;
+    /** Moving average of the read time (seconds) */
+    double read_time;
+    /** Highest sample rate within budget (samples per second) */
+    double limit;
+    /** Reads measured */
+    size_t reads;
+};
+
+struct mstat_sampler_t {
+    /** PID being sampled */
+    pid_t pid;
+    /** Descriptor of /proc/PID/smaps_rollup (or smaps) */
+    int fd;
+    /** MSTAT_SOURCE_SMAPS_ROLLUP, or MSTAT_SOURCE_SMAPS when smaps_rollup is unavailable */
+    int source;
+    /** Descriptor of /proc/PID/statm */
+    int fd_statm;
+    /** Size of a memory page in kB */
+    size_t page_size;
+    /** Read buffer */
+    char *data;
+    /** Size of read buffer */
+    size_t size;
+    /** Nanoseconds spent reading smaps_rollup by the last mstat_sampler_read */
+    unsigned long long read_time;
+    /** Nanoseconds spent parsing smaps_rollup by the last mstat_sampler_read */
+    unsigned long long parse_time;
+    /** Nanoseconds spent by the last mstat_sampler_probe */
+    unsigned long long probe_time;
+};
+
+struct mstat_map_t {
+    /** Header of the mapped file */
+    struct mstat_header_t hdr;
+    /** Field names stored in the header (NULL terminated) */
+    char **fields;
+    /** Storage type of each field (MSTAT_TYPE_*) */
+    char *types;
+    /** Open file stream */
+    FILE *fp;
+    /** Start of the mapping */
+    char *base;
+    /** Size of the mapping */
+    size_t size;
+    /** First record (in the mapping, or decoded from compressed blocks) */
+    char *data;
+    /** Records decoded from compressed blocks (NULL when read in place) */
+    char *decoded;
+    /** Capacity of decoded (records) */
+    size_t decoded_capacity;
+    /** Offset of the first compressed block not decoded yet */
+    size_t next_block;
+};
+
+struct mstat_column_t {
+    /** First value */
+    const char *data;
+    /** Bytes between consecutive values */
+    size_t stride;
+    /** Bytes per value */
+    size_t width;
+    /** Number of values */
+    size_t count;
+    /** MSTAT_TYPE_* */
+    char type;
+};
+
+struct mstat_stats_t {
+    /** Number of values */
+    size_t count;
+    /** Smallest value */
+    double min;
+    /** Largest value */
+    double max;
+    /** Sum of values */
+    double sum;
+    /** Values above this are counted in `above` */
+    double threshold;
+    /** Seconds covered by the values */
+    double duration;
+    /** Seconds spent above threshold */
+    double above;
+    /** Last value added (held until the next one) */
+    double last_value;
+    /** Timestamp of last_value (seconds) */
+    double last_time;
+    /** Distribution of values (quantiles) */
+    struct mstat_hist_t hist;
+};
+
+struct mstat_cursor_t {
+    /** Mapped file */
+    const struct mstat_map_t *map;
+    /** Next record to return */
+    size_t index;
+    /** Stop before this record */
+    size_t end;
 };
 
 union mstat_field_t {
@@ -73,21 +365,101 @@ char **mstat_read_fields(FILE *fp);
 int mstat_is_valid_field(char **fields, const char *name);
 union mstat_field_t mstat_get_field_by_id(const struct mstat_record_t *record, unsigned id);
 union mstat_field_t mstat_get_field_by_name(const struct mstat_record_t *p, const char *name);
+int mstat_get_field_id(const char *name);
 int mstat_check_header(FILE *fp);
+int mstat_write_header_fields(FILE *fp, char **names, const char *types);
+int mstat_read_header(FILE *fp, struct mstat_header_t *hdr);
+ssize_t mstat_get_record_count(FILE *fp);
+int mstat_seek(FILE *fp, size_t index);
+int mstat_set_sample_info(FILE *fp, double sample_rate, const struct timespec *start);
+int mstat_set_record_count(FILE *fp, size_t count, unsigned long long flags);
+char mstat_get_field_type(unsigned id);
 FILE *mstat_open(const char *filename);
 int mstat_rewind(FILE *fp);
-ssize_t mstat_get_value_smaps(char *data);
-char *mstat_get_key_smaps(char *data, const char *key);
+void mstat_smaps_init();
+const struct mstat_smaps_key_t *mstat_smaps_lookup(const char *key, size_t len);
 void mstat_read_smaps(struct mstat_record_t *p, FILE *fp);
+void mstat_parse_smaps(struct mstat_record_t *p, const char *data, size_t len);
+int mstat_sampler_open(struct mstat_sampler_t *s, pid_t pid);
+int mstat_sampler_read(struct mstat_sampler_t *s, struct mstat_record_t *p);
+int mstat_sampler_probe(struct mstat_sampler_t *s, struct mstat_record_t *p);
+int mstat_sampler_parse_statm(const struct mstat_sampler_t *s, struct mstat_record_t *p, const char *data);
+void mstat_sampler_close(struct mstat_sampler_t *s);
+void mstat_merge_probe(struct mstat_record_t *p, const struct mstat_record_t *full);
+void mstat_record_add(struct mstat_record_t *total, const struct mstat_record_t *p);
 int mstat_attach(struct mstat_record_t *p, pid_t pid);
+size_t mstat_get_start_time(pid_t pid);
 int mstat_write_header(FILE *fp);
+size_t mstat_pack(char *buf, const struct mstat_record_t *record);
+void mstat_unpack(struct mstat_record_t *record, const char *buf, const struct mstat_header_t *hdr);
 int mstat_write(FILE *fp, struct mstat_record_t *p);
+int mstat_write_block(FILE *fp, const char *records, size_t count, int fields, const char *types, char *scratch);
+int mstat_write_index(FILE *fp, const size_t *offsets, size_t count);
 int mstat_iter(FILE *fp, struct mstat_record_t *p);
-void mstat_get_mmax(const double a[], size_t size, double *min, double *max);
+struct mstat_map_t *mstat_map_open(const char *filename);
+void mstat_map_close(struct mstat_map_t *map);
+int mstat_map_find_field(const struct mstat_map_t *map, const char *name);
+char **mstat_map_default_fields(const struct mstat_map_t *map);
+const char *mstat_map_record(const struct mstat_map_t *map, size_t index);
+int mstat_map_get(const struct mstat_map_t *map, size_t index, struct mstat_record_t *record);
+ssize_t mstat_map_refresh(struct mstat_map_t *map);
+int mstat_map_column(const struct mstat_map_t *map, int field, struct mstat_column_t *column);
+size_t mstat_map_gather(const struct mstat_map_t *map, int field, size_t first, size_t count, double *dest);
+void mstat_cursor_init(struct mstat_cursor_t *cursor, const struct mstat_map_t *map);
+int mstat_cursor_next(struct mstat_cursor_t *cursor, struct mstat_record_t *record);
+int mstat_field_is_probed(int id);
+int mstat_stats_init(struct mstat_stats_t *s, double threshold);
+void mstat_stats_add(struct mstat_stats_t *s, const double *values, const double *timestamps, size_t count);
+int mstat_stats_merge(struct mstat_stats_t *dest, const struct mstat_stats_t *src);
+double mstat_stats_quantile(const struct mstat_stats_t *s, double q);
+int mstat_stats_map(const struct mstat_map_t *map, int field, struct mstat_stats_t *s);
+void mstat_stats_free(struct mstat_stats_t *s);
+int mstat_write_summary(FILE *fp, char **names, const struct mstat_stats_t *stats, size_t count);
+int mstat_read_summary(FILE *fp, char ***names, struct mstat_stats_t **stats);
 double mstat_difftimespec(struct timespec end, struct timespec start);
+unsigned long long mstat_difftimespec_ns(struct timespec end, struct timespec start);
+void mstat_sched_init(struct mstat_sched_t *s, double rate);
+void mstat_sched_next(struct mstat_sched_t *s);
+int mstat_sched_wait(struct mstat_sched_t *s);
+void mstat_sched_set_rate(struct mstat_sched_t *s, double rate);
+void mstat_adapt_init(struct mstat_adapt_t *a, double low, double high, double threshold);
+int mstat_adapt_update(struct mstat_adapt_t *a, const struct mstat_record_t *p);
+void mstat_throttle_init(struct mstat_throttle_t *t, double budget);
+double mstat_throttle_update(struct mstat_throttle_t *t, double seconds);
+int mstat_write_trailer(FILE *fp, char **keys, const double *values, size_t count);
+int mstat_read_trailer(FILE *fp, char ***keys, double **values);
+int mstat_watch_open(const char *filename);
+int mstat_watch_wait(int fd);
 int mstat_find_program(const char *name, char *where);
 void mstat_check_argument_str(char **x, char *arg, int i);
 void mstat_check_argument_int(char **x, char *arg, int i);
 void mstat_check_argument_double(char **x, char *arg, int i);
 
+/**
+ * Return a value of an unsigned integer column
+ * @param column pointer to column view
+ * @param i index of value
+ * @return value
+ */
+static inline size_t mstat_column_u64(const struct mstat_column_t *column, size_t i) {
+    size_t value = 0;
+    memcpy(&value, column->data + i * column->stride, column->width);
+    return value;
+}
+
+/**
+ * Return a value of a column as a double
+ * @param column pointer to column view
+ * @param i index of value
+ * @return value
+ */
+static inline double mstat_column_f64(const struct mstat_column_t *column, size_t i) {
+    double value;
+    if (column->type != MSTAT_TYPE_F64) {
+        return (double) mstat_column_u64(column, i);
+    }
+    memcpy(&value, column->data + i * column->stride, sizeof(value));
+    return value;
+}
+
 #endif //MSTAT_COMMON_H
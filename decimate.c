@@ -0,0 +1,486 @@
+#include <math.h>
+#include "decimate.h"
+
+/*
+ * Decimators reduce a series that is too long to draw to roughly the
+ * number of points a plot can show. Points are pushed in time order and
+ * all series share one x axis. Memory is proportional to the number of
+ * buckets, never to the number of points.
+ *
+ * MINMAX splits the points into equal buckets and emits two points per
+ * bucket: at the first x of the bucket the extreme that occurred first,
+ * at its last x the other one. Every minimum and maximum survives, so
+ * a spike is never lost; it moves by less than one bucket.
+ *
+ * LTTB keeps the first and last point and picks one point per bucket:
+ * the one forming the largest triangle with the point picked in the
+ * previous bucket and the mean of the next bucket. Areas of all series
+ * are normalized by their range and summed, so one x serves all series.
+ * The bucket means come from a first pass over the data.
+ *
+ * Live decimators accept points without knowing how many will come.
+ * They keep MINMAX buckets of a fixed number of points; when every bucket
+ * is in use, neighbouring buckets are merged in pairs and the bucket
+ * width doubles. Each point costs O(series), whatever the length of the
+ * series, and mstat_decimate_render() produces the points to draw.
+ */
+
+/**
+ * Append a point to the output
+ * @param d pointer to decimator
+ * @param x x value
+ * @param y one value per series
+ */
+static void mstat_decimate_emit(struct mstat_decimate_t *d, double x, const double *y) {
+    if (d->count == d->capacity) {
+        return;
+    }
+    d->x[d->count] = x;
+    for (size_t s = 0; s < d->series; s++) {
+        d->y[s][d->count] = y[s];
+    }
+    d->count++;
+}
+
+/**
+ * Emit the points of a finished MINMAX bucket
+ * @param d pointer to decimator
+ */
+static void mstat_decimate_flush_bucket(struct mstat_decimate_t *d) {
+    if (!d->bucket_count || d->count + 2 > d->capacity) {
+        return;
+    }
+    d->x[d->count] = d->first_x;
+    d->x[d->count + 1] = d->last_x;
+    for (size_t s = 0; s < d->series; s++) {
+        int min_first = d->min_at[s] <= d->max_at[s];
+        d->y[s][d->count] = min_first ? d->min[s] : d->max[s];
+        d->y[s][d->count + 1] = min_first ? d->max[s] : d->min[s];
+    }
+    // A single point needs no second copy
+    d->count += d->bucket_count > 1 ? 2 : 1;
+    d->bucket_count = 0;
+}
+
+/**
+ * Prepare a decimator
+ * @param d pointer to decimator (modified)
+ * @param method MSTAT_DECIMATE_*
+ * @param records number of points that will be pushed (per pass)
+ * @param points approximate number of points to produce (0 = keep every point)
+ * @param series number of y series
+ * @return 0 on success. -1 on error
+ */
+int mstat_decimate_init(struct mstat_decimate_t *d, int method, size_t records, size_t points, size_t series) {
+    memset(d, 0, sizeof(*d));
+    if (!points || records <= points || (method == MSTAT_DECIMATE_LTTB && points < 3)) {
+        method = MSTAT_DECIMATE_NONE;
+    }
+    d->method = method;
+    d->records = records;
+    d->series = series;
+
+    switch (method) {
+        case MSTAT_DECIMATE_MINMAX:
+            d->buckets = points / 2 ? points / 2 : 1;
+            d->capacity = d->buckets * 2;
+            break;
+        case MSTAT_DECIMATE_LTTB:
+            // First and last point sit outside the buckets
+            d->buckets = points - 2;
+            d->capacity = points;
+            break;
+        default:
+            d->capacity = records;
+            break;
+    }
+
+    d->x = calloc(d->capacity + 1, sizeof(*d->x));
+    d->y = calloc(series + 1, sizeof(*d->y));
+    d->min = calloc(series + 1, sizeof(*d->min));
+    d->max = calloc(series + 1, sizeof(*d->max));
+    d->min_at = calloc(series + 1, sizeof(*d->min_at));
+    d->max_at = calloc(series + 1, sizeof(*d->max_at));
+    d->best_y = calloc(series + 1, sizeof(*d->best_y));
+    d->lo = calloc(series + 1, sizeof(*d->lo));
+    d->hi = calloc(series + 1, sizeof(*d->hi));
+    if (!d->x || !d->y || !d->min || !d->max || !d->min_at || !d->max_at || !d->best_y || !d->lo || !d->hi) {
+        mstat_decimate_free(d);
+        return -1;
+    }
+    for (size_t s = 0; s < series; s++) {
+        d->y[s] = calloc(d->capacity + 1, sizeof(*d->y[s]));
+        if (!d->y[s]) {
+            mstat_decimate_free(d);
+            return -1;
+        }
+        d->lo[s] = HUGE_VAL;
+        d->hi[s] = -HUGE_VAL;
+    }
+    if (method == MSTAT_DECIMATE_LTTB) {
+        d->avg_x = calloc(d->buckets + 1, sizeof(*d->avg_x));
+        d->avg_y = calloc((d->buckets + 1) * series + 1, sizeof(*d->avg_y));
+        if (!d->avg_x || !d->avg_y) {
+            mstat_decimate_free(d);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Prepare a live decimator (MINMAX over a series of unknown length)
+ * @param d pointer to decimator (modified)
+ * @param points approximate number of points to produce
+ * @param series number of y series
+ * @return 0 on success. -1 on error
+ */
+int mstat_decimate_init_live(struct mstat_decimate_t *d, size_t points, size_t series) {
+    size_t buckets = points / 2 >= 2 ? points / 2 : 2;
+
+    // Bucket pairs are merged, so keep an even number of them
+    buckets &= ~(size_t) 1;
+    // Room for two points per finished bucket, plus the bucket being filled
+    if (mstat_decimate_init(d, MSTAT_DECIMATE_NONE, (buckets + 1) * 2, 0, series) < 0) {
+        return -1;
+    }
+    d->method = MSTAT_DECIMATE_MINMAX;
+    d->live = 1;
+    d->width = 1;
+    d->buckets = buckets;
+    d->bucket_first_x = calloc(buckets + 1, sizeof(*d->bucket_first_x));
+    d->bucket_last_x = calloc(buckets + 1, sizeof(*d->bucket_last_x));
+    d->bucket_min = calloc((buckets + 1) * series + 1, sizeof(*d->bucket_min));
+    d->bucket_max = calloc((buckets + 1) * series + 1, sizeof(*d->bucket_max));
+    d->bucket_min_first = calloc((buckets + 1) * series + 1, sizeof(*d->bucket_min_first));
+    if (!d->bucket_first_x || !d->bucket_last_x || !d->bucket_min || !d->bucket_max || !d->bucket_min_first) {
+        mstat_decimate_free(d);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Merge neighbouring live buckets in pairs
+ * @param d pointer to decimator
+ */
+static void mstat_decimate_halve(struct mstat_decimate_t *d) {
+    size_t n = d->series;
+
+    for (size_t b = 0; b < d->done / 2; b++) {
+        size_t a = b * 2;
+        size_t c = a + 1;
+        d->bucket_first_x[b] = d->bucket_first_x[a];
+        d->bucket_last_x[b] = d->bucket_last_x[c];
+        for (size_t s = 0; s < n; s++) {
+            // Which half each extreme comes from decides their order
+            int min_left = d->bucket_min[a * n + s] <= d->bucket_min[c * n + s];
+            int max_left = d->bucket_max[a * n + s] >= d->bucket_max[c * n + s];
+            unsigned char min_first;
+            if (min_left != max_left) {
+                min_first = (unsigned char) min_left;
+            } else {
+                min_first = d->bucket_min_first[(min_left ? a : c) * n + s];
+            }
+            d->bucket_min[b * n + s] = min_left ? d->bucket_min[a * n + s] : d->bucket_min[c * n + s];
+            d->bucket_max[b * n + s] = max_left ? d->bucket_max[a * n + s] : d->bucket_max[c * n + s];
+            d->bucket_min_first[b * n + s] = min_first;
+        }
+    }
+    d->done /= 2;
+    d->width *= 2;
+}
+
+/**
+ * Consume the next point of a live decimator
+ * @param d pointer to decimator
+ * @param x x value
+ * @param y one value per series
+ */
+static void mstat_decimate_push_live(struct mstat_decimate_t *d, double x, const double *y) {
+    if (!d->bucket_count) {
+        d->first_x = x;
+        for (size_t s = 0; s < d->series; s++) {
+            d->min[s] = d->max[s] = y[s];
+            d->min_at[s] = d->max_at[s] = 0;
+        }
+    } else {
+        for (size_t s = 0; s < d->series; s++) {
+            if (y[s] < d->min[s]) {
+                d->min[s] = y[s];
+                d->min_at[s] = d->bucket_count;
+            }
+            if (y[s] > d->max[s]) {
+                d->max[s] = y[s];
+                d->max_at[s] = d->bucket_count;
+            }
+        }
+    }
+    d->last_x = x;
+    d->bucket_count++;
+    d->index++;
+
+    if (d->bucket_count < d->width) {
+        return;
+    }
+    // The bucket is full
+    if (d->done == d->buckets) {
+        mstat_decimate_halve(d);
+    }
+    d->bucket_first_x[d->done] = d->first_x;
+    d->bucket_last_x[d->done] = d->last_x;
+    for (size_t s = 0; s < d->series; s++) {
+        d->bucket_min[d->done * d->series + s] = d->min[s];
+        d->bucket_max[d->done * d->series + s] = d->max[s];
+        d->bucket_min_first[d->done * d->series + s] = d->min_at[s] <= d->max_at[s];
+    }
+    d->done++;
+    d->bucket_count = 0;
+}
+
+/**
+ * Produce the points of a live decimator (x, y and count)
+ * @param d pointer to decimator
+ */
+void mstat_decimate_render(struct mstat_decimate_t *d) {
+    size_t n = d->series;
+
+    if (!d->live) {
+        return;
+    }
+    d->count = 0;
+    for (size_t b = 0; b < d->done; b++) {
+        d->x[d->count] = d->bucket_first_x[b];
+        d->x[d->count + 1] = d->bucket_last_x[b];
+        for (size_t s = 0; s < n; s++) {
+            int min_first = d->bucket_min_first[b * n + s];
+            d->y[s][d->count] = min_first ? d->bucket_min[b * n + s] : d->bucket_max[b * n + s];
+            d->y[s][d->count + 1] = min_first ? d->bucket_max[b * n + s] : d->bucket_min[b * n + s];
+        }
+        // A single point needs no second copy
+        d->count += d->width > 1 ? 2 : 1;
+    }
+    // The bucket being filled
+    if (d->bucket_count) {
+        d->x[d->count] = d->first_x;
+        d->x[d->count + 1] = d->last_x;
+        for (size_t s = 0; s < n; s++) {
+            int min_first = d->min_at[s] <= d->max_at[s];
+            d->y[s][d->count] = min_first ? d->min[s] : d->max[s];
+            d->y[s][d->count + 1] = min_first ? d->max[s] : d->min[s];
+        }
+        d->count += d->bucket_count > 1 ? 2 : 1;
+    }
+}
+
+/**
+ * Return how many times the points must be pushed
+ * @param d pointer to decimator
+ * @return number of passes
+ */
+int mstat_decimate_passes(const struct mstat_decimate_t *d) {
+    return d->method == MSTAT_DECIMATE_LTTB ? 2 : 1;
+}
+
+/**
+ * Return the LTTB bucket of a point
+ * @param d pointer to decimator
+ * @param index position of point (1 .. records - 2)
+ * @return bucket
+ */
+static inline size_t mstat_lttb_bucket(const struct mstat_decimate_t *d, size_t index) {
+    return (index - 1) * d->buckets / (d->records - 2);
+}
+
+/**
+ * Consume a point during the first LTTB pass
+ * @param d pointer to decimator
+ * @param x x value
+ * @param y one value per series
+ */
+static void mstat_lttb_measure(struct mstat_decimate_t *d, double x, const double *y) {
+    size_t b;
+
+    for (size_t s = 0; s < d->series; s++) {
+        if (y[s] < d->lo[s]) {
+            d->lo[s] = y[s];
+        }
+        if (y[s] > d->hi[s]) {
+            d->hi[s] = y[s];
+        }
+    }
+    if (d->index == 0) {
+        return;
+    }
+    // The last point stands in for the mean of the bucket after the last one
+    b = d->index == d->records - 1 ? d->buckets : mstat_lttb_bucket(d, d->index);
+    if (b != d->bucket) {
+        if (d->bucket_count) {
+            d->avg_x[d->bucket] /= (double) d->bucket_count;
+            for (size_t s = 0; s < d->series; s++) {
+                d->avg_y[d->bucket * d->series + s] /= (double) d->bucket_count;
+            }
+        }
+        d->bucket = b;
+        d->bucket_count = 0;
+    }
+    d->avg_x[b] += x;
+    for (size_t s = 0; s < d->series; s++) {
+        d->avg_y[b * d->series + s] += y[s];
+    }
+    d->bucket_count++;
+}
+
+/**
+ * Consume a point during the second LTTB pass
+ * @param d pointer to decimator
+ * @param x x value
+ * @param y one value per series
+ */
+static void mstat_lttb_select(struct mstat_decimate_t *d, double x, const double *y) {
+    const double *prev_y;
+    const double *next_y;
+    double prev_x, next_x, area;
+    size_t b;
+
+    if (d->index == 0) {
+        mstat_decimate_emit(d, x, y);
+        d->bucket = 0;
+        d->best_area = -1.0;
+        return;
+    }
+    b = d->index == d->records - 1 ? d->buckets : mstat_lttb_bucket(d, d->index);
+    if (b != d->bucket) {
+        mstat_decimate_emit(d, d->best_x, d->best_y);
+        d->bucket = b;
+        d->best_area = -1.0;
+    }
+    if (b == d->buckets) {
+        mstat_decimate_emit(d, x, y);
+        return;
+    }
+
+    prev_x = d->x[d->count - 1];
+    next_x = d->avg_x[b + 1];
+    next_y = &d->avg_y[(b + 1) * d->series];
+    area = 0.0;
+    for (size_t s = 0; s < d->series; s++) {
+        double range = d->hi[s] - d->lo[s];
+        prev_y = &d->y[s][d->count - 1];
+        if (range > 0.0) {
+            area += fabs((prev_x - next_x) * (y[s] - *prev_y) - (prev_x - x) * (next_y[s] - *prev_y)) / range;
+        }
+    }
+    if (area > d->best_area) {
+        d->best_area = area;
+        d->best_x = x;
+        memcpy(d->best_y, y, d->series * sizeof(*y));
+    }
+}
+
+/**
+ * Consume the next point
+ * @param d pointer to decimator
+ * @param x x value (points are pushed in order of x)
+ * @param y one value per series
+ */
+void mstat_decimate_push(struct mstat_decimate_t *d, double x, const double *y) {
+    if (d->live) {
+        mstat_decimate_push_live(d, x, y);
+        return;
+    }
+    if (d->index >= d->records) {
+        return;
+    }
+    switch (d->method) {
+        case MSTAT_DECIMATE_MINMAX: {
+            size_t b = d->index * d->buckets / d->records;
+            if (b != d->bucket) {
+                mstat_decimate_flush_bucket(d);
+                d->bucket = b;
+            }
+            if (!d->bucket_count) {
+                d->first_x = x;
+                for (size_t s = 0; s < d->series; s++) {
+                    d->min[s] = d->max[s] = y[s];
+                    d->min_at[s] = d->max_at[s] = 0;
+                }
+            } else {
+                for (size_t s = 0; s < d->series; s++) {
+                    if (y[s] < d->min[s]) {
+                        d->min[s] = y[s];
+                        d->min_at[s] = d->bucket_count;
+                    }
+                    if (y[s] > d->max[s]) {
+                        d->max[s] = y[s];
+                        d->max_at[s] = d->bucket_count;
+                    }
+                }
+            }
+            d->last_x = x;
+            d->bucket_count++;
+            break;
+        }
+        case MSTAT_DECIMATE_LTTB:
+            if (d->pass == 0) {
+                mstat_lttb_measure(d, x, y);
+            } else {
+                mstat_lttb_select(d, x, y);
+            }
+            break;
+        default:
+            mstat_decimate_emit(d, x, y);
+            break;
+    }
+    d->index++;
+}
+
+/**
+ * Finish a pass over the points
+ * @param d pointer to decimator
+ */
+void mstat_decimate_end_pass(struct mstat_decimate_t *d) {
+    if (d->method == MSTAT_DECIMATE_MINMAX) {
+        mstat_decimate_flush_bucket(d);
+    } else if (d->method == MSTAT_DECIMATE_LTTB && d->pass == 0) {
+        if (d->bucket_count) {
+            d->avg_x[d->bucket] /= (double) d->bucket_count;
+            for (size_t s = 0; s < d->series; s++) {
+                d->avg_y[d->bucket * d->series + s] /= (double) d->bucket_count;
+            }
+        }
+        d->bucket = 0;
+        d->bucket_count = 0;
+    }
+    d->pass++;
+    d->index = 0;
+}
+
+/**
+ * Release resources held by a decimator
+ * @param d pointer to decimator
+ */
+void mstat_decimate_free(struct mstat_decimate_t *d) {
+    if (d->y) {
+        for (size_t s = 0; s < d->series; s++) {
+            free(d->y[s]);
+        }
+    }
+    free(d->y);
+    free(d->x);
+    free(d->min);
+    free(d->max);
+    free(d->min_at);
+    free(d->max_at);
+    free(d->best_y);
+    free(d->lo);
+    free(d->hi);
+    free(d->avg_x);
+    free(d->avg_y);
+    free(d->bucket_first_x);
+    free(d->bucket_last_x);
+    free(d->bucket_min);
+    free(d->bucket_max);
+    free(d->bucket_min_first);
+    memset(d, 0, sizeof(*d));
+}
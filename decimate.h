@@ -0,0 +1,92 @@
+#ifndef MSTAT_DECIMATE_H
+#define MSTAT_DECIMATE_H
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    /** Keep every point */
+    MSTAT_DECIMATE_NONE = 0,
+    /** Minimum and maximum of each bucket (keeps every peak) */
+    MSTAT_DECIMATE_MINMAX,
+    /** Largest-Triangle-Three-Buckets (two passes) */
+    MSTAT_DECIMATE_LTTB,
+};
+
+struct mstat_decimate_t {
+    /** MSTAT_DECIMATE_* */
+    int method;
+    /** Points that will be pushed per pass */
+    size_t records;
+    /** Number of y series */
+    size_t series;
+    /** Number of buckets */
+    size_t buckets;
+    /** Current pass (LTTB makes two) */
+    int pass;
+    /** Points pushed in the current pass */
+    size_t index;
+    /** Bucket being filled */
+    size_t bucket;
+    /** Points in the bucket being filled */
+    size_t bucket_count;
+    /** x of the first point in the bucket */
+    double first_x;
+    /** x of the last point in the bucket */
+    double last_x;
+    /** Smallest value of each series in the bucket */
+    double *min;
+    /** Largest value of each series in the bucket */
+    double *max;
+    /** Position of min in the bucket */
+    size_t *min_at;
+    /** Position of max in the bucket */
+    size_t *max_at;
+    /** LTTB: mean x of each bucket */
+    double *avg_x;
+    /** LTTB: mean of each series in each bucket (buckets x series) */
+    double *avg_y;
+    /** LTTB: range of each series (lowest) */
+    double *lo;
+    /** LTTB: range of each series (highest) */
+    double *hi;
+    /** LTTB: best candidate of the bucket (x) */
+    double best_x;
+    /** LTTB: best candidate of the bucket (one value per series) */
+    double *best_y;
+    /** LTTB: score of the best candidate */
+    double best_area;
+    /** Live: number of points is not known in advance */
+    int live;
+    /** Live: points per bucket (doubles as the series grows) */
+    size_t width;
+    /** Live: finished buckets */
+    size_t done;
+    /** Live: first x of each finished bucket */
+    double *bucket_first_x;
+    /** Live: last x of each finished bucket */
+    double *bucket_last_x;
+    /** Live: smallest value of each series in each finished bucket (buckets x series) */
+    double *bucket_min;
+    /** Live: largest value of each series in each finished bucket (buckets x series) */
+    double *bucket_max;
+    /** Live: nonzero where the smallest value came first (buckets x series) */
+    unsigned char *bucket_min_first;
+    /** Decimated x values */
+    double *x;
+    /** Decimated values of each series */
+    double **y;
+    /** Number of decimated points */
+    size_t count;
+    /** Capacity of x and y */
+    size_t capacity;
+};
+
+int mstat_decimate_init(struct mstat_decimate_t *d, int method, size_t records, size_t points, size_t series);
+int mstat_decimate_init_live(struct mstat_decimate_t *d, size_t points, size_t series);
+int mstat_decimate_passes(const struct mstat_decimate_t *d);
+void mstat_decimate_push(struct mstat_decimate_t *d, double x, const double *y);
+void mstat_decimate_end_pass(struct mstat_decimate_t *d);
+void mstat_decimate_render(struct mstat_decimate_t *d);
+void mstat_decimate_free(struct mstat_decimate_t *d);
+
+#endif //MSTAT_DECIMATE_H
@@ -0,0 +1,234 @@
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include "events.h"
+
+/**
+ * pidfd_open(2)
+ */
+static int mstat_pidfd_open(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return (int) syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void) pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * Add a descriptor to the epoll instance
+ * @param e pointer to events
+ * @param fd descriptor to wait for
+ * @param events EPOLLIN (readable) or EPOLLPRI (PSI trigger)
+ * @return 0 on success. -1 on error
+ */
+static int mstat_events_add(struct mstat_events_t *e, int fd, unsigned events) {
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = fd;
+    return epoll_ctl(e->epfd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/**
+ * Set up the sample loop wake-ups
+ *
+ * The signals are blocked in the calling thread, and in every thread it
+ * creates afterwards, so call this before starting threads. Processes
+ * forked later restore old_mask before exec.
+ *
+ * @param e pointer to events
+ * @param signals signals to read from the signalfd
+ * @param count number of signals
+ * @return 0 on success. -1 on error
+ */
+int mstat_events_open(struct mstat_events_t *e, const int *signals, size_t count) {
+    memset(e, 0, sizeof(*e));
+    e->epfd = -1;
+    e->timerfd = -1;
+    e->sigfd = -1;
+    e->pidfd = -1;
+    e->psifd = -1;
+
+    sigemptyset(&e->mask);
+    for (size_t i = 0; i < count; i++) {
+        sigaddset(&e->mask, signals[i]);
+    }
+    if (sigprocmask(SIG_BLOCK, &e->mask, &e->old_mask) < 0) {
+        return -1;
+    }
+
+    e->epfd = epoll_create1(EPOLL_CLOEXEC);
+    e->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    e->sigfd = signalfd(-1, &e->mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (e->epfd < 0 || e->timerfd < 0 || e->sigfd < 0
+        || mstat_events_add(e, e->timerfd, EPOLLIN) < 0 || mstat_events_add(e, e->sigfd, EPOLLIN) < 0) {
+        mstat_events_close(e);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Wake up when a process exits
+ *
+ * Needs pidfd_open (Linux 5.3). Without it the exit is noticed when the
+ * next sample fails.
+ *
+ * @param e pointer to events
+ * @param pid process to watch
+ * @return 0 on success. -1 on error
+ */
+int mstat_events_watch(struct mstat_events_t *e, pid_t pid) {
+    e->pidfd = mstat_pidfd_open(pid);
+    if (e->pidfd < 0) {
+        return -1;
+    }
+    if (mstat_events_add(e, e->pidfd, EPOLLIN) < 0) {
+        close(e->pidfd);
+        e->pidfd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Check whether the watched process exited
+ *
+ * Without a pidfd the /proc entry of the process is compared with the
+ * start time it had when it was first seen, so a reused pid does not
+ * count as the same process.
+ *
+ * @param e pointer to events
+ * @param pid process (as given to mstat_events_watch)
+ * @param start_time start time of the process (see mstat_get_start_time)
+ * @return 1 if the process exited. 0 if it is still running
+ */
+int mstat_events_exited(const struct mstat_events_t *e, pid_t pid, size_t start_time) {
+    if (e->pidfd >= 0) {
+        struct pollfd pfd = {.fd = e->pidfd, .events = POLLIN};
+        return poll(&pfd, 1, 0) > 0;
+    }
+    return mstat_get_start_time(pid) != start_time;
+}
+
+/**
+ * Wake up when a PSI trigger fires
+ * @param e pointer to events
+ * @param fd pressure file with a trigger (see mstat_psi_open)
+ * @return 0 on success. -1 on error
+ */
+int mstat_events_watch_pressure(struct mstat_events_t *e, int fd) {
+    if (mstat_events_add(e, fd, EPOLLPRI) < 0) {
+        return -1;
+    }
+    e->psifd = fd;
+    return 0;
+}
+
+/**
+ * Wait for the next deadline, a signal, the exit of the target or memory pressure
+ *
+ * A signal or an exit may arrive before the deadline. The deadline stays
+ * set, and the next call waits for the rest of it. Memory pressure ends
+ * the period instead: deadlines start again from the time it was seen.
+ *
+ * @param e pointer to events
+ * @param s pointer to scheduler (advanced to its next deadline, see mstat_sched_next)
+ * @param signo pointer to signal number (set for MSTAT_EVENT_SIGNAL)
+ * @return MSTAT_EVENT_*. -1 on error
+ */
+int mstat_events_wait(struct mstat_events_t *e, struct mstat_sched_t *s, int *signo) {
+    if (!e->armed) {
+        struct itimerspec when;
+
+        mstat_sched_next(s);
+        memset(&when, 0, sizeof(when));
+        when.it_value = s->deadline;
+        if (timerfd_settime(e->timerfd, TFD_TIMER_ABSTIME, &when, NULL) < 0) {
+            return -1;
+        }
+        e->armed = 1;
+    }
+
+    while (1) {
+        struct epoll_event ready[4];
+        int count;
+
+        count = epoll_wait(e->epfd, ready, 4, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        // Signals and exits come first: they may end the loop
+        for (int i = 0; i < count; i++) {
+            if (ready[i].data.fd == e->sigfd) {
+                struct signalfd_siginfo info;
+                if (read(e->sigfd, &info, sizeof(info)) == sizeof(info)) {
+                    *signo = (int) info.ssi_signo;
+                    return MSTAT_EVENT_SIGNAL;
+                }
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            if (ready[i].data.fd == e->pidfd) {
+                return MSTAT_EVENT_EXIT;
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            if (ready[i].data.fd == e->psifd) {
+                if (ready[i].events & EPOLLERR) {
+                    // The trigger is gone (its cgroup was removed)
+                    epoll_ctl(e->epfd, EPOLL_CTL_DEL, e->psifd, NULL);
+                    e->psifd = -1;
+                    continue;
+                }
+                e->armed = 0;
+                clock_gettime(CLOCK_MONOTONIC, &s->deadline);
+                s->wake_late = 0;
+                return MSTAT_EVENT_PRESSURE;
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            if (ready[i].data.fd == e->timerfd) {
+                unsigned long long expirations;
+                struct timespec now;
+
+                if (read(e->timerfd, &expirations, sizeof(expirations)) < 0) {
+                    continue;
+                }
+                e->armed = 0;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                s->wake_late = mstat_difftimespec_ns(now, s->deadline);
+                return MSTAT_EVENT_TICK;
+            }
+        }
+    }
+}
+
+/**
+ * Release the descriptors and unblock the signals
+ * @param e pointer to events
+ */
+void mstat_events_close(struct mstat_events_t *e) {
+    int fds[] = {e->pidfd, e->sigfd, e->timerfd, e->epfd};
+
+    for (size_t i = 0; i < sizeof(fds) / sizeof(*fds); i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &e->old_mask, NULL);
+    e->epfd = -1;
+    e->timerfd = -1;
+    e->sigfd = -1;
+    e->pidfd = -1;
+    e->psifd = -1;
+}
@@ -0,0 +1,51 @@
+#ifndef MSTAT_EVENTS_H
+#define MSTAT_EVENTS_H
+#include <signal.h>
+#include "common.h"
+
+// What woke up mstat_events_wait
+enum {
+    /** The next deadline of the scheduler was reached */
+    MSTAT_EVENT_TICK = 0,
+    /** A signal was received */
+    MSTAT_EVENT_SIGNAL,
+    /** The target exited */
+    MSTAT_EVENT_EXIT,
+    /** A PSI trigger fired (see psi.h) */
+    MSTAT_EVENT_PRESSURE,
+};
+
+/*
+ * Sample loop wake-ups. Deadlines are a timerfd, signals are read from a
+ * signalfd, the exit of the target from a pidfd and memory pressure from
+ * a PSI trigger, all waited for with one epoll instance. Signals are
+ * blocked while they are handled this way, so nothing runs in signal
+ * context.
+ */
+struct mstat_events_t {
+    /** epoll instance */
+    int epfd;
+    /** Deadlines of the scheduler */
+    int timerfd;
+    /** Signals in the mask */
+    int sigfd;
+    /** Target process (-1 = not watched) */
+    int pidfd;
+    /** PSI trigger (-1 = not watched) */
+    int psifd;
+    /** Signals read from sigfd */
+    sigset_t mask;
+    /** Signal mask before mstat_events_open (restored for child processes) */
+    sigset_t old_mask;
+    /** The timer is set to a deadline that has not been reached */
+    int armed;
+};
+
+int mstat_events_open(struct mstat_events_t *e, const int *signals, size_t count);
+int mstat_events_watch(struct mstat_events_t *e, pid_t pid);
+int mstat_events_exited(const struct mstat_events_t *e, pid_t pid, size_t start_time);
+int mstat_events_watch_pressure(struct mstat_events_t *e, int fd);
+int mstat_events_wait(struct mstat_events_t *e, struct mstat_sched_t *s, int *signo);
+void mstat_events_close(struct mstat_events_t *e);
+
+#endif //MSTAT_EVENTS_H
@@ -1,6 +1,10 @@
 #include "gnuplot.h"
 #include <string.h>
+#include <strings.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
 
 /**
  * Open a new gnuplot handle
@@ -12,6 +16,51 @@ FILE *gnuplot_open() {
     return popen("gnuplot -p", "w");
 }
 
+/**
+ * Open a new gnuplot handle without a window
+ * Use `gnuplot_output` to choose where the plot is written.
+ * @return stream on success, or NULL on error
+ */
+FILE *gnuplot_open_headless() {
+    return popen("gnuplot", "w");
+}
+
+/**
+ * Return the gnuplot terminal able to write an image file
+ * @param filename image file name (.png or .svg)
+ * @return terminal name, or NULL if the extension is not supported
+ */
+const char *gnuplot_terminal(const char *filename) {
+    const char *ext = strrchr(filename, '.');
+    if (!ext) {
+        return NULL;
+    }
+    if (!strcasecmp(ext, ".png")) {
+        return "png";
+    }
+    if (!strcasecmp(ext, ".svg")) {
+        return "svg";
+    }
+    return NULL;
+}
+
+/**
+ * Send the next plot to an image file instead of a window
+ * @param fp pointer to gnuplot stream
+ * @param filename image file name (.png or .svg)
+ * @param width image width (pixels)
+ * @param height image height (pixels)
+ * @return value of `gnuplot_sh`. <0 on error
+ */
+int gnuplot_output(FILE *fp, const char *filename, unsigned int width, unsigned int height) {
+    const char *terminal = gnuplot_terminal(filename);
+    if (!terminal) {
+        return -1;
+    }
+    gnuplot_sh(fp, "set terminal %s size %u,%u\n", terminal, width, height);
+    return gnuplot_sh(fp, "set output '%s'\n", filename);
+}
+
 /**
  * Close a gnuplot handle
  * @param fp pointer to gnuplot stream
@@ -49,17 +98,88 @@ int gnuplot_sh(FILE *fp, char *fmt, ...) {
     return status;
 }
 
+/**
+ * Write plot data to a temporary file gnuplot can read as a binary matrix
+ * Each row holds x followed by one value per y array, as native float64.
+ * The file is filled through a shared mapping, so no number is ever
+ * formatted as text.
+ * @param x an array representing the x axis
+ * @param y an array of double-precision arrays representing the y axes
+ * @param x_count total length of array x
+ * @param y_count total number of arrays in y
+ * @return path of the file (caller must unlink and free). NULL on error
+ */
+static char *gnuplot_write_data(double x[], double *y[], size_t x_count, size_t y_count) {
+    char path[PATH_MAX] = {0};
+    const char *tmpdir;
+    size_t columns;
+    size_t size;
+    double *data;
+    int fd;
+
+    tmpdir = getenv("TMPDIR");
+    if (!tmpdir || !*tmpdir) {
+        tmpdir = "/tmp";
+    }
+    snprintf(path, sizeof(path) - 1, "%s/mstat_plot.XXXXXX", tmpdir);
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+
+    columns = y_count + 1;
+    size = x_count * columns * sizeof(*data);
+    if (!size) {
+        // Nothing to map. gnuplot reads an empty file.
+        close(fd);
+        return strdup(path);
+    }
+    if (ftruncate(fd, (off_t) size) < 0) {
+        perror(path);
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(path);
+        unlink(path);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < x_count; i++) {
+        double *row = &data[i * columns];
+        row[0] = x[i];
+        for (size_t arr = 0; arr < y_count; arr++) {
+            row[arr + 1] = y[arr][i];
+        }
+    }
+    munmap(data, size);
+    return strdup(path);
+}
+
 /**
  * Generate a plot
  * Each GNUPLOT_PLOT pointer in the `gp` array corresponds to a line.
+ * The data is passed to gnuplot as a binary file shared by every line. Its
+ * path is stored in gp[0]->data_file and must outlive the gnuplot process
+ * (see `gnuplot_remove_data`).
  * @param fp pointer to gnuplot stream
  * @param gp pointer to an array of GNUPLOT_PLOT structures
  * @param x an array representing the x axis
  * @param y an array of double-precision arrays representing the y axes
  * @param x_count total length of array x
  * @param y_count total number of arrays in y
+ * @return 0 on success. -1 on error
  */
-void gnuplot_plot(FILE *fp, struct GNUPLOT_PLOT **gp, double x[], double *y[], size_t x_count, size_t y_count) {
+int gnuplot_plot(FILE *fp, struct GNUPLOT_PLOT **gp, double x[], double *y[], size_t x_count, size_t y_count) {
+    gp[0]->data_file = gnuplot_write_data(x, y, x_count, y_count);
+    if (!gp[0]->data_file) {
+        return -1;
+    }
+
     // Configure plot
     gnuplot_sh(fp, "set title '%s'\n", gp[0]->title);
     gnuplot_sh(fp, "set xlabel '%s'\n", gp[0]->xlabel);
@@ -90,7 +210,10 @@ void gnuplot_plot(FILE *fp, struct GNUPLOT_PLOT **gp, double x[], double *y[], s
     gnuplot_sh(fp, "plot ");
     for (size_t i = 0; i < y_count; i++) {
         char pltbuf[1024] = {0};
-        sprintf(pltbuf, "'-' ");
+        // The first line names the file, the others reuse it ('').
+        // Each row is one float64 for x, and one for each y array.
+        gnuplot_sh(fp, "'%s' binary format='%%float64%%%zufloat64' ", i ? "" : gp[0]->data_file, y_count);
+        sprintf(pltbuf, "using 1:%zu ", i + 2);
         if (gp[0]->legend_toggle) {
             sprintf(pltbuf + strlen(pltbuf), "title '%s' ", gp[i]->legend_title);
             sprintf(pltbuf + strlen(pltbuf), "with lines ");
@@ -103,25 +226,70 @@ void gnuplot_plot(FILE *fp, struct GNUPLOT_PLOT **gp, double x[], double *y[], s
             if (gp[i]->line_color) {
                 sprintf(pltbuf + strlen(pltbuf), "lc rgb '#%06x' ", gp[i]->line_color);
             }
-            gnuplot_sh(fp, "%s ", pltbuf);
         } else {
-            gnuplot_sh(fp, "with lines ");
+            sprintf(pltbuf + strlen(pltbuf), "with lines ");
         }
+        gnuplot_sh(fp, "%s ", pltbuf);
         if (i < y_count - 1) {
             gnuplot_sh(fp, ", ");
         }
     }
     gnuplot_sh(fp, "\n");
+    fflush(fp);
+    return 0;
+}
 
-    // Emit MSTAT data
-    for (size_t arr = 0; arr < y_count; arr++) {
-        for (size_t i = 0; i < x_count; i++) {
-            gnuplot_sh(fp, "%lf %lf\n", x[i], y[arr][i]);
-        }
-        // Commit plot and execute
-        gnuplot_sh(fp, "e\n");
+/**
+ * Replace the data of a plot made by `gnuplot_plot` and draw it again
+ * The new data goes to a new file that is renamed over the old one, so
+ * gnuplot never reads a file that is half written.
+ * @param fp pointer to gnuplot stream
+ * @param gp pointer to an array of GNUPLOT_PLOT structures
+ * @param x an array representing the x axis
+ * @param y an array of double-precision arrays representing the y axes
+ * @param x_count total length of array x
+ * @param y_count total number of arrays in y
+ * @param output image file to write again (NULL = window)
+ * @return 0 on success. -1 on error
+ */
+int gnuplot_replot(FILE *fp, struct GNUPLOT_PLOT **gp, double x[], double *y[], size_t x_count, size_t y_count, const char *output) {
+    char *path;
+
+    path = gnuplot_write_data(x, y, x_count, y_count);
+    if (!path) {
+        return -1;
+    }
+    if (rename(path, gp[0]->data_file) < 0) {
+        perror(gp[0]->data_file);
+        unlink(path);
+        free(path);
+        return -1;
+    }
+    free(path);
+
+    if (output) {
+        // Reopening the output starts a new image. Closing it completes the file.
+        gnuplot_sh(fp, "set output '%s'\n", output);
+        gnuplot_sh(fp, "replot\n");
+        gnuplot_sh(fp, "unset output\n");
+    } else {
+        gnuplot_sh(fp, "replot\n");
     }
     fflush(fp);
+    return 0;
+}
+
+/**
+ * Remove the data file written by `gnuplot_plot`
+ * Call once gnuplot no longer needs it (after `gnuplot_close`).
+ * @param gp pointer to the first GNUPLOT_PLOT structure
+ */
+void gnuplot_remove_data(struct GNUPLOT_PLOT *gp) {
+    if (gp->data_file) {
+        unlink(gp->data_file);
+        free(gp->data_file);
+        gp->data_file = NULL;
+    }
 }
 
 unsigned int gnuplot_rgb(unsigned char r, unsigned char g, unsigned char b) {
@@ -18,13 +18,19 @@ struct GNUPLOT_PLOT {
     unsigned char legend_toggle;
     unsigned char legend_enhanced;
     char *legend_title;
+    char *data_file;
 };
 
 FILE *gnuplot_open();
+FILE *gnuplot_open_headless();
+const char *gnuplot_terminal(const char *filename);
+int gnuplot_output(FILE *fp, const char *filename, unsigned int width, unsigned int height);
 int gnuplot_close(FILE *fp);
 int gnuplot_wait(FILE *fp);
 int gnuplot_sh(FILE *fp, char *fmt, ...);
-void gnuplot_plot(FILE *fp, struct GNUPLOT_PLOT **gp, double x[], double *y[], size_t x_count, size_t y_count);
+int gnuplot_plot(FILE *fp, struct GNUPLOT_PLOT **gp, double x[], double *y[], size_t x_count, size_t y_count);
+int gnuplot_replot(FILE *fp, struct GNUPLOT_PLOT **gp, double x[], double *y[], size_t x_count, size_t y_count, const char *output);
+void gnuplot_remove_data(struct GNUPLOT_PLOT *gp);
 unsigned int gnuplot_rgb(unsigned char r, unsigned char g, unsigned char b);
 
 #endif //MSTAT_GNUPLOT_H
@@ -0,0 +1,193 @@
+#include "hist.h"
+
+/**
+ * Return the smallest value counted by a bucket
+ * @param b bucket
+ * @return value
+ */
+static unsigned long long mstat_hist_lower(size_t b) {
+    size_t shift;
+
+    if (b < MSTAT_HIST_SUB * 2) {
+        return b;
+    }
+    shift = (b >> MSTAT_HIST_BITS) - 1;
+    return ((b & (MSTAT_HIST_SUB - 1)) | MSTAT_HIST_SUB) << shift;
+}
+
+/**
+ * Return the number of values counted by a bucket
+ * @param b bucket
+ * @return width
+ */
+static unsigned long long mstat_hist_width(size_t b) {
+    if (b < MSTAT_HIST_SUB * 2) {
+        return 1;
+    }
+    return 1ULL << ((b >> MSTAT_HIST_BITS) - 1);
+}
+
+/**
+ * Prepare an empty histogram
+ * @param h pointer to histogram (modified)
+ * @return 0 on success. -1 on error
+ */
+int mstat_hist_init(struct mstat_hist_t *h) {
+    memset(h, 0, sizeof(*h));
+    h->counts = calloc(MSTAT_HIST_BUCKETS, sizeof(*h->counts));
+    if (!h->counts) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Forget every value
+ * @param h pointer to histogram
+ */
+void mstat_hist_reset(struct mstat_hist_t *h) {
+    if (h->total) {
+        memset(&h->counts[h->lo], 0, (h->hi - h->lo + 1) * sizeof(*h->counts));
+    }
+    h->total = 0;
+    h->lo = 0;
+    h->hi = 0;
+}
+
+/**
+ * Add the values of one histogram to another
+ * @param dest pointer to histogram (modified)
+ * @param src pointer to histogram
+ */
+void mstat_hist_merge(struct mstat_hist_t *dest, const struct mstat_hist_t *src) {
+    if (!src->total) {
+        return;
+    }
+    for (size_t b = src->lo; b <= src->hi; b++) {
+        dest->counts[b] += src->counts[b];
+    }
+    if (!dest->total || src->lo < dest->lo) {
+        dest->lo = src->lo;
+    }
+    if (!dest->total || src->hi > dest->hi) {
+        dest->hi = src->hi;
+    }
+    dest->total += src->total;
+}
+
+/**
+ * Return a quantile
+ * The result is the middle of the bucket holding the quantile, so it is
+ * within 1/MSTAT_HIST_SUB of the exact value.
+ * @param h pointer to histogram
+ * @param q quantile (0.0 - 1.0)
+ * @return value (0 when the histogram is empty)
+ */
+unsigned long long mstat_hist_quantile(const struct mstat_hist_t *h, double q) {
+    size_t rank;
+    size_t seen = 0;
+
+    if (!h->total) {
+        return 0;
+    }
+    if (q < 0.0) {
+        q = 0.0;
+    } else if (q > 1.0) {
+        q = 1.0;
+    }
+    // Rank of the value (1 .. total)
+    rank = (size_t) (q * (double) h->total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    } else if (rank > h->total) {
+        rank = h->total;
+    }
+    for (size_t b = h->lo; b <= h->hi; b++) {
+        seen += h->counts[b];
+        if (seen >= rank) {
+            return mstat_hist_lower(b) + mstat_hist_width(b) / 2;
+        }
+    }
+    return mstat_hist_lower(h->hi);
+}
+
+/**
+ * Write a histogram to a stream
+ *
+ * 0x00 - 0x08 = number of values (8 bytes)
+ * 0x08 - 0x10 = number of buckets that follow (8 bytes)
+ * 0x10 - ...  = bucket (unsigned int), count (8 bytes) (n... bytes)
+ *
+ * Only buckets holding values are written.
+ *
+ * @param fp pointer to stream
+ * @param h pointer to histogram
+ * @return 0 on success. -1 on error
+ */
+int mstat_hist_write(FILE *fp, const struct mstat_hist_t *h) {
+    unsigned long long total = h->total;
+    unsigned long long used = 0;
+
+    for (size_t b = h->lo; h->total && b <= h->hi; b++) {
+        used += h->counts[b] != 0;
+    }
+    if (!fwrite(&total, sizeof(total), 1, fp)) return -1;
+    if (!fwrite(&used, sizeof(used), 1, fp)) return -1;
+    for (size_t b = h->lo; h->total && b <= h->hi; b++) {
+        unsigned int bucket = (unsigned int) b;
+        unsigned long long count = h->counts[b];
+        if (!count) {
+            continue;
+        }
+        if (!fwrite(&bucket, sizeof(bucket), 1, fp)) return -1;
+        if (!fwrite(&count, sizeof(count), 1, fp)) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read a histogram written by mstat_hist_write
+ * The values are added to the histogram.
+ * @param fp pointer to stream
+ * @param h pointer to histogram (modified)
+ * @return 0 on success. -1 on error
+ */
+int mstat_hist_read(FILE *fp, struct mstat_hist_t *h) {
+    unsigned long long total;
+    unsigned long long used;
+    unsigned long long sum = 0;
+
+    if (!fread(&total, sizeof(total), 1, fp)) return -1;
+    if (!fread(&used, sizeof(used), 1, fp)) return -1;
+    if (used > MSTAT_HIST_BUCKETS) {
+        return -1;
+    }
+    for (unsigned long long i = 0; i < used; i++) {
+        unsigned int bucket;
+        unsigned long long count;
+        if (!fread(&bucket, sizeof(bucket), 1, fp)) return -1;
+        if (!fread(&count, sizeof(count), 1, fp)) return -1;
+        if (bucket >= MSTAT_HIST_BUCKETS) {
+            return -1;
+        }
+        h->counts[bucket] += count;
+        if (!h->total || bucket < h->lo) {
+            h->lo = bucket;
+        }
+        if (!h->total || bucket > h->hi) {
+            h->hi = bucket;
+        }
+        h->total += count;
+        sum += count;
+    }
+    return sum == total ? 0 : -1;
+}
+
+/**
+ * Release resources held by a histogram
+ * @param h pointer to histogram
+ */
+void mstat_hist_free(struct mstat_hist_t *h) {
+    free(h->counts);
+    memset(h, 0, sizeof(*h));
+}
@@ -0,0 +1,73 @@
+#ifndef MSTAT_HIST_H
+#define MSTAT_HIST_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Sub-buckets per power of two (2^MSTAT_HIST_BITS). Relative error of a quantile is below 1/2^MSTAT_HIST_BITS.
+#define MSTAT_HIST_BITS 7
+#define MSTAT_HIST_SUB (1ULL << MSTAT_HIST_BITS)
+// Buckets needed to cover every 64-bit value
+#define MSTAT_HIST_BUCKETS ((64 - MSTAT_HIST_BITS + 1) * MSTAT_HIST_SUB)
+
+/*
+ * Log-linear histogram of unsigned integers (HDR histogram layout).
+ * Values below MSTAT_HIST_SUB are counted exactly. Above that, every
+ * power of two is split into MSTAT_HIST_SUB equal buckets. Two
+ * histograms are merged by adding their counts, so summaries of
+ * separate recordings combine without the original values.
+ */
+struct mstat_hist_t {
+    /** Values per bucket (MSTAT_HIST_BUCKETS) */
+    size_t *counts;
+    /** Total number of values */
+    size_t total;
+    /** Lowest bucket in use */
+    size_t lo;
+    /** Highest bucket in use */
+    size_t hi;
+};
+
+int mstat_hist_init(struct mstat_hist_t *h);
+void mstat_hist_reset(struct mstat_hist_t *h);
+void mstat_hist_merge(struct mstat_hist_t *dest, const struct mstat_hist_t *src);
+unsigned long long mstat_hist_quantile(const struct mstat_hist_t *h, double q);
+int mstat_hist_write(FILE *fp, const struct mstat_hist_t *h);
+int mstat_hist_read(FILE *fp, struct mstat_hist_t *h);
+void mstat_hist_free(struct mstat_hist_t *h);
+
+/**
+ * Return the bucket of a value
+ * @param value value
+ * @return bucket
+ */
+static inline size_t mstat_hist_bucket(unsigned long long value) {
+    int msb;
+    int shift;
+
+    if (value < MSTAT_HIST_SUB) {
+        return (size_t) value;
+    }
+    msb = 63 - __builtin_clzll(value);
+    shift = msb - MSTAT_HIST_BITS;
+    return ((size_t) (shift + 1) << MSTAT_HIST_BITS) | (size_t) ((value >> shift) & (MSTAT_HIST_SUB - 1));
+}
+
+/**
+ * Count a value
+ * @param h pointer to histogram
+ * @param value value
+ */
+static inline void mstat_hist_add(struct mstat_hist_t *h, unsigned long long value) {
+    size_t b = mstat_hist_bucket(value);
+    h->counts[b]++;
+    if (!h->total++) {
+        h->lo = h->hi = b;
+    } else if (b < h->lo) {
+        h->lo = b;
+    } else if (b > h->hi) {
+        h->hi = b;
+    }
+}
+
+#endif //MSTAT_HIST_H
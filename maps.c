@@ -0,0 +1,660 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include "maps.h"
+#include "codec.h"
+
+/*
+ * Per-mapping sampling reads the full /proc/PID/smaps and sums the
+ * values of every VMA into one entry per mapping name: each file, the
+ * pseudo mappings ([heap], [stack], [vdso], named anonymous regions, ...)
+ * and MSTAT_MAPS_ANON for anonymous memory without a name.
+ *
+ * The companion file starts with a header:
+ *
+ *   0x00  "MSTATMAP"
+ *   0x08  format version (u32)
+ *   0x0C  byte order mark (u32)
+ *   0x10  values per mapping (u32)
+ *   0x14  pid (i32)
+ *   0x18  value names (NUL terminated, one per value)
+ *
+ * followed by a stream of tagged entries:
+ *
+ *   'N' id name_len name         a mapping seen for the first time
+ *   'S' timestamp count entries  a sample (timestamp is a f64)
+ *
+ * A sample only lists the mappings that changed since the previous
+ * sample. Each entry is the mapping id followed by the difference of
+ * every value to its last stored value. All integers are varints;
+ * differences are zigzag encoded.
+ */
+
+// smaps is read in chunks of this size
+#define MSTAT_MAPS_CHUNK 0x100000
+// Initial number of slots in the mapping table
+#define MSTAT_MAPS_TABLE_SIZE 256
+
+char *mstat_maps_value_names[] = {
+#define MSTAT_MAPS_X(id, name, key, field) #name,
+        MSTAT_MAPS_SCHEMA(MSTAT_MAPS_X)
+#undef MSTAT_MAPS_X
+        "vmas",
+        NULL,
+};
+
+/**
+ * Per-mapping value of each smaps key, indexed by the id of mstat_smaps_lookup
+ * (MSTAT_MAPS_VALUE_* + 1, 0 = not summed per mapping)
+ */
+static const unsigned char mstat_maps_values[MSTAT_SMAPS_KEY_MAX] = {
+#define MSTAT_MAPS_X(id, name, key, field) [key] = MSTAT_MAPS_VALUE_##id + 1,
+        MSTAT_MAPS_SCHEMA(MSTAT_MAPS_X)
+#undef MSTAT_MAPS_X
+};
+
+/**
+ * MSTAT record field the totals of each value are added to, indexed by MSTAT_MAPS_VALUE_* id
+ */
+static const size_t mstat_maps_offsets[] = {
+#define MSTAT_MAPS_X(id, name, key, field) offsetof(struct mstat_record_t, field),
+        MSTAT_MAPS_SCHEMA(MSTAT_MAPS_X)
+#undef MSTAT_MAPS_X
+};
+
+/**
+ * Populate the smaps key lookup table
+ */
+void mstat_maps_init() {
+    mstat_smaps_init();
+}
+
+/**
+ * Hash a mapping name (FNV-1a)
+ * @param name mapping name (not terminated)
+ * @param len length of name
+ * @return hash
+ */
+static inline unsigned long long mstat_maps_hash_name(const char *name, size_t len) {
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Create a mapping and add it to the mapping table
+ * @param m pointer to per-mapping sampler
+ * @param name mapping name (not terminated)
+ * @param len length of name
+ * @param hash hash of name
+ * @return pointer to mapping. NULL on error
+ */
+static struct mstat_mapping_t *mstat_maps_add(struct mstat_maps_t *m, const char *name, size_t len, unsigned long long hash) {
+    struct mstat_mapping_t *mapping;
+    size_t slot;
+
+    // Keep the table at most half full
+    if ((m->count + 1) * 2 > m->table_size) {
+        size_t size = m->table_size ? m->table_size * 2 : MSTAT_MAPS_TABLE_SIZE;
+        struct mstat_mapping_t **table = calloc(size, sizeof(*table));
+        if (!table) {
+            return NULL;
+        }
+        for (size_t i = 0; i < m->count; i++) {
+            slot = m->mappings[i]->hash & (size - 1);
+            while (table[slot]) {
+                slot = (slot + 1) & (size - 1);
+            }
+            table[slot] = m->mappings[i];
+        }
+        free(m->table);
+        m->table = table;
+        m->table_size = size;
+    }
+    if (m->count == m->capacity) {
+        size_t capacity = m->capacity ? m->capacity * 2 : MSTAT_MAPS_TABLE_SIZE;
+        struct mstat_mapping_t **tmp = realloc(m->mappings, capacity * sizeof(*tmp));
+        if (!tmp) {
+            return NULL;
+        }
+        m->mappings = tmp;
+        m->capacity = capacity;
+    }
+
+    mapping = calloc(1, sizeof(*mapping));
+    if (!mapping) {
+        return NULL;
+    }
+    mapping->name = malloc(len + 1);
+    if (!mapping->name) {
+        free(mapping);
+        return NULL;
+    }
+    memcpy(mapping->name, name, len);
+    mapping->name[len] = '\0';
+    mapping->len = len;
+    mapping->hash = hash;
+    mapping->id = m->count;
+
+    slot = hash & (m->table_size - 1);
+    while (m->table[slot]) {
+        slot = (slot + 1) & (m->table_size - 1);
+    }
+    m->table[slot] = mapping;
+    m->mappings[m->count++] = mapping;
+    return mapping;
+}
+
+/**
+ * Find a mapping by name, creating it on first use
+ * @param m pointer to per-mapping sampler
+ * @param name mapping name (not terminated)
+ * @param len length of name
+ * @return pointer to mapping. NULL on error
+ */
+static struct mstat_mapping_t *mstat_maps_find(struct mstat_maps_t *m, const char *name, size_t len) {
+    unsigned long long hash;
+    struct mstat_mapping_t *mapping;
+    size_t slot;
+
+    // Consecutive VMAs usually belong to the same file
+    if (m->current && m->current->len == len && !memcmp(m->current->name, name, len)) {
+        return m->current;
+    }
+
+    hash = mstat_maps_hash_name(name, len);
+    if (m->table_size) {
+        slot = hash & (m->table_size - 1);
+        while ((mapping = m->table[slot]) != NULL) {
+            if (mapping->hash == hash && mapping->len == len && !memcmp(mapping->name, name, len)) {
+                return mapping;
+            }
+            slot = (slot + 1) & (m->table_size - 1);
+        }
+    }
+    return mstat_maps_add(m, name, len, hash);
+}
+
+/**
+ * Open /proc/`pid`/smaps for repeated per-mapping sampling
+ * @param m pointer to per-mapping sampler
+ * @param pid of target process
+ * @return 0 on success. -1 on error (errno is set)
+ */
+int mstat_maps_open(struct mstat_maps_t *m, pid_t pid) {
+    char path[PATH_MAX] = {0};
+
+    memset(m, 0, sizeof(*m));
+    m->pid = pid;
+    snprintf(path, sizeof(path) - 1, "/proc/%d/smaps", pid);
+    m->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (m->fd < 0) {
+        return -1;
+    }
+
+    m->size = MSTAT_MAPS_CHUNK;
+    m->data = malloc(m->size);
+    if (!m->data) {
+        close(m->fd);
+        m->fd = -1;
+        return -1;
+    }
+    mstat_maps_init();
+    return 0;
+}
+
+/**
+ * Consume smaps text held in memory
+ *
+ * Only complete lines are parsed. A mapping header line selects the
+ * mapping the following value lines are added to, so a sample may be
+ * parsed in any number of pieces.
+ *
+ * @param m pointer to per-mapping sampler
+ * @param data smaps text
+ * @param len length of data
+ * @return number of bytes consumed
+ */
+size_t mstat_maps_parse(struct mstat_maps_t *m, const char *data, size_t len) {
+    const char *pos = data;
+    const char *end = data + len;
+
+    while (pos < end) {
+        const char *eol = memchr(pos, '\n', end - pos);
+        unsigned char c = (unsigned char) *pos;
+
+        if (!eol) {
+            break;
+        }
+        if ((unsigned) (c - '0') < 10 || (unsigned) (c - 'a') < 6) {
+            // Mapping header: start-end perms offset dev inode [name]
+            const char *name = pos;
+            size_t name_len;
+            struct mstat_mapping_t *mapping;
+
+            for (int i = 0; i < 5 && name < eol; i++) {
+                while (name < eol && *name != ' ') {
+                    name++;
+                }
+                while (name < eol && *name == ' ') {
+                    name++;
+                }
+            }
+            name_len = eol - name;
+            if (!name_len) {
+                name = MSTAT_MAPS_ANON;
+                name_len = sizeof(MSTAT_MAPS_ANON) - 1;
+            }
+
+            mapping = mstat_maps_find(m, name, name_len);
+            if (mapping && mapping->generation != m->generation) {
+                memset(mapping->value, 0, sizeof(mapping->value));
+                mapping->generation = m->generation;
+            }
+            if (mapping) {
+                mapping->value[MSTAT_MAPS_VALUE_VMAS]++;
+            }
+            m->current = mapping;
+        } else if (m->current) {
+            const char *key = pos;
+            const struct mstat_smaps_key_t *k;
+
+            while (pos < eol && *pos != ':') {
+                pos++;
+            }
+            if (pos < eol && pos > key && (k = mstat_smaps_lookup(key, pos - key)) != NULL
+                && mstat_maps_values[k->id]) {
+                size_t value = 0;
+                pos++;
+                while (pos < eol && *pos == ' ') {
+                    pos++;
+                }
+                while (pos < eol && (unsigned) (*pos - '0') < 10) {
+                    value = value * 10 + (size_t) (*pos - '0');
+                    pos++;
+                }
+                m->current->value[mstat_maps_values[k->id] - 1] += value;
+            }
+        }
+        pos = eol + 1;
+    }
+    return pos - data;
+}
+
+/**
+ * Add the values of every mapping to a MSTAT record
+ *
+ * smaps has no Pss_Anon, Pss_File or Pss_Shmem lines, so those fields
+ * are left untouched.
+ *
+ * @param m pointer to per-mapping sampler
+ * @param p pointer to MSTAT record (modified)
+ */
+void mstat_maps_total(const struct mstat_maps_t *m, struct mstat_record_t *p) {
+    for (size_t f = 0; f < sizeof(mstat_maps_offsets) / sizeof(*mstat_maps_offsets); f++) {
+        size_t total = 0;
+        for (size_t i = 0; i < m->count; i++) {
+            total += m->mappings[i]->value[f];
+        }
+        *(size_t *) ((char *) p + mstat_maps_offsets[f]) += total;
+    }
+}
+
+/**
+ * Sample the memory values of every mapping of the process
+ *
+ * smaps is read in chunks and parsed as it arrives, so memory use does
+ * not grow with the number of VMAs. Mappings missing from the sample
+ * were unmapped and drop to zero. Like smaps_rollup, smaps is reopened
+ * once when the process has exec'd.
+ *
+ * @param m pointer to per-mapping sampler
+ * @param p pointer to MSTAT record. Totals are added to it (may be NULL)
+ * @return 0 on success. -1 on error (errno is ESRCH when the process has exited)
+ */
+int mstat_maps_read(struct mstat_maps_t *m, struct mstat_record_t *p) {
+    size_t have = 0;
+    off_t offset = 0;
+    int reopened = 0;
+
+    m->generation++;
+    m->current = NULL;
+    while (1) {
+        ssize_t len = pread(m->fd, m->data + have, m->size - have, offset);
+        size_t used;
+
+        if (len <= 0 && !offset && !reopened && (len == 0 || errno == ESRCH)) {
+            char path[PATH_MAX] = {0};
+            int fd;
+
+            reopened = 1;
+            snprintf(path, sizeof(path) - 1, "/proc/%d/smaps", m->pid);
+            fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                errno = ESRCH;
+                return -1;
+            }
+            close(m->fd);
+            m->fd = fd;
+            continue;
+        }
+        if (len < 0) {
+            return -1;
+        }
+        if (len == 0) {
+            break;
+        }
+        offset += len;
+        have += (size_t) len;
+
+        used = mstat_maps_parse(m, m->data, have);
+        if (!used && have == m->size) {
+            // A line longer than the buffer cannot be parsed. Skip it.
+            used = have;
+        }
+        memmove(m->data, m->data + used, have - used);
+        have -= used;
+    }
+    if (!offset) {
+        errno = ESRCH;
+        return -1;
+    }
+
+    for (size_t i = 0; i < m->count; i++) {
+        struct mstat_mapping_t *mapping = m->mappings[i];
+        if (mapping->generation != m->generation) {
+            memset(mapping->value, 0, sizeof(mapping->value));
+        } else if (!mapping->seen) {
+            mapping->rss_first = mapping->value[MSTAT_MAPS_VALUE_RSS];
+            mapping->seen = 1;
+        }
+    }
+    if (p) {
+        mstat_maps_total(m, p);
+    }
+    return 0;
+}
+
+/**
+ * Make room in the encoding buffer
+ * @param m pointer to per-mapping sampler
+ * @param size bytes required
+ * @return 0 on success. -1 on error
+ */
+static int mstat_maps_reserve(struct mstat_maps_t *m, size_t size) {
+    size_t out_size = m->out_size ? m->out_size : BUFSIZ;
+    char *tmp;
+
+    if (size <= m->out_size) {
+        return 0;
+    }
+    while (out_size < size) {
+        out_size *= 2;
+    }
+    tmp = realloc(m->out, out_size);
+    if (!tmp) {
+        return -1;
+    }
+    m->out = tmp;
+    m->out_size = out_size;
+    return 0;
+}
+
+/**
+ * Write the header of a companion file
+ * @param fp pointer to companion file stream
+ * @param pid of sampled process
+ * @return 0 on success. -1 on error
+ */
+int mstat_maps_write_header(FILE *fp, pid_t pid) {
+    unsigned int version = MSTAT_MAPS_VERSION;
+    unsigned int byte_order = MSTAT_BOM;
+    unsigned int fields = MSTAT_MAPS_VALUE_MAX;
+    int id = pid;
+
+    if (!fwrite(MSTAT_MAPS_MAGIC, MSTAT_MAPS_MAGIC_SIZE, 1, fp)
+        || !fwrite(&version, sizeof(version), 1, fp)
+        || !fwrite(&byte_order, sizeof(byte_order), 1, fp)
+        || !fwrite(&fields, sizeof(fields), 1, fp)
+        || !fwrite(&id, sizeof(id), 1, fp)) {
+        return -1;
+    }
+    for (size_t i = 0; mstat_maps_value_names[i] != NULL; i++) {
+        if (!fwrite(mstat_maps_value_names[i], strlen(mstat_maps_value_names[i]) + 1, 1, fp)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Append the mappings that changed since the last call to a companion file
+ * @param m pointer to per-mapping sampler
+ * @param fp pointer to companion file stream
+ * @param timestamp of the sample
+ * @return 0 on success. -1 on error
+ */
+int mstat_maps_write(struct mstat_maps_t *m, FILE *fp, double timestamp) {
+    size_t len = 0;
+    size_t changed = 0;
+
+    for (size_t i = m->named; i < m->count; i++) {
+        struct mstat_mapping_t *mapping = m->mappings[i];
+        if (mstat_maps_reserve(m, len + mapping->len + 21) < 0) {
+            return -1;
+        }
+        m->out[len++] = MSTAT_MAPS_TAG_NAME;
+        len += mstat_varint_put(m->out + len, mapping->id);
+        len += mstat_varint_put(m->out + len, mapping->len);
+        memcpy(m->out + len, mapping->name, mapping->len);
+        len += mapping->len;
+    }
+    m->named = m->count;
+
+    for (size_t i = 0; i < m->count; i++) {
+        if (memcmp(m->mappings[i]->value, m->mappings[i]->stored, sizeof(m->mappings[i]->value))) {
+            changed++;
+        }
+    }
+
+    if (changed) {
+        if (mstat_maps_reserve(m, len + 1 + sizeof(timestamp) + 10 + changed * (MSTAT_MAPS_VALUE_MAX + 1) * 10) < 0) {
+            return -1;
+        }
+        m->out[len++] = MSTAT_MAPS_TAG_SAMPLE;
+        memcpy(m->out + len, &timestamp, sizeof(timestamp));
+        len += sizeof(timestamp);
+        len += mstat_varint_put(m->out + len, changed);
+        for (size_t i = 0; i < m->count; i++) {
+            struct mstat_mapping_t *mapping = m->mappings[i];
+            if (!memcmp(mapping->value, mapping->stored, sizeof(mapping->value))) {
+                continue;
+            }
+            len += mstat_varint_put(m->out + len, mapping->id);
+            for (size_t f = 0; f < MSTAT_MAPS_VALUE_MAX; f++) {
+                long long delta = (long long) (mapping->value[f] - mapping->stored[f]);
+                len += mstat_varint_put(m->out + len, mstat_zigzag(delta));
+            }
+            memcpy(mapping->stored, mapping->value, sizeof(mapping->value));
+        }
+    }
+
+    if (len && !fwrite(m->out, len, 1, fp)) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read a varint from a file stream
+ * @param fp pointer to file stream
+ * @param value pointer to decoded integer (modified)
+ * @return 0 on success. -1 if the stream ends early
+ */
+static int mstat_maps_get_varint(FILE *fp, unsigned long long *value) {
+    unsigned long long result = 0;
+    unsigned shift = 0;
+    int byte;
+
+    while ((byte = getc(fp)) != EOF && shift < 64) {
+        result |= (unsigned long long) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return 0;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+/**
+ * Read the header of a companion file and prepare to read its samples
+ * @param fp pointer to companion file stream
+ * @param m pointer to per-mapping sampler (initialized)
+ * @return 0 on success. -1 if fp is not a companion file
+ */
+int mstat_maps_read_header(FILE *fp, struct mstat_maps_t *m) {
+    char magic[MSTAT_MAPS_MAGIC_SIZE];
+    unsigned int version, byte_order, fields;
+    int pid;
+
+    memset(m, 0, sizeof(*m));
+    m->fd = -1;
+    if (!fread(magic, sizeof(magic), 1, fp)
+        || memcmp(magic, MSTAT_MAPS_MAGIC, sizeof(magic)) != 0
+        || !fread(&version, sizeof(version), 1, fp)
+        || !fread(&byte_order, sizeof(byte_order), 1, fp)
+        || !fread(&fields, sizeof(fields), 1, fp)
+        || !fread(&pid, sizeof(pid), 1, fp)) {
+        return -1;
+    }
+    if (version > MSTAT_MAPS_VERSION || byte_order != MSTAT_BOM || !fields) {
+        return -1;
+    }
+    m->pid = pid;
+    m->fields = fields;
+
+    m->names = calloc(fields + 1, sizeof(*m->names));
+    if (!m->names) {
+        return -1;
+    }
+    for (size_t i = 0; i < fields; i++) {
+        char name[255] = {0};
+        size_t len = 0;
+        int ch;
+
+        while ((ch = getc(fp)) != EOF && ch != '\0') {
+            if (len < sizeof(name) - 1) {
+                name[len++] = (char) ch;
+            }
+        }
+        if (ch == EOF) {
+            return -1;
+        }
+        m->names[i] = strdup(name);
+        if (!m->names[i]) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Read the next sample of a companion file
+ *
+ * Mappings listed in the sample have their values updated and their
+ * `generation` set to the sample number (`m->generation`).
+ *
+ * @param fp pointer to companion file stream (past the header)
+ * @param m pointer to per-mapping sampler (see mstat_maps_read_header())
+ * @param timestamp pointer to sample time (modified)
+ * @return 1 when a sample was read. 0 at the end of the stream. -1 if the stream is damaged
+ */
+int mstat_maps_iter(FILE *fp, struct mstat_maps_t *m, double *timestamp) {
+    int tag;
+
+    while ((tag = getc(fp)) != EOF) {
+        unsigned long long id, len, count;
+
+        if (tag == MSTAT_MAPS_TAG_NAME) {
+            char *name;
+            if (mstat_maps_get_varint(fp, &id) < 0 || id != m->count
+                || mstat_maps_get_varint(fp, &len) < 0 || len > PATH_MAX * 2) {
+                return -1;
+            }
+            name = malloc(len + 1);
+            if (!name) {
+                return -1;
+            }
+            if (len && !fread(name, len, 1, fp)) {
+                free(name);
+                return -1;
+            }
+            if (!mstat_maps_add(m, name, len, mstat_maps_hash_name(name, len))) {
+                free(name);
+                return -1;
+            }
+            free(name);
+        } else if (tag == MSTAT_MAPS_TAG_SAMPLE) {
+            if (!fread(timestamp, sizeof(*timestamp), 1, fp) || mstat_maps_get_varint(fp, &count) < 0) {
+                return -1;
+            }
+            m->generation++;
+            for (size_t i = 0; i < count; i++) {
+                struct mstat_mapping_t *mapping;
+
+                if (mstat_maps_get_varint(fp, &id) < 0 || id >= m->count) {
+                    return -1;
+                }
+                mapping = m->mappings[id];
+                for (size_t f = 0; f < m->fields; f++) {
+                    unsigned long long raw;
+                    if (mstat_maps_get_varint(fp, &raw) < 0) {
+                        return -1;
+                    }
+                    if (f < MSTAT_MAPS_VALUE_MAX) {
+                        mapping->value[f] += (size_t) mstat_unzigzag(raw);
+                    }
+                }
+                if (!mapping->seen) {
+                    mapping->rss_first = mapping->value[MSTAT_MAPS_VALUE_RSS];
+                    mapping->seen = 1;
+                }
+                mapping->generation = m->generation;
+            }
+            return 1;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Release resources held by a per-mapping sampler
+ * @param m pointer to per-mapping sampler
+ */
+void mstat_maps_close(struct mstat_maps_t *m) {
+    if (m->fd >= 0) {
+        close(m->fd);
+    }
+    for (size_t i = 0; i < m->count; i++) {
+        free(m->mappings[i]->name);
+        free(m->mappings[i]);
+    }
+    if (m->names) {
+        for (size_t i = 0; m->names[i] != NULL; i++) {
+            free(m->names[i]);
+        }
+    }
+    free(m->names);
+    free(m->mappings);
+    free(m->table);
+    free(m->data);
+    free(m->out);
+    memset(m, 0, sizeof(*m));
+    m->fd = -1;
+}
@@ -0,0 +1,119 @@
+#ifndef MSTAT_MAPS_H
+#define MSTAT_MAPS_H
+#include "common.h"
+
+#define MSTAT_MAPS_MAGIC "MSTATMAP"
+#define MSTAT_MAPS_MAGIC_SIZE 0x08
+#define MSTAT_MAPS_VERSION 1
+// Companion file name: <MSTAT file><MSTAT_MAPS_SUFFIX>
+#define MSTAT_MAPS_SUFFIX ".maps"
+// Stream tags
+#define MSTAT_MAPS_TAG_NAME 'N'
+#define MSTAT_MAPS_TAG_SAMPLE 'S'
+// Name given to anonymous mappings without a name
+#define MSTAT_MAPS_ANON "[anon]"
+
+/*
+ * Values summed per mapping. One line per value:
+ *
+ *   X(ID, name, smaps key id (see mstat_smaps_lookup), MSTAT record field the totals are added to)
+ *
+ * MSTAT_MAPS_VALUE_VMAS (the number of VMAs) follows the smaps values.
+ */
+#define MSTAT_MAPS_SCHEMA(X) \
+    X(SIZE, size, MSTAT_SMAPS_KEY_SIZE, vm_size) \
+    X(RSS, rss, MSTAT_FIELD_RSS, rss) \
+    X(PSS, pss, MSTAT_FIELD_PSS, pss) \
+    X(SHARED_CLEAN, shared_clean, MSTAT_FIELD_SHARED_CLEAN, shared_clean) \
+    X(SHARED_DIRTY, shared_dirty, MSTAT_FIELD_SHARED_DIRTY, shared_dirty) \
+    X(PRIVATE_CLEAN, private_clean, MSTAT_FIELD_PRIVATE_CLEAN, private_clean) \
+    X(PRIVATE_DIRTY, private_dirty, MSTAT_FIELD_PRIVATE_DIRTY, private_dirty) \
+    X(REFERENCED, referenced, MSTAT_FIELD_REFERENCED, referenced) \
+    X(ANONYMOUS, anonymous, MSTAT_FIELD_ANONYMOUS, anonymous) \
+    X(LAZY_FREE, lazy_free, MSTAT_FIELD_LAZY_FREE, lazy_free) \
+    X(ANON_HUGE_PAGES, anon_huge_pages, MSTAT_FIELD_ANON_HUGE_PAGES, anon_huge_pages) \
+    X(SHMEM_PMD_MAPPED, shmem_pmd_mapped, MSTAT_FIELD_SHMEM_PMD_MAPPED, shmem_pmd_mapped) \
+    X(FILE_PMD_MAPPED, file_pmd_mapped, MSTAT_FIELD_FILE_PMD_MAPPED, file_pmd_mapped) \
+    X(SHARED_HUGETLB, shared_hugetlb, MSTAT_FIELD_SHARED_HUGETLB, shared_hugetlb) \
+    X(PRIVATE_HUGETLB, private_hugetlb, MSTAT_FIELD_PRIVATE_HUGETLB, private_hugetlb) \
+    X(SWAP, swap, MSTAT_FIELD_SWAP, swap) \
+    X(SWAP_PSS, swap_pss, MSTAT_FIELD_SWAP_PSS, swap_pss) \
+    X(LOCKED, locked, MSTAT_FIELD_LOCKED, locked)
+
+enum {
+#define MSTAT_MAPS_X(id, name, key, field) MSTAT_MAPS_VALUE_##id,
+    MSTAT_MAPS_SCHEMA(MSTAT_MAPS_X)
+#undef MSTAT_MAPS_X
+    MSTAT_MAPS_VALUE_VMAS,
+    MSTAT_MAPS_VALUE_MAX,
+};
+
+struct mstat_mapping_t {
+    /** Mapping name (path, [heap], [stack], [anon], ...) */
+    char *name;
+    /** Length of name */
+    size_t len;
+    /** Hash of name */
+    unsigned long long hash;
+    /** Position in mstat_maps_t.mappings */
+    size_t id;
+    /** Sample that last updated value */
+    size_t generation;
+    /** RSS when the mapping was first seen (kB) */
+    size_t rss_first;
+    /** Nonzero once rss_first is set */
+    int seen;
+    /** Current values (kB, MSTAT_MAPS_VALUE_VMAS is a count) */
+    size_t value[MSTAT_MAPS_VALUE_MAX];
+    /** Values last written to the companion file */
+    size_t stored[MSTAT_MAPS_VALUE_MAX];
+};
+
+struct mstat_maps_t {
+    /** PID being sampled */
+    pid_t pid;
+    /** Descriptor of /proc/PID/smaps */
+    int fd;
+    /** Read buffer */
+    char *data;
+    /** Size of read buffer */
+    size_t size;
+    /** Hash table of mappings (open addressing) */
+    struct mstat_mapping_t **table;
+    /** Slots in table (power of two) */
+    size_t table_size;
+    /** Mappings in order of appearance */
+    struct mstat_mapping_t **mappings;
+    /** Number of mappings */
+    size_t count;
+    /** Capacity of mappings */
+    size_t capacity;
+    /** Mapping the lines being parsed belong to */
+    struct mstat_mapping_t *current;
+    /** Mappings whose names were written to the companion file */
+    size_t named;
+    /** Number of the current sample */
+    size_t generation;
+    /** Values per mapping stored in the companion file being read */
+    size_t fields;
+    /** Value names stored in the companion file being read (NULL terminated) */
+    char **names;
+    /** Encoding buffer */
+    char *out;
+    /** Size of encoding buffer */
+    size_t out_size;
+};
+
+extern char *mstat_maps_value_names[];
+void mstat_maps_init();
+int mstat_maps_open(struct mstat_maps_t *m, pid_t pid);
+int mstat_maps_read(struct mstat_maps_t *m, struct mstat_record_t *p);
+size_t mstat_maps_parse(struct mstat_maps_t *m, const char *data, size_t len);
+void mstat_maps_total(const struct mstat_maps_t *m, struct mstat_record_t *p);
+int mstat_maps_write_header(FILE *fp, pid_t pid);
+int mstat_maps_write(struct mstat_maps_t *m, FILE *fp, double timestamp);
+int mstat_maps_read_header(FILE *fp, struct mstat_maps_t *m);
+int mstat_maps_iter(FILE *fp, struct mstat_maps_t *m, double *timestamp);
+void mstat_maps_close(struct mstat_maps_t *m);
+
+#endif //MSTAT_MAPS_H
@@ -1,9 +1,18 @@
 #include <errno.h>
 #include <dirent.h>
+#include <libgen.h>
 #include <signal.h>
 #include <time.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include "common.h"
+#include "writer.h"
+#include "maps.h"
+#include "cgroup.h"
+#include "system.h"
+#include "tree.h"
+#include "events.h"
+#include "psi.h"
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
@@ -17,6 +26,18 @@ static struct Option {
     unsigned char clobber;
     /** PID to track */
     pid_t pid;
+    /** cgroup v2 directory to track (empty = track a process) */
+    char cgroup[PATH_MAX];
+    /** Track every process on the host */
+    unsigned char system;
+    /** Track the process and its descendants */
+    unsigned char tree;
+    /** Threads sampling processes in system and tree mode */
+    size_t workers;
+    /** Batch the reads of system and tree mode with io_uring (when available) */
+    unsigned char uring;
+    /** PID was started by mstat (PROGRAM) */
+    unsigned char child;
     /** PID subprocess status */
     int status;
     /** Output file handle to track */
@@ -27,31 +48,273 @@ static struct Option {
     char filename[PATH_MAX];
     /** Number of times per second mstat samples a pid */
     double sample_rate;
+    /** Number of times per second mstat probes statm (0 = disabled) */
+    double probe_rate;
+    /** Highest adaptive sample rate (0 = fixed rate) */
+    double adapt_rate;
+    /** Change of RSS or PSS that raises the adaptive rate (kB per second) */
+    double adapt_threshold;
+    /** Largest share of wall time spent reading smaps (percent, 0 = unlimited) */
+    double max_overhead;
+    /** Sample rate while memory pressure lasts (0 = no PSI trigger) */
+    double burst_rate;
+    /** Seconds the burst rate is kept after the PSI trigger fires */
+    double burst_window;
     /** Maximum number of samples (0 = disabled) */
     size_t sample_limit;
+    /** Store sampler statistics in a trailer */
+    unsigned char trailer;
+    /** Write compressed records */
+    unsigned char compress;
+    /** Record per-mapping values from /proc/PID/smaps */
+    unsigned char maps;
+    /** Per-mapping output file handle */
+    FILE *maps_file;
+    /** Per-mapping output filename (filename with MSTAT_MAPS_SUFFIX) */
+    char maps_filename[PATH_MAX + sizeof(MSTAT_MAPS_SUFFIX)];
 } option;
 
+static struct mstat_sched_t sched;
+static struct mstat_adapt_t adapt;
+static struct mstat_throttle_t throttle;
+// Samples taken at a rate lowered by --max-overhead
+static size_t throttled;
+static struct mstat_writer_t writer;
+static struct mstat_maps_t maps;
+static struct mstat_cgroup_t cgroup;
+static struct mstat_system_t system_sampler;
+static struct mstat_tree_t tree;
+static struct mstat_events_t events;
+static struct mstat_psi_t psi;
+// End of the burst started by the last PSI event (CLOCK_MONOTONIC seconds)
+static double burst_end;
+
+// Mappings listed in the growth summary
+#define MSTAT_MAPS_GROWTH_TOP 10
+// Processes shown per tick in system and tree mode (verbose)
+#define MSTAT_SYSTEM_TOP 10
+
+// Costs of the sample loop, measured on every tick
+enum {
+    PROFILE_READ = 0,
+    PROFILE_PARSE,
+    PROFILE_PROBE,
+    PROFILE_QUEUE,
+    PROFILE_WAKE,
+    PROFILE_SCAN,
+    PROFILE_BATCH,
+    PROFILE_TICK,
+    PROFILE_WRITE,
+    PROFILE_MAX,
+};
+static const char *profile_names[PROFILE_MAX] = {"read", "parse", "probe", "queue", "wake", "scan", "batch", "tick", "write"};
+// PROFILE_WRITE is kept by the writer thread (writer.write_time)
+static struct mstat_hist_t profile[PROFILE_WRITE];
+// Values stored in the trailer per histogram (count, p50, p99, max)
+#define PROFILE_TRAILER_KEYS 4
+
+/**
+ * Report how well the sample rate was kept
+ */
+static void show_sched_stats() {
+    if (!sched.ticks)
+        return;
+    printf("Samples: %zu, missed deadlines: %zu, overruns: %zu (worst: %.6lfs)\n",
+           sched.ticks, sched.missed, sched.overruns, sched.overrun_max);
+    printf("Records written: %zu, dropped (writer queue full): %zu\n",
+           writer.written, writer.dropped);
+    if (option.adapt_rate) {
+        printf("Rate raised to %.2lf samples per second: %zu times\n", adapt.ceiling, adapt.bursts);
+    }
+    if (option.max_overhead) {
+        printf("Samples throttled (max overhead %.2lf%%): %zu, mean read time: %.6lfs\n",
+               option.max_overhead, throttled, throttle.read_time);
+    }
+    if (option.burst_rate) {
+        printf("Memory pressure events (burst to %.2lf samples per second): %zu\n",
+               option.burst_rate, psi.events);
+    }
+}
+
+/**
+ * Return the CPU time used by mstat (every thread)
+ * @return seconds
+ */
+static double cpu_time() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0) {
+        return 0.0;
+    }
+    return (double) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+           + (double) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/**
+ * Return the histogram of a loop cost
+ * @param id PROFILE_* constant
+ * @return histogram of nanoseconds
+ */
+static const struct mstat_hist_t *profile_hist(int id) {
+    return id == PROFILE_WRITE ? &writer.write_time : &profile[id];
+}
+
+/**
+ * Print one row of the overhead report
+ * @param name what was measured
+ * @param h histogram of nanoseconds
+ */
+static void show_profile_row(const char *name, const struct mstat_hist_t *h) {
+    if (!h->total) {
+        return;
+    }
+    printf("  %-8s %10zu %10.1lf %10.1lf %10.1lf %10.1lf %10.1lf\n", name, h->total,
+           (double) mstat_hist_quantile(h, 0.50) / 1e3,
+           (double) mstat_hist_quantile(h, 0.90) / 1e3,
+           (double) mstat_hist_quantile(h, 0.99) / 1e3,
+           (double) mstat_hist_quantile(h, 0.999) / 1e3,
+           (double) mstat_hist_quantile(h, 1.0) / 1e3);
+}
+
+/**
+ * Report what sampling costs
+ *
+ * read/parse: smaps_rollup (or smaps with -m, where parsing is part of read)
+ * probe: statm read and parse
+ * queue: hand-off to the writer thread
+ * write: writer thread, per batch
+ * wake: how late the loop woke up after each deadline
+ * scan: listing /proc (system mode) or updating the process tree (tree mode)
+ * batch: io_uring batch of reads, submission to last completion (system and tree mode)
+ * tick: scanning and sampling every process (system and tree mode)
+ */
+static void show_profile() {
+    struct timespec now;
+    double elapsed;
+    double cpu;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = mstat_difftimespec(now, sched.start);
+    cpu = cpu_time();
+    printf("Sampler overhead (microseconds):\n");
+    printf("  %-8s %10s %10s %10s %10s %10s %10s\n", "", "count", "p50", "p90", "p99", "p99.9", "max");
+    for (int i = 0; i < PROFILE_MAX; i++) {
+        show_profile_row(profile_names[i], profile_hist(i));
+    }
+    printf("CPU time: %.3lfs (%.3lf%% of %.3lfs elapsed)\n",
+           cpu, elapsed > 0 ? cpu / elapsed * 100.0 : 0.0, elapsed);
+}
+
+/**
+ * Compare mappings by RSS growth (largest first)
+ */
+static int compare_growth(const void *a, const void *b) {
+    const struct mstat_mapping_t *x = *(const struct mstat_mapping_t **) a;
+    const struct mstat_mapping_t *y = *(const struct mstat_mapping_t **) b;
+    long long gx = (long long) (x->value[MSTAT_MAPS_VALUE_RSS] - x->rss_first);
+    long long gy = (long long) (y->value[MSTAT_MAPS_VALUE_RSS] - y->rss_first);
+    return (gx < gy) - (gx > gy);
+}
+
+/**
+ * Report the mappings whose RSS grew the most since they were first seen
+ */
+static void show_maps_growth() {
+    struct mstat_mapping_t **sorted;
+
+    if (!maps.count) {
+        return;
+    }
+    sorted = malloc(maps.count * sizeof(*sorted));
+    if (!sorted) {
+        return;
+    }
+    memcpy(sorted, maps.mappings, maps.count * sizeof(*sorted));
+    qsort(sorted, maps.count, sizeof(*sorted), compare_growth);
+
+    printf("RSS growth by mapping (kB):\n");
+    for (size_t i = 0; i < maps.count && i < MSTAT_MAPS_GROWTH_TOP; i++) {
+        long long growth = (long long) (sorted[i]->value[MSTAT_MAPS_VALUE_RSS] - sorted[i]->rss_first);
+        if (growth <= 0) {
+            break;
+        }
+        printf("  %+12lld  %12zu  %s\n", growth, sorted[i]->value[MSTAT_MAPS_VALUE_RSS], sorted[i]->name);
+    }
+    free(sorted);
+}
+
+/**
+ * Append sampler statistics to the output file
+ * @param fp pointer to MSTAT file stream
+ */
+static void write_sched_stats(FILE *fp) {
+    char names[PROFILE_MAX][PROFILE_TRAILER_KEYS][32];
+    char *keys[10 + PROFILE_MAX * PROFILE_TRAILER_KEYS] = {
+            "sample_rate",
+            "ticks",
+            "missed",
+            "overruns",
+            "overrun_max",
+            "dropped",
+            "bursts",
+            "throttled",
+            "pressure_events",
+    };
+    double values[sizeof(keys) / sizeof(*keys)] = {
+            option.sample_rate,
+            (double) sched.ticks,
+            (double) sched.missed,
+            (double) sched.overruns,
+            sched.overrun_max,
+            (double) writer.dropped,
+            (double) adapt.bursts,
+            (double) throttled,
+            (double) psi.events,
+    };
+    size_t count = 9;
+
+    keys[count] = "cpu_time";
+    values[count++] = cpu_time();
+
+    // Loop costs in nanoseconds: NAME_count, NAME_p50_ns, NAME_p99_ns, NAME_max_ns
+    for (int i = 0; i < PROFILE_MAX; i++) {
+        const struct mstat_hist_t *h = profile_hist(i);
+        if (!h->total) {
+            continue;
+        }
+        snprintf(names[i][0], sizeof(names[i][0]), "%s_count", profile_names[i]);
+        snprintf(names[i][1], sizeof(names[i][1]), "%s_p50_ns", profile_names[i]);
+        snprintf(names[i][2], sizeof(names[i][2]), "%s_p99_ns", profile_names[i]);
+        snprintf(names[i][3], sizeof(names[i][3]), "%s_max_ns", profile_names[i]);
+        values[count] = (double) h->total;
+        values[count + 1] = (double) mstat_hist_quantile(h, 0.50);
+        values[count + 2] = (double) mstat_hist_quantile(h, 0.99);
+        values[count + 3] = (double) mstat_hist_quantile(h, 1.0);
+        for (int k = 0; k < PROFILE_TRAILER_KEYS; k++) {
+            keys[count++] = names[i][k];
+        }
+    }
+    if (mstat_write_trailer(fp, keys, values, count) < 0) {
+        fprintf(stderr, "Unable to write trailer to %s: %s\n", option.filename, strerror(errno));
+    }
+}
+
 /**
  * Interrupt handler.
- * Called on exit.
- * @param sig the trapped signal
+ * Called by the sample loop with the signals read from the signalfd (no
+ * signal handler runs), and on exit.
+ * @param sig the received signal (0 = exit)
  */
 static void handle_interrupt(int sig) {
     enable_cls = 0;
     switch (sig) {
-        case SIGCHLD:
-            waitpid(option.pid, &option.status, WNOHANG|WUNTRACED);
-            if (WIFEXITED(option.status)) {
-                printf("pid %d returned %d\n", option.pid, WEXITSTATUS(option.status));
-            } else {
-                fprintf(stderr, "warning: pid %d is likely defunct\n", option.pid);
-            }
+        case SIGUSR2:
+            show_profile();
             return;
         case SIGUSR1:
             if (option.file) {
                 if (option.verbose)
                     fprintf(stderr, "flushing %s\n", option.filename);
-                fflush(option.file);
+                mstat_writer_flush(&writer);
             } else {
                 if (option.verbose)
                     fprintf(stderr, "flush request ignored. no handle\n");
@@ -61,7 +324,24 @@ static void handle_interrupt(int sig) {
         case SIGTERM:
         case SIGINT:
             puts("");
+            if (mstat_writer_close(&writer) < 0) {
+                fprintf(stderr, "Unable to write records to %s: %s\n", option.filename, strerror(errno));
+            }
+            show_sched_stats();
+            if (sched.ticks) {
+                show_profile();
+            }
+            if (option.maps_file) {
+                show_maps_growth();
+                if (fclose(option.maps_file)) {
+                    fprintf(stderr, "Unable to write %s: %s\n", option.maps_filename, strerror(errno));
+                }
+                option.maps_file = NULL;
+            }
             if (option.file) {
+                if (option.trailer) {
+                    write_sched_stats(option.file);
+                }
                 fflush(option.file);
                 fclose(option.file);
                 // Let stdout/stderr catch up
@@ -91,15 +371,34 @@ static void usage(char *prog) {
     if (sep) {
         name = sep + 1;
     }
-    printf("usage: %s [OPTIONS] [-p PID] | {PROGRAM... ARGS}\n"
+    printf("usage: %s [OPTIONS] [-t] [-p PID] | [-g CGROUP] | [-a] | {PROGRAM... ARGS}\n"
+           "  -a        monitor every process on the host in 'system.mstat'\n"
+           "  -A MAX    adapt the sample rate between RATE (-s) and MAX\n"
+           "  -b RATE   sample at RATE while memory is under pressure (PSI trigger)\n"
            "  -c        clobber 'PID#.mstat' if it exists\n"
+           "  -D KB     RSS or PSS change per second that raises the adaptive rate (default: %0.0lf)\n"
+           "  -g PATH   cgroup v2 directory to monitor (memory.current, memory.stat, memory.events)\n"
            "  -h        this help message\n"
+           "  -j JOBS   threads sampling processes with -a and -t (default: online CPUs)\n"
            "  -l LIMIT  stop execution after LIMIT samples\n"
+           "  -m        record per-mapping values from smaps in 'PID#.mstat.maps'\n"
            "  -o DIR    path to output directory (must exist)\n"
            "  -p PID    process id to monitor\n"
+           "  -r RATE   statm probes per second between samples (default: off)\n"
            "  -s RATE   samples per second (default: %0.2lf)\n"
+           "  -t        monitor the process and its descendants (per process and tree total)\n"
+           "  -T        store sampler statistics in the output file\n"
            "  -v        increased verbosity\n"
-           "", name, option.sample_rate);
+           "  -w SECS   keep the burst rate (-b) for SECS after pressure is seen (default: %0.0lf)\n"
+           "  -z        compress records (delta + varint encoded blocks)\n"
+           "  --uring   batch the reads of -a and -t mode with io_uring where available\n"
+           "            (default: the -j threads read with pread())\n"
+           "  --no-uring\n"
+           "            read with pread() in -a and -t mode (default)\n"
+           "  --max-overhead PCT\n"
+           "            lower the sample rate so smaps reads (which hold the target's\n"
+           "            mmap_lock) take at most PCT percent of the time\n"
+           "", name, option.adapt_threshold, option.sample_rate, option.burst_window);
 }
 
 /**
@@ -124,6 +423,26 @@ static int parse_options(int argc, char *argv[]) {
                 option.verbose = 1;
             } else if (!strcmp(arg, "c")) {
                 option.clobber = 1;
+            } else if (!strcmp(arg, "T")) {
+                option.trailer = 1;
+            } else if (!strcmp(arg, "z")) {
+                option.compress = 1;
+            } else if (!strcmp(arg, "m")) {
+                option.maps = 1;
+            } else if (!strcmp(arg, "a")) {
+                option.system = 1;
+            } else if (!strcmp(arg, "t")) {
+                option.tree = 1;
+            } else if (!strcmp(arg, "j")) {
+                long jobs;
+                mstat_check_argument_int(argv, arg, i);
+                jobs = strtol(argv[i+1], NULL, 10);
+                if (jobs < 1) {
+                    fprintf(stderr, "invalid number of jobs: %ld\ndefault applied.\n", jobs);
+                    jobs = 0;
+                }
+                option.workers = (size_t) jobs;
+                i++;
             } else if (!strcmp(arg, "l")) {
                 mstat_check_argument_int(argv, arg, i);
                 option.sample_limit = strtol(argv[i+1], NULL, 10);
@@ -140,12 +459,74 @@ static int parse_options(int argc, char *argv[]) {
             } else if (!strcmp(arg, "s")) {
                 mstat_check_argument_double(argv, arg, i);
                 option.sample_rate = strtod(argv[i+1], NULL);
-                if (option.sample_rate < 0.0) {
+                if (option.sample_rate <= 0.0) {
                     fprintf(stderr, "invalid sample rate: %.2lf\ndefault rate applied.\n",
                             option.sample_rate);
                     option.sample_rate = 1.0;
                 }
                 i++;
+            } else if (!strcmp(arg, "-uring")) {
+                option.uring = 1;
+            } else if (!strcmp(arg, "-no-uring")) {
+                option.uring = 0;
+            } else if (!strcmp(arg, "-max-overhead")) {
+                mstat_check_argument_double(argv, arg, i);
+                option.max_overhead = strtod(argv[i+1], NULL);
+                if (option.max_overhead <= 0.0 || option.max_overhead > 100.0) {
+                    fprintf(stderr, "invalid max overhead: %.2lf\noverhead limit disabled.\n",
+                            option.max_overhead);
+                    option.max_overhead = 0.0;
+                }
+                i++;
+            } else if (!strcmp(arg, "A")) {
+                mstat_check_argument_double(argv, arg, i);
+                option.adapt_rate = strtod(argv[i+1], NULL);
+                if (option.adapt_rate < 0.0) {
+                    fprintf(stderr, "invalid adaptive rate: %.2lf\nadaptive rate disabled.\n",
+                            option.adapt_rate);
+                    option.adapt_rate = 0.0;
+                }
+                i++;
+            } else if (!strcmp(arg, "b")) {
+                mstat_check_argument_double(argv, arg, i);
+                option.burst_rate = strtod(argv[i+1], NULL);
+                if (option.burst_rate < 0.0) {
+                    fprintf(stderr, "invalid burst rate: %.2lf\nburst sampling disabled.\n",
+                            option.burst_rate);
+                    option.burst_rate = 0.0;
+                }
+                i++;
+            } else if (!strcmp(arg, "w")) {
+                mstat_check_argument_double(argv, arg, i);
+                option.burst_window = strtod(argv[i+1], NULL);
+                if (option.burst_window <= 0.0) {
+                    fprintf(stderr, "invalid burst window: %.2lf\ndefault window applied.\n",
+                            option.burst_window);
+                    option.burst_window = 10.0;
+                }
+                i++;
+            } else if (!strcmp(arg, "D")) {
+                mstat_check_argument_double(argv, arg, i);
+                option.adapt_threshold = strtod(argv[i+1], NULL);
+                if (option.adapt_threshold <= 0.0) {
+                    fprintf(stderr, "invalid adaptive threshold: %.2lf\ndefault threshold applied.\n",
+                            option.adapt_threshold);
+                    option.adapt_threshold = 1024.0;
+                }
+                i++;
+            } else if (!strcmp(arg, "r")) {
+                mstat_check_argument_double(argv, arg, i);
+                option.probe_rate = strtod(argv[i+1], NULL);
+                if (option.probe_rate < 0.0) {
+                    fprintf(stderr, "invalid probe rate: %.2lf\nprobes disabled.\n",
+                            option.probe_rate);
+                    option.probe_rate = 0.0;
+                }
+                i++;
+            } else if (!strcmp(arg, "g")) {
+                mstat_check_argument_str(argv, arg, i);
+                strncpy(option.cgroup, argv[i+1], PATH_MAX - 1);
+                i++;
             } else if (!strcmp(arg, "p")) {
                 mstat_check_argument_int(argv, arg, i);
                 option.pid = (pid_t) strtol(argv[i+1], NULL, 10);
@@ -171,14 +552,276 @@ int pid_exists(pid_t pid) {
 }
 
 /**
- * Check /proc/`pid` provides the smaps_rollups file
- * @param pid
- * @return 0 if exists and can read the file. -1 if not
+ * Print the values of a record (verbose mode)
+ * @param packed record in its on-disk layout
+ * @param names field names (NULL terminated)
+ * @param types storage type of each field (NULL = process schema)
+ * @param index sample number (from 0)
  */
-int smaps_rollup_usable(pid_t pid) {
-    char path[PATH_MAX] = {0};
-    snprintf(path, sizeof(path) - 1, "/proc/%d/smaps_rollup", pid);
-    return access(path, F_OK | R_OK);
+static void show_record(const char *packed, char **names, const char *types, size_t index) {
+    double timestamp;
+
+    memcpy(&timestamp, packed + MSTAT_FIELD_TIMESTAMP * sizeof(size_t), sizeof(timestamp));
+    printf("Sample: %zu", index + 1);
+    if (option.sample_limit > 0) {
+        printf("/%zu, ", option.sample_limit);
+    } else {
+        printf(", ");
+    }
+    printf("Elapsed: %lf\n----\n", timestamp);
+    // The identifier and the timestamp are shown above
+    for (size_t n = MSTAT_FIELD_TIMESTAMP + 1, x = 0; names[n] != NULL; n++) {
+        union mstat_field_t field;
+        char type = types ? types[n] : mstat_get_field_type(n);
+        if (x == 3) {
+            x = 0;
+            puts("");
+        }
+        memcpy(&field, packed + n * sizeof(size_t), sizeof(field));
+        if (type == MSTAT_TYPE_F64) {
+            printf("\t%-16s %-8.2lf ", names[n], field.d64);
+        } else {
+            printf("\t%-16s %-8lu ", names[n], field.u64);
+        }
+        x++;
+    }
+    puts("\n");
+    printf("(interrupt with ctrl-c...)\n");
+}
+
+/**
+ * Compare processes by PSS (largest first)
+ */
+static int compare_pss(const void *a, const void *b) {
+    const struct mstat_proc_t *x = *(const struct mstat_proc_t **) a;
+    const struct mstat_proc_t *y = *(const struct mstat_proc_t **) b;
+    return (x->record.pss < y->record.pss) - (x->record.pss > y->record.pss);
+}
+
+/**
+ * Print the processes using the most memory (verbose system and tree mode)
+ * @param index sample number (from 0)
+ * @param elapsed time spent scanning and sampling (seconds)
+ * @param total sum of the tree (NULL in system mode)
+ */
+static void show_system(size_t index, double elapsed, const struct mstat_record_t *total) {
+    struct mstat_proc_t **sorted;
+    size_t count = 0;
+
+    printf("Sample: %zu, processes: %zu (unreadable: %zu), sampled in %.3lf ms\n----\n",
+           index + 1, system_sampler.count, system_sampler.skipped, elapsed * 1e3);
+    if (total) {
+        printf("\tTree %d (via %s): PSS %zu, RSS %zu, SWAP %zu\n\n", total->pid,
+               mstat_tree_methods[tree.method], total->pss, total->rss, total->swap);
+    }
+    sorted = malloc((system_sampler.count + 1) * sizeof(*sorted));
+    if (!sorted) {
+        return;
+    }
+    for (size_t n = 0; n < system_sampler.count; n++) {
+        if (!system_sampler.procs[n].status) {
+            sorted[count++] = &system_sampler.procs[n];
+        }
+    }
+    qsort(sorted, count, sizeof(*sorted), compare_pss);
+
+    printf("\t%-8s %-12s %-12s %-12s %s\n", "PID", "PSS", "RSS", "SWAP", "COMMAND");
+    for (size_t n = 0; n < count && n < MSTAT_SYSTEM_TOP; n++) {
+        char path[PATH_MAX] = {0};
+        char comm[32] = {0};
+        FILE *fp;
+
+        snprintf(path, sizeof(path) - 1, "/proc/%d/comm", sorted[n]->pid);
+        fp = fopen(path, "r");
+        if (fp) {
+            if (fgets(comm, sizeof(comm), fp)) {
+                comm[strcspn(comm, "\n")] = '\0';
+            }
+            fclose(fp);
+        }
+        printf("\t%-8d %-12zu %-12zu %-12zu %s\n", sorted[n]->pid,
+               sorted[n]->record.pss, sorted[n]->record.rss, sorted[n]->record.swap, comm);
+    }
+    free(sorted);
+    puts("");
+    printf("(interrupt with ctrl-c...)\n");
+}
+
+/**
+ * Hand a record to the writer thread
+ *
+ * Records are dropped while the writer queue is full. The first drop is
+ * reported right away; the total is shown on exit.
+ *
+ * @param packed record in its on-disk layout
+ */
+static void queue_record(const char *packed) {
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (mstat_writer_push(&writer, packed) < 0 && writer.dropped == 1) {
+        fprintf(stderr, "Writer queue full: %s cannot keep up, records are being dropped\n",
+                option.filename);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    mstat_hist_add(&profile[PROFILE_QUEUE], mstat_difftimespec_ns(t1, t0));
+}
+
+/**
+ * Sample every process on the host (or in the tree) and queue one record
+ * per process
+ *
+ * In tree mode a record of the tree total follows (source: MSTAT_SOURCE_TREE).
+ *
+ * @param tick values shared by every record (timestamp and rate)
+ * @param index sample number (from 0)
+ * @return 0 on success. -1 if /proc cannot be listed or the root of the tree exited (errno: ESRCH)
+ */
+static int sample_system(const struct mstat_record_t *tick, size_t index) {
+    struct mstat_record_t total;
+    struct timespec t0, t1, t2;
+    int root_sampled = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (option.tree) {
+        if (mstat_tree_update(&tree) < 0
+            || mstat_system_set(&system_sampler, tree.pids, tree.count) < 0) {
+            return -1;
+        }
+    } else if (mstat_system_scan(&system_sampler) < 0) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    mstat_system_sample(&system_sampler, tick);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    mstat_hist_add(&profile[PROFILE_SCAN], mstat_difftimespec_ns(t1, t0));
+    mstat_hist_add(&profile[PROFILE_TICK], mstat_difftimespec_ns(t2, t0));
+    if (system_sampler.batch_time) {
+        mstat_hist_add(&profile[PROFILE_BATCH], system_sampler.batch_time);
+    }
+
+    // The tree total carries the pid and start time of the root
+    total = *tick;
+    total.source = MSTAT_SOURCE_TREE;
+    for (size_t n = 0; n < system_sampler.count; n++) {
+        const struct mstat_proc_t *p = &system_sampler.procs[n];
+        char packed[MSTAT_RECORD_SIZE];
+
+        if (p->status < 0) {
+            continue;
+        }
+        if (option.tree) {
+            mstat_record_add(&total, &p->record);
+            root_sampled |= p->pid == tick->pid;
+        }
+        // Reads of an io_uring batch are timed together (PROFILE_BATCH)
+        if (p->sampler.read_time) {
+            mstat_hist_add(&profile[PROFILE_READ], p->sampler.read_time);
+        }
+        mstat_hist_add(&profile[PROFILE_PARSE], p->sampler.parse_time);
+        mstat_pack(packed, &p->record);
+        queue_record(packed);
+    }
+
+    if (option.tree) {
+        char packed[MSTAT_RECORD_SIZE];
+
+        if (!root_sampled) {
+            // A read of the root may fail while it runs. Skip the total then.
+            if (!mstat_events_exited(&events, tick->pid, tick->start_time)) {
+                return 0;
+            }
+            errno = ESRCH;
+            return -1;
+        }
+        mstat_pack(packed, &total);
+        queue_record(packed);
+    }
+
+    if (option.verbose) {
+        show_system(index, mstat_difftimespec(t2, t0), option.tree ? &total : NULL);
+    }
+    return 0;
+}
+
+/**
+ * Start the threads (or io_uring) sampling many processes
+ */
+static void start_system_sampler() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (!option.workers) {
+        option.workers = cpus > 0 ? (size_t) cpus : 1;
+    }
+    // io_uring is opt-in (--uring): bench/system.c has not shown it to win everywhere
+    if (mstat_system_open(&system_sampler, option.workers, option.uring) < 0) {
+        fprintf(stderr, "Unable to start workers: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+/**
+ * Report the end of the target
+ * @return 1 if the target exited. 0 if it is still running (it was stopped)
+ */
+static int reap_target() {
+    if (!option.child) {
+        // '-p' monitoring: let the user know when the PID disappears
+        fprintf(stderr, "pid: %d disappeared\n", option.pid);
+        return 1;
+    }
+    if (waitpid(option.pid, &option.status, WNOHANG | WUNTRACED) <= 0) {
+        return 0;
+    }
+    if (WIFEXITED(option.status)) {
+        printf("pid %d returned %d\n", option.pid, WEXITSTATUS(option.status));
+    } else if (WIFSIGNALED(option.status)) {
+        fprintf(stderr, "pid %d was killed by signal %d\n", option.pid, WTERMSIG(option.status));
+    } else {
+        fprintf(stderr, "warning: pid %d is stopped\n", option.pid);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Sleep until the next deadline, handling signals in the meantime
+ * @return 0 when the deadline is reached. -1 when sampling ends (interrupted, target exited, error)
+ */
+static int wait_tick() {
+    while (1) {
+        int signo = 0;
+
+        switch (mstat_events_wait(&events, &sched, &signo)) {
+            case MSTAT_EVENT_TICK:
+                return 0;
+            case MSTAT_EVENT_EXIT:
+                reap_target();
+                return -1;
+            case MSTAT_EVENT_PRESSURE: {
+                // Sample now, then at the burst rate until the window passes
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                burst_end = (double) now.tv_sec + (double) now.tv_nsec / 1e9 + option.burst_window;
+                psi.events++;
+                return 0;
+            }
+            case MSTAT_EVENT_SIGNAL:
+                if (signo == SIGINT || signo == SIGTERM) {
+                    return -1;
+                }
+                if (signo == SIGCHLD) {
+                    if (option.child && reap_target()) {
+                        return -1;
+                    }
+                    continue;
+                }
+                handle_interrupt(signo);
+                continue;
+            default:
+                perror("epoll_wait");
+                return -1;
+        }
+    }
 }
 
 static void clearscr() {
@@ -190,6 +833,8 @@ static void clearscr() {
 
 int main(int argc, char *argv[]) {
     struct mstat_record_t record;
+    struct mstat_sampler_t sampler;
+    size_t start_time;
     int positional;
 
     // Initialize options
@@ -200,28 +845,80 @@ int main(int argc, char *argv[]) {
 
     // Set default options
     option.sample_rate = 1;
+    option.adapt_threshold = 1024;
+    option.burst_window = 10;
     option.verbose = 0;
     option.clobber = 0;
 
     // Set options based on arguments
     positional = parse_options(argc, argv);
-    if (!option.pid && positional < 0) {
-        fprintf(stderr, "missing: -p PID, or PROGRAM with arguments\n\n");
+    if (option.system && (option.pid || option.cgroup[0] || positional >= 0)) {
+        fprintf(stderr, "-a cannot be combined with -p PID, -g CGROUP or PROGRAM\n");
+        exit(1);
+    }
+    if (option.system && (option.maps || option.probe_rate || option.adapt_rate || option.max_overhead)) {
+        fprintf(stderr, "-m, -r, -A and --max-overhead sample one process. They cannot be used with -a\n");
+        exit(1);
+    }
+    if (option.tree && (option.system || option.cgroup[0])) {
+        fprintf(stderr, "-t follows a process (-p PID or PROGRAM). It cannot be combined with -a or -g CGROUP\n");
+        exit(1);
+    }
+    if (option.tree && (option.maps || option.probe_rate || option.adapt_rate || option.max_overhead)) {
+        fprintf(stderr, "-m, -r, -A and --max-overhead sample one process. They cannot be used with -t\n");
+        exit(1);
+    }
+    if (option.cgroup[0] && (option.pid || positional >= 0)) {
+        fprintf(stderr, "-g CGROUP cannot be combined with -p PID or PROGRAM\n");
+        exit(1);
+    }
+    if (option.cgroup[0] && (option.maps || option.probe_rate || option.adapt_rate || option.max_overhead)) {
+        fprintf(stderr, "-m, -r, -A and --max-overhead sample processes. They cannot be used with -g\n");
+        exit(1);
+    }
+    if (!option.system && !option.cgroup[0] && !option.pid && positional < 0) {
+        fprintf(stderr, "missing: -p PID, -g CGROUP, -a, or PROGRAM with arguments\n\n");
         usage(argv[0]);
         exit(1);
     }
+    if (option.adapt_rate && option.adapt_rate <= option.sample_rate) {
+        fprintf(stderr, "adaptive rate (-A) must be above the sample rate (-s). adaptive rate disabled.\n");
+        option.adapt_rate = 0.0;
+    }
+    if (option.burst_rate && option.burst_rate <= option.sample_rate) {
+        fprintf(stderr, "burst rate (-b) must be above the sample rate (-s). burst sampling disabled.\n");
+        option.burst_rate = 0.0;
+    }
 
-    // Wait for our children
-    signal(SIGCHLD, handle_interrupt);
-    // Allow user to flush the data stream with USR1
-    signal(SIGUSR1, handle_interrupt);
-    // Always attempt to exit cleanly
-    signal(SIGINT, handle_interrupt);
-    signal(SIGTERM, handle_interrupt);
+    // Signals are read by the sample loop. They are blocked before any
+    // thread starts, so every thread leaves them to the signalfd.
+    //   CHLD: wait for our children
+    //   USR1: allow user to flush the data stream
+    //   USR2: report the sampler overhead
+    //   INT, TERM: always attempt to exit cleanly
+    const int signals[] = {SIGCHLD, SIGUSR1, SIGUSR2, SIGINT, SIGTERM};
+    if (mstat_events_open(&events, signals, sizeof(signals) / sizeof(*signals)) < 0) {
+        perror("Unable to set up the event loop");
+        exit(1);
+    }
 
     // Figure out what we are going to monitor.
-    // Will it be a user-defined PID or a new process?
-    if (option.pid) {
+    // Will it be every process, a cgroup, a user-defined PID or a new process?
+    if (option.system) {
+        start_system_sampler();
+        if (mstat_system_scan(&system_sampler) < 0) {
+            perror("/proc");
+            exit(1);
+        }
+    } else if (option.cgroup[0]) {
+        if (mstat_cgroup_open(&cgroup, option.cgroup) < 0) {
+            fprintf(stderr, "cgroup %s: %s\n", option.cgroup, strerror(errno));
+            if (errno == ENOENT) {
+                fprintf(stderr, "(cgroup v2 with the memory controller enabled is required)\n");
+            }
+            exit(1);
+        }
+    } else if (option.pid) {
         // User-defined PID
         if (pid_exists(option.pid) < 0) {
             fprintf(stderr, "no pid %d\n", option.pid);
@@ -244,6 +941,9 @@ int main(int argc, char *argv[]) {
 
         int stdin_handle = -1;
         if (p == 0) {
+            // The program receives the signals mstat reads from the signalfd
+            sigprocmask(SIG_SETMASK, &events.old_mask, NULL);
+
             // Give control of STDIN to the child
             dup2(STDIN_FILENO, stdin_handle);
             close(STDIN_FILENO);
@@ -265,19 +965,66 @@ int main(int argc, char *argv[]) {
         close(stdin_handle);
 
         option.pid = p;
+        option.child = 1;
     }
 
-    // Verify /proc/PID/smaps_rollup is present
-    if (smaps_rollup_usable(option.pid) < 0) {
+    // Stop as soon as the target exits, rather than when the next sample
+    // fails. Without pidfd_open (before Linux 5.3) that is what happens.
+    if (option.pid) {
+        mstat_events_watch(&events, option.pid);
+    }
+
+    // Memory pressure raises the sample rate (-b). The kernel checks the
+    // trigger, so mstat sleeps until then.
+    if (option.burst_rate) {
+        char path[PATH_MAX * 2] = {0};
+        if (option.cgroup[0]) {
+            snprintf(path, sizeof(path) - 1, "%s/memory.pressure", option.cgroup);
+        } else {
+            strncpy(path, MSTAT_PSI_SYSTEM, sizeof(path) - 1);
+        }
+        if (mstat_psi_open(&psi, path, MSTAT_PSI_STALL, MSTAT_PSI_WINDOW) < 0
+            || mstat_events_watch_pressure(&events, psi.trigger) < 0) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            if (errno == ENOENT || errno == EOPNOTSUPP) {
+                fprintf(stderr, "(pressure stall information is required: CONFIG_PSI, not disabled by psi=0)\n");
+            }
+            exit(1);
+        }
+    }
+
+    if (option.tree) {
+        // Descendants forked from here on are reported by the proc connector
+        start_system_sampler();
+        if (mstat_tree_open(&tree, option.pid, 1) < 0
+            || mstat_system_set(&system_sampler, tree.pids, tree.count) < 0) {
+            fprintf(stderr, "pid %d: %s\n", option.pid, strerror(errno));
+            exit(1);
+        }
+    }
+
+    // Open /proc/PID/smaps_rollup for the life of the sample loop
+    if (option.pid && !option.tree && mstat_sampler_open(&sampler, option.pid) < 0) {
         fprintf(stderr, "pid %d: %s\n", option.pid, strerror(errno));
         exit(1);
     }
+    // Tells the process apart from a later one given the same pid
+    start_time = option.pid ? mstat_get_start_time(option.pid) : 0;
 
     // Set up output directory root and file path
-    snprintf(option.filename, PATH_MAX - 1, "%d.mstat", option.pid);
+    if (option.system) {
+        snprintf(option.filename, PATH_MAX - 1, "system.mstat");
+    } else if (option.cgroup[0]) {
+        // Named after the cgroup directory: 'NAME.mstat'
+        char tmpname[PATH_MAX] = {0};
+        strncpy(tmpname, option.cgroup, PATH_MAX - 1);
+        snprintf(option.filename, PATH_MAX - 1, "%s.mstat", basename(tmpname));
+    } else {
+        snprintf(option.filename, PATH_MAX - 1, "%d.mstat", option.pid);
+    }
     if (strlen(option.root)) {
         // Strip trailing slash from path
-        if (strlen(option.root) > 1 && strrchr(option.root, '/')) {
+        if (strlen(option.root) > 1 && option.root[strlen(option.root) - 1] == '/') {
             option.root[strlen(option.root) - 1] = '\0';
         }
 
@@ -304,6 +1051,37 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    // Per-mapping values go to a companion file next to the data file
+    if (option.maps) {
+        snprintf(option.maps_filename, sizeof(option.maps_filename), "%s%s", option.filename, MSTAT_MAPS_SUFFIX);
+        if (strlen(option.maps_filename) >= PATH_MAX) {
+            fprintf(stderr, "%s: %s\n", option.maps_filename, strerror(ENAMETOOLONG));
+            exit(1);
+        }
+        if (access(option.maps_filename, F_OK) == 0) {
+            if (option.clobber) {
+                remove(option.maps_filename);
+                fprintf(stderr, "%s clobbered\n", option.maps_filename);
+            } else {
+                fprintf(stderr, "%s file already exists\n", option.maps_filename);
+                exit(1);
+            }
+        }
+        if (mstat_maps_open(&maps, option.pid) < 0) {
+            fprintf(stderr, "pid %d: smaps: %s\n", option.pid, strerror(errno));
+            exit(1);
+        }
+        option.maps_file = fopen(option.maps_filename, "w+b");
+        if (!option.maps_file) {
+            perror(option.maps_filename);
+            exit(1);
+        }
+        if (mstat_maps_write_header(option.maps_file, option.pid) < 0) {
+            perror(option.maps_filename);
+            exit(1);
+        }
+    }
+
     // Initialize mstat data file
     option.file = mstat_open(option.filename);
     if (!option.file) {
@@ -315,21 +1093,129 @@ int main(int argc, char *argv[]) {
     if (mstat_check_header(option.file)) {
         mstat_write_header(option.file);
     }
+    // cgroup records have their own schema
+    if (option.cgroup[0] && mstat_write_header_fields(option.file, mstat_cgroup_field_names,
+                                                      mstat_cgroup_field_types) < 0) {
+        fprintf(stderr, "Unable to write header to %s: %s\n", option.filename, strerror(errno));
+        exit(1);
+    }
 
     size_t i;
+    size_t full_every, since_full;
+    size_t tick_records;
+    double peak_rate;
+    double rate;
+    int throttling;
+    int bursting;
+    struct mstat_pressure_t pressure;
     struct timespec ts_start, ts_end;
     extern char *mstat_field_names[];
+    extern const char mstat_field_types[];
+
+    // With probes enabled the loop ticks at the probe rate and every
+    // full_every-th tick reads smaps_rollup instead of statm
+    full_every = 1;
+    if (option.probe_rate > option.sample_rate) {
+        full_every = (size_t) (option.probe_rate / option.sample_rate + 0.5);
+    }
+
+    // Describe the recording in the header
+    struct timespec ts_wall;
+    clock_gettime(CLOCK_REALTIME, &ts_wall);
+    if (mstat_set_sample_info(option.file, option.sample_rate * (double) full_every, &ts_wall) < 0) {
+        fprintf(stderr, "Unable to update header of %s: %s\n", option.filename, strerror(errno));
+    }
+
+    // Adaptive mode moves the rate between the sample rate and the ceiling
+    peak_rate = option.sample_rate;
+    if (option.adapt_rate) {
+        peak_rate = option.adapt_rate;
+    }
+    mstat_adapt_init(&adapt, option.sample_rate, peak_rate, option.adapt_threshold);
+    mstat_throttle_init(&throttle, option.max_overhead / 100.0);
+    // Memory pressure may raise it further
+    if (option.burst_rate > peak_rate) {
+        peak_rate = option.burst_rate;
+    }
+
+    // Hand records to a writer thread. The queue absorbs two seconds of
+    // samples at the highest rate (at least 4096) while the disk is slow.
+    // System mode writes a record per process on every tick, tree mode
+    // adds the total. Both leave room for twice as many processes, and a
+    // tree room to fork. The writer caps the queue at MSTAT_WRITER_RING_MAX.
+    tick_records = 1;
+    if (option.system || option.tree) {
+        tick_records = (system_sampler.count + (option.tree ? 1 : 0)) * 2;
+        if (option.tree && tick_records < 256) {
+            tick_records = 256;
+        }
+    }
+    if (mstat_writer_open(&writer, option.file,
+                          (size_t) (peak_rate * (double) full_every * 2 + 1) * tick_records + 4096,
+                          option.cgroup[0] ? MSTAT_CGROUP_FIELD_MAX : MSTAT_FIELD_MAX,
+                          option.cgroup[0] ? mstat_cgroup_field_types : mstat_field_types,
+                          option.compress ? MSTAT_FLAG_COMPRESSED : 0) < 0) {
+        fprintf(stderr, "Unable to start writer: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    for (int n = 0; n < PROFILE_WRITE; n++) {
+        if (mstat_hist_init(&profile[n]) < 0) {
+            perror("Unable to allocate memory for the overhead profile");
+            exit(1);
+        }
+    }
 
     // Begin tracking time.
     clock_gettime(CLOCK_MONOTONIC, &ts_start);
+    mstat_sched_init(&sched, option.sample_rate * (double) full_every);
 
     // Begin sample loop
-    printf("PID: %d\nSamples per second: %.2lf\n",
-           option.pid, option.sample_rate);
+    if (option.system && system_sampler.uring.fd >= 0) {
+        printf("Processes: %zu, sampled by io_uring batches\nSamples per second: %.2lf\n",
+               system_sampler.count, option.sample_rate);
+    } else if (option.system) {
+        printf("Processes: %zu, sampled by %zu threads\nSamples per second: %.2lf\n",
+               system_sampler.count, option.workers, option.sample_rate);
+    } else if (option.tree) {
+        printf("Tree: %d (%zu processes, via %s)\nSamples per second: %.2lf\n",
+               option.pid, system_sampler.count, mstat_tree_methods[tree.method], option.sample_rate);
+    } else if (option.cgroup[0]) {
+        printf("cgroup: %s\nSamples per second: %.2lf\n", option.cgroup, option.sample_rate);
+    } else {
+        printf("PID: %d\nSamples per second: %.2lf\n", option.pid, option.sample_rate);
+    }
+    if (option.pid && !option.tree && !option.maps && sampler.source == MSTAT_SOURCE_SMAPS) {
+        printf("smaps_rollup unavailable: reading smaps\n");
+    }
+    if (option.adapt_rate) {
+        printf("Adaptive up to: %.2lf (above %.0lf kB/s)\n", option.adapt_rate, option.adapt_threshold);
+    }
+    if (full_every > 1) {
+        printf("Probes per second: %.2lf\n", option.sample_rate * (double) full_every);
+    }
+    if (option.max_overhead) {
+        printf("Max overhead: %.2lf%%\n", option.max_overhead);
+    }
+    if (option.burst_rate) {
+        printf("Under memory pressure: %.2lf samples per second for %.2lfs\n",
+               option.burst_rate, option.burst_window);
+    }
     printf("(interrupt with ctrl-c...)\n");
 
     i = 0;
+    since_full = 0;
+    rate = option.sample_rate;
+    throttling = 0;
+    bursting = 0;
     while (1) {
+        int status;
+        double next;
+        // Time spent reading smaps (0 = statm probe)
+        unsigned long long read_time = 0;
+        // Record in its on-disk layout
+        char packed[MSTAT_RECORD_SIZE > MSTAT_CGROUP_RECORD_SIZE ? MSTAT_RECORD_SIZE : MSTAT_CGROUP_RECORD_SIZE];
+
         if (option.sample_limit && i >= option.sample_limit) {
             break;
         }
@@ -338,54 +1224,180 @@ int main(int argc, char *argv[]) {
         }
         memset(&record, 0, sizeof(record));
         record.pid = option.pid;
+        record.start_time = start_time;
 
         // Record run time since last call
         clock_gettime(CLOCK_MONOTONIC, &ts_end);
         record.timestamp = mstat_difftimespec(ts_end, ts_start);
+        // Records per second while this record was taken
+        record.rate = rate * (double) full_every;
+        // Memory pressure goes with every record when bursts are enabled
+        if (option.burst_rate && !mstat_psi_read(&psi, &pressure)) {
+            record.psi_some = pressure.some;
+            record.psi_full = pressure.full;
+            record.psi_some_total = pressure.some_total;
+            record.psi_full_total = pressure.full_total;
+        }
 
         // Sample memory values
-        if (mstat_attach(&record, record.pid) < 0) {
-            if (positional < 0) {
-                // '-p' monitoring: let the user know when the PID disappears
-                fprintf(stderr, "pid: %d disappeared\n", option.pid);
+        if (option.system || option.tree) {
+            // One record per process (and the tree total) is queued here
+            status = sample_system(&record, i);
+        } else if (option.cgroup[0]) {
+            struct mstat_cgroup_record_t cgroup_record;
+            memset(&cgroup_record, 0, sizeof(cgroup_record));
+            cgroup_record.timestamp = record.timestamp;
+            cgroup_record.rate = record.rate;
+            cgroup_record.psi_some = record.psi_some;
+            cgroup_record.psi_full = record.psi_full;
+            cgroup_record.psi_some_total = record.psi_some_total;
+            cgroup_record.psi_full_total = record.psi_full_total;
+            status = mstat_cgroup_read(&cgroup, &cgroup_record);
+            if (!status) {
+                mstat_hist_add(&profile[PROFILE_READ], cgroup.read_time);
+                mstat_hist_add(&profile[PROFILE_PARSE], cgroup.parse_time);
+            }
+            memcpy(packed, &cgroup_record, sizeof(cgroup_record));
+        } else if (since_full) {
+            record.source = MSTAT_SOURCE_STATM;
+            status = mstat_sampler_probe(&sampler, &record);
+            if (!status) {
+                mstat_hist_add(&profile[PROFILE_PROBE], sampler.probe_time);
+            }
+        } else if (option.maps) {
+            struct timespec t0, t1;
+            // smaps provides the totals (and VM size) as well
+            record.source = MSTAT_SOURCE_SMAPS;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            status = mstat_maps_read(&maps, &record);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            read_time = mstat_difftimespec_ns(t1, t0);
+            mstat_hist_add(&profile[PROFILE_READ], read_time);
+            if (!status && mstat_maps_write(&maps, option.maps_file, record.timestamp) < 0) {
+                fprintf(stderr, "Unable to write %s: %s\n", option.maps_filename, strerror(errno));
+                break;
+            }
+        } else {
+            record.source = sampler.source;
+            status = mstat_sampler_read(&sampler, &record);
+            if (!status) {
+                read_time = sampler.read_time;
+                mstat_hist_add(&profile[PROFILE_READ], sampler.read_time);
+                mstat_hist_add(&profile[PROFILE_PARSE], sampler.parse_time);
+                // VM size is not part of smaps_rollup
+                struct mstat_record_t probe;
+                if (!mstat_sampler_probe(&sampler, &probe)) {
+                    record.vm_size = probe.vm_size;
+                }
+            }
+        }
+        since_full = (since_full + 1) % full_every;
+        if (status < 0) {
+            if (option.system) {
+                perror("/proc");
+            } else if (option.tree && errno != ESRCH) {
+                perror("process tree");
+            } else if (option.cgroup[0]) {
+                fprintf(stderr, "cgroup: %s: %s\n", option.cgroup, strerror(errno));
+            } else {
+                // The target exited before its exit was read from the pidfd
+                reap_target();
             }
             break;
         }
 
-        if (option.verbose) {
-            printf("\nPID: %d, ", record.pid);
-            printf("Sample: %zu", i + 1);
-            if (option.sample_limit > 0) {
-                printf("/%zu, ", option.sample_limit);
+        if (!option.cgroup[0] && !option.system && !option.tree) {
+            mstat_pack(packed, &record);
+        }
+
+        if (option.verbose && !option.system && !option.tree) {
+            if (option.cgroup[0]) {
+                printf("\ncgroup: %s, ", option.cgroup);
+                show_record(packed, mstat_cgroup_field_names, mstat_cgroup_field_types, i);
             } else {
-                printf(", ");
+                printf("\nPID: %d, ", record.pid);
+                show_record(packed, mstat_field_names, NULL, i);
             }
-            printf("Elapsed: %lf\n----\n", record.timestamp);
-            for (size_t n = 2, x = 0; mstat_field_names[n] != NULL; n++) {
-                if (x == 3) {
-                    x = 0;
-                    puts("");
+        }
+
+        if (!option.system && !option.tree) {
+            queue_record(packed);
+        }
+        if (mstat_writer_error(&writer)) {
+            fprintf(stderr, "Unable to write record to %s: %s\n",
+                    option.filename, strerror(mstat_writer_error(&writer)));
+            break;
+        }
+
+        // Follow the memory trend in adaptive mode
+        if (option.adapt_rate) {
+            mstat_adapt_update(&adapt, &record);
+        }
+        next = adapt.rate;
+
+        // Sample faster while memory pressure lasts
+        if (option.burst_rate) {
+            double now = (double) ts_end.tv_sec + (double) ts_end.tv_nsec / 1e9;
+            if (now < burst_end) {
+                if (!bursting) {
+                    fprintf(stderr, "memory pressure: sample rate raised to %.2lf\n", option.burst_rate);
+                    bursting = 1;
                 }
-                union mstat_field_t field;
-                field = mstat_get_field_by_name(&record, mstat_field_names[n]);
-                printf("\t%-16s %-8lu ", mstat_field_names[n], field.u64);
-                x++;
+                if (next < option.burst_rate) {
+                    next = option.burst_rate;
+                }
+            } else if (bursting) {
+                fprintf(stderr, "memory pressure eased: sample rate %.2lf\n", next);
+                bursting = 0;
             }
-            puts("\n");
-            printf("(interrupt with ctrl-c...)\n");
         }
 
-        if (mstat_write(option.file, &record) < 0) {
-            fprintf(stderr, "Unable to write record to mstat file for pid %d: %s\n",
-                    option.pid, strerror(errno));
-            break;
+        // Keep smaps reads within the overhead budget
+        if (option.max_overhead) {
+            if (read_time) {
+                mstat_throttle_update(&throttle, (double) read_time / 1e9);
+            }
+            if (next > throttle.limit) {
+                next = throttle.limit;
+                if (!throttling) {
+                    fprintf(stderr, "throttling: smaps reads take %.3lf ms, sample rate lowered to %.2lf\n",
+                            throttle.read_time * 1e3, next);
+                    throttling = 1;
+                }
+                throttled++;
+            } else if (throttling) {
+                fprintf(stderr, "throttling lifted: sample rate %.2lf\n", next);
+                throttling = 0;
+            }
+        }
+
+        if (next != rate) {
+            rate = next;
+            mstat_sched_set_rate(&sched, rate * (double) full_every);
         }
 
         // Perform n samples per second
-        usleep((int) (1e6 / option.sample_rate));
+        if (wait_tick() < 0) {
+            break;
+        }
+        mstat_hist_add(&profile[PROFILE_WAKE], sched.wake_late);
         i++;
     }
 
+    if (option.tree) {
+        mstat_tree_close(&tree);
+        mstat_system_close(&system_sampler);
+    } else if (option.system) {
+        mstat_system_close(&system_sampler);
+    } else if (option.cgroup[0]) {
+        mstat_cgroup_close(&cgroup);
+    } else {
+        mstat_sampler_close(&sampler);
+    }
+    if (option.burst_rate) {
+        mstat_psi_close(&psi);
+    }
+    mstat_events_close(&events);
     handle_interrupt(0);
     return option.status;
 }
@@ -1,67 +1,492 @@
+#include <errno.h>
+#include <math.h>
 #include "common.h"
+#include "maps.h"
 
-int main(int argc, char *argv[]) {
-    FILE *fp;
-    struct mstat_record_t p;
+// Output is collected in a buffer of this size before it is written
+#define EXPORT_BUFFER_SIZE 0x100000
+// Longest formatted value (a double printed by snprintf) plus a separator
+#define EXPORT_VALUE_MAX 0x200
+
+extern char *mstat_field_names[];
+
+static struct Option {
+    /** Field(s) to export (NULL terminated. NULL = all) */
     char **fields;
-    size_t fields_total;
+    /** Export records at or after this time (seconds) */
+    double time_start;
+    /** Export records at or before this time (seconds) */
+    double time_end;
+    /** Keep exporting records appended to the file */
+    unsigned char follow;
+    /** Input file */
+    char filename[PATH_MAX];
+} option;
+
+static struct Output {
+    /** Pending output */
+    char data[EXPORT_BUFFER_SIZE];
+    /** Bytes pending */
+    size_t len;
+} output;
+
+static void usage(char *prog) {
+    char *sep;
+    char *name;
 
+    sep = strrchr(prog, '/');
+    name = prog;
+    if (sep) {
+        name = sep + 1;
+    }
+    printf("usage: %s [OPTIONS] {FILE}\n"
+           "  -f NAME[,...]   mstat field(s) to export (default: all)\n"
+           "  -h              this help message\n"
+           "  -t START:END    export records between START and END seconds (either may be omitted)\n"
+           "  --follow        keep exporting records appended to FILE until it is closed\n"
+           "", name);
+}
+
+/**
+ * Parse a time range
+ * @param arg "START:END", "START:" or ":END" (seconds)
+ * @return 0 on success. -1 if arg is malformed
+ */
+static int parse_time_range(const char *arg) {
+    const char *sep = strchr(arg, ':');
+    char *end;
+
+    if (!sep) {
+        return -1;
+    }
+    if (sep != arg) {
+        option.time_start = strtod(arg, &end);
+        if (end != sep) {
+            return -1;
+        }
+    }
+    if (*(sep + 1)) {
+        option.time_end = strtod(sep + 1, &end);
+        if (*end) {
+            return -1;
+        }
+    }
+    return option.time_start <= option.time_end ? 0 : -1;
+}
+
+static void parse_options(int argc, char *argv[]) {
     if (argc < 2) {
-        fprintf(stderr, "Missing path to *.mstat data file\n");
+        usage(argv[0]);
         exit(1);
     }
 
-    if (access(argv[1], F_OK)) {
-        perror(argv[1]);
-        exit(1);
+    option.time_start = -HUGE_VAL;
+    option.time_end = HUGE_VAL;
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+        if (strlen(arg) > 1 && *arg == '-') {
+            arg = argv[i] + 1;
+            if (!strcmp(arg, "h")) {
+                usage(argv[0]);
+                exit(0);
+            } else if (!strcmp(arg, "-follow")) {
+                option.follow = 1;
+            } else if (!strcmp(arg, "f")) {
+                size_t x = 0;
+                char *val;
+                char *token;
+
+                mstat_check_argument_str(argv, arg, i);
+                val = argv[i + 1];
+                option.fields = calloc(strlen(val) + 2, sizeof(*option.fields));
+                if (!option.fields) {
+                    perror("Unable to allocate memory for fields");
+                    exit(1);
+                }
+                while ((token = strsep(&val, ",")) != NULL) {
+                    if (*token) {
+                        option.fields[x++] = token;
+                    }
+                }
+                i++;
+            } else if (!strcmp(arg, "t")) {
+                mstat_check_argument_str(argv, arg, i);
+                if (parse_time_range(argv[i + 1]) < 0) {
+                    fprintf(stderr, "invalid time range: %s (expected START:END)\n", argv[i + 1]);
+                    exit(1);
+                }
+                i++;
+            } else {
+                fprintf(stderr, "unknown option: %s\n", argv[i]);
+                usage(argv[0]);
+                exit(1);
+            }
+        } else {
+            strncpy(option.filename, argv[i], PATH_MAX - 1);
+        }
     }
 
-    fp = mstat_open(argv[1]);
-    if (!fp) {
-        perror(argv[1]);
+    if (!strlen(option.filename)) {
+        fprintf(stderr, "Missing path to *.mstat data file\n");
         exit(1);
     }
+}
 
-    fields = mstat_read_fields(fp);
-    if (!fields) {
-        fprintf(stderr, "Unable to obtain field names from %s\n", argv[1]);
-        exit(1);
+/**
+ * Write pending output to stdout
+ */
+static void output_flush() {
+    const char *pos = output.data;
+
+    while (output.len) {
+        ssize_t len = write(STDOUT_FILENO, pos, output.len);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            exit(1);
+        }
+        pos += len;
+        output.len -= (size_t) len;
     }
+}
 
-    fields_total = mstat_get_field_count(fp);
-    for (size_t i = 0; i < fields_total; i++) {
-        printf("%s", fields[i]);
-        if (i < fields_total - 1) {
-            printf(",");
+/**
+ * Two-digit decimal strings "00" through "99"
+ */
+static const char digit_pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+/**
+ * Format an unsigned integer in decimal
+ * @param dest destination (at least 20 bytes)
+ * @param value integer
+ * @return number of bytes written
+ */
+static size_t format_u64(char *dest, unsigned long long value) {
+    char tmp[20];
+    char *pos = tmp + sizeof(tmp);
+    size_t len;
+
+    // Two digits per division
+    while (value >= 100) {
+        unsigned pair = (unsigned) (value % 100);
+        value /= 100;
+        pos -= 2;
+        memcpy(pos, digit_pairs + pair * 2, 2);
+    }
+    if (value >= 10) {
+        pos -= 2;
+        memcpy(pos, digit_pairs + value * 2, 2);
+    } else {
+        *--pos = (char) ('0' + value);
+    }
+    len = tmp + sizeof(tmp) - pos;
+    memcpy(dest, pos, len);
+    return len;
+}
+
+/**
+ * Format a double like printf("%lf") (six decimal places)
+ *
+ * The value is scaled to an integer number of millionths. Negative
+ * values, values too large to scale exactly and values so close to a
+ * rounding boundary that the scaling error could flip the last digit are
+ * left to snprintf(), so the output never differs from printf.
+ *
+ * @param dest destination (at least EXPORT_VALUE_MAX bytes)
+ * @param value number
+ * @return number of bytes written
+ */
+static size_t format_f64(char *dest, double value) {
+    double scaled = value * 1e6;
+    double whole;
+    double frac;
+    unsigned long long micro;
+    size_t len = 0;
+
+    if (signbit(value) || !(scaled < 0x1p50)) {
+        return (size_t) snprintf(dest, EXPORT_VALUE_MAX, "%lf", value);
+    }
+    // The product is off by at most half a unit in the last place
+    frac = modf(scaled, &whole);
+    if (fabs(frac - 0.5) <= scaled * 0x1p-52) {
+        return (size_t) snprintf(dest, EXPORT_VALUE_MAX, "%lf", value);
+    }
+    micro = (unsigned long long) whole + (frac > 0.5);
+
+    len += format_u64(dest, micro / 1000000);
+    dest[len++] = '.';
+    micro %= 1000000;
+    // Six zero-padded digits
+    for (int i = 5; i >= 0; i--) {
+        dest[len + i] = (char) ('0' + micro % 10);
+        micro /= 10;
+    }
+    return len + 6;
+}
+
+/**
+ * Find the first record at or after a time
+ * @param column timestamp column
+ * @param t time (seconds)
+ * @return index of record (column->count if none)
+ */
+static size_t find_time(const struct mstat_column_t *column, double t) {
+    size_t lo = 0;
+    size_t hi = column->count;
+
+    // Timestamps come from a monotonic clock and never decrease
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (mstat_column_f64(column, mid) < t) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
-    puts("");
+    return lo;
+}
+
+/**
+ * Format records as CSV rows
+ * @param columns one column view per exported field
+ * @param fields_total number of exported fields
+ * @param first first record
+ * @param last stop before this record
+ */
+static void export_records(const struct mstat_column_t *columns, size_t fields_total, size_t first, size_t last) {
+    for (size_t rec = first; rec < last; rec++) {
+        char *pos;
+
+        if (output.len > EXPORT_BUFFER_SIZE - EXPORT_VALUE_MAX * fields_total) {
+            output_flush();
+        }
+        pos = output.data + output.len;
+        for (size_t i = 0; i < fields_total; i++) {
+            if (columns[i].type == MSTAT_TYPE_F64) {
+                pos += format_f64(pos, mstat_column_f64(&columns[i], rec));
+            } else {
+                pos += format_u64(pos, mstat_column_u64(&columns[i], rec));
+            }
+            *pos++ = ',';
+        }
+        *(pos - 1) = '\n';
+        output.len = pos - output.data;
+    }
+}
+
+/**
+ * Resolve the column views of the exported fields
+ * Called again whenever the mapping changes (see mstat_map_refresh).
+ * @param map pointer to map
+ * @param columns one column view per exported field (modified)
+ * @param fields_total number of exported fields
+ */
+static void resolve_columns(const struct mstat_map_t *map, struct mstat_column_t *columns, size_t fields_total) {
+    for (size_t i = 0; i < fields_total; i++) {
+        mstat_map_column(map, mstat_map_find_field(map, option.fields[i]), &columns[i]);
+    }
+}
+
+/**
+ * Export records as they are appended to the file
+ * Returns once the writer closes the file, the file goes away, or a
+ * record passes the end of the time range. Only new records are read.
+ * @param map pointer to map
+ * @param columns one column view per exported field
+ * @param fields_total number of exported fields
+ */
+static void follow(struct mstat_map_t *map, struct mstat_column_t *columns, size_t fields_total) {
+    struct mstat_column_t time_column;
+    int watch;
+    int gone = 0;
 
-    if (mstat_rewind(fp) < 0) {
-        perror("Unable to rewind");
+    watch = mstat_watch_open(option.filename);
+    if (watch < 0) {
+        perror(option.filename);
         exit(1);
     }
+    // Records written before the watch was set up are picked up first
+    while (1) {
+        size_t first = map->hdr.records;
+        size_t last;
+        ssize_t added = mstat_map_refresh(map);
+        int status;
 
-    while (!mstat_iter(fp, &p)) {
-        char buf[1024] = {0};
-        for (size_t i = 0; i < fields_total; i++) {
-            struct mstat_record_t *pptr = &p;
-            union mstat_field_t result;
-            result = mstat_get_field_by_name(pptr, fields[i]);
+        if (added < 0) {
+            fprintf(stderr, "%s: unable to read new records\n", option.filename);
+            break;
+        }
+        if (added) {
+            resolve_columns(map, columns, fields_total);
+            last = map->hdr.records;
+            if (!mstat_map_column(map, mstat_map_find_field(map, "timestamp"), &time_column)) {
+                // Only the new records are searched
+                struct mstat_column_t added_column = time_column;
+                size_t base = first;
+                added_column.data += base * time_column.stride;
+                added_column.count = last - base;
+                first = base + find_time(&added_column, option.time_start);
+                last = base + find_time(&added_column, nextafter(option.time_end, HUGE_VAL));
+            }
+            export_records(columns, fields_total, first, last);
+            output_flush();
+            if (last < map->hdr.records) {
+                // Past the end of the time range
+                break;
+            }
+        }
+        if (gone || (map->hdr.flags & MSTAT_FLAG_CLOSED)) {
+            break;
+        }
 
-            if (!strcmp(fields[i], "timestamp")) {
-                snprintf(buf, sizeof(buf) - 1, "%lf", result.d64);
-            } else {
-                snprintf(buf, sizeof(buf) - 1, "%zu", result.u64);
+        status = mstat_watch_wait(watch);
+        if (status < 0 && errno != EINTR) {
+            perror(option.filename);
+            break;
+        }
+        // The file was removed or renamed. Export what its writer left.
+        gone = !status;
+    }
+    close(watch);
+}
+
+/**
+ * Export a per-mapping companion file
+ *
+ * Each line holds the values of one mapping at the time they changed.
+ *
+ * @param filename path to companion file
+ * @return 0 on success. -1 if filename is not a companion file
+ */
+static int export_maps(const char *filename) {
+    struct mstat_maps_t maps;
+    double timestamp;
+    FILE *fp;
+    int status;
+
+    fp = fopen(filename, "rb");
+    if (!fp) {
+        return -1;
+    }
+    if (mstat_maps_read_header(fp, &maps) < 0) {
+        mstat_maps_close(&maps);
+        fclose(fp);
+        return -1;
+    }
+
+    if (option.follow) {
+        fprintf(stderr, "%s: --follow is not supported for per-mapping files\n", filename);
+    }
+    printf("timestamp,mapping");
+    for (size_t i = 0; i < maps.fields; i++) {
+        printf(",%s", maps.names[i]);
+    }
+    puts("");
+
+    while ((status = mstat_maps_iter(fp, &maps, &timestamp)) > 0) {
+        if (timestamp < option.time_start || timestamp > option.time_end) {
+            continue;
+        }
+        for (size_t i = 0; i < maps.count; i++) {
+            struct mstat_mapping_t *mapping = maps.mappings[i];
+            if (mapping->generation != maps.generation) {
+                continue;
             }
-            if (i < fields_total - 1) {
-                strcat(buf, ",");
+            printf("%lf,\"%s\"", timestamp, mapping->name);
+            for (size_t f = 0; f < maps.fields && f < MSTAT_MAPS_VALUE_MAX; f++) {
+                printf(",%zu", mapping->value[f]);
             }
-            printf("%s", buf);
+            puts("");
         }
-        puts("");
+    }
+    if (status < 0) {
+        fprintf(stderr, "%s: damaged after %zu samples\n", filename, maps.generation);
     }
 
+    mstat_maps_close(&maps);
     fclose(fp);
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char *argv[]) {
+    struct mstat_map_t *map;
+    struct mstat_column_t *columns;
+    struct mstat_column_t time_column;
+    size_t fields_total;
+    size_t first, last;
+
+    memset(&option, 0, sizeof(option));
+    parse_options(argc, argv);
+
+    if (access(option.filename, F_OK)) {
+        perror(option.filename);
+        exit(1);
+    }
+
+    // Per-mapping companion files ('mstat -m') have a format of their own
+    if (!export_maps(option.filename)) {
+        return 0;
+    }
+
+    map = mstat_map_open(option.filename);
+    if (!map) {
+        fprintf(stderr, "Unable to read %s\n", option.filename);
+        exit(1);
+    }
+
+    // Without -f every stored field is exported
+    if (!option.fields) {
+        option.fields = map->fields;
+    }
+    for (fields_total = 0; option.fields[fields_total] != NULL; fields_total++);
+    if (!fields_total || fields_total >= EXPORT_BUFFER_SIZE / EXPORT_VALUE_MAX) {
+        fprintf(stderr, "Too %s fields requested\n", fields_total ? "many" : "few");
+        exit(1);
+    }
+
+    columns = calloc(fields_total, sizeof(*columns));
+    if (!columns) {
+        perror("Unable to allocate memory for columns");
+        exit(1);
+    }
+
+    // Resolve every field once. The record loop only follows column views.
+    for (size_t i = 0; i < fields_total; i++) {
+        if (mstat_map_column(map, mstat_map_find_field(map, option.fields[i]), &columns[i]) < 0) {
+            fprintf(stderr, "Invalid field: '%s'\n", option.fields[i]);
+            exit(1);
+        }
+        output.len += (size_t) snprintf(output.data + output.len, EXPORT_VALUE_MAX, "%s%s",
+                                        option.fields[i], i < fields_total - 1 ? "," : "\n");
+        if (output.len > EXPORT_BUFFER_SIZE - EXPORT_VALUE_MAX) {
+            output_flush();
+        }
+    }
+
+    first = 0;
+    last = map->hdr.records;
+    if (option.time_start > -HUGE_VAL || option.time_end < HUGE_VAL) {
+        if (mstat_map_column(map, mstat_map_find_field(map, "timestamp"), &time_column) < 0) {
+            fprintf(stderr, "%s has no timestamp field\n", option.filename);
+            exit(1);
+        }
+        first = find_time(&time_column, option.time_start);
+        last = find_time(&time_column, nextafter(option.time_end, HUGE_VAL));
+    }
+
+    export_records(columns, fields_total, first, last);
+    output_flush();
+
+    if (option.follow && last == map->hdr.records) {
+        follow(map, columns, fields_total);
+    }
+
+    free(columns);
+    mstat_map_close(map);
+    return 0;
+}
@@ -1,14 +1,81 @@
+#include <math.h>
+#include <libgen.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "common.h"
 #include "gnuplot.h"
+#include "decimate.h"
+
+// Width of a default gnuplot window (pixels)
+#define PLOT_WIDTH 640
+// Height of a default gnuplot window (pixels)
+#define PLOT_HEIGHT 480
+// Points drawn per series by default: two per pixel column
+#define PLOT_POINTS (PLOT_WIDTH * 2)
 
 extern char *mstat_field_names[];
+extern char *mstat_cgroup_field_names[];
 
 static struct Option {
     unsigned char verbose;
     char *fields[0xffff];
-    char filename[PATH_MAX];
+    /** Fields were requested with -f (otherwise they depend on the file) */
+    unsigned char fields_given;
+    /** Plot every field stored in the file (-f all) */
+    unsigned char all;
+    /** Input files (NULL terminated) */
+    char **filenames;
+    /** Number of input files */
+    size_t file_count;
+    /** Image file, or directory of images in batch mode (NULL = window) */
+    char *output;
+    /** Image format in batch mode (png or svg) */
+    char *format;
+    /** Files rendered at the same time in batch mode */
+    long jobs;
+    /** Keep plotting records appended to the file */
+    unsigned char follow;
+    /** MSTAT_DECIMATE_* */
+    int decimate;
+    /** Points drawn per series (0 = all) */
+    size_t points;
 } option;
 
+// Set by SIGINT/SIGTERM to end --follow
+static volatile sig_atomic_t interrupted;
+
+struct Series {
+    /** Values of the field */
+    struct mstat_column_t column;
+    /** Field is sampled by statm probes */
+    int probed;
+    /** Value of the last full sample */
+    double held;
+    /** Smallest value */
+    double min;
+    /** Largest value */
+    double max;
+};
+
+struct Input {
+    /** Mapped file */
+    struct mstat_map_t *map;
+    /** Requested fields */
+    struct Series *series;
+    /** Number of requested fields */
+    size_t count;
+    /** Record sources (statm probe or full sample) */
+    struct mstat_column_t source;
+    /** File stores record sources */
+    int has_source;
+    /** Record timestamps */
+    struct mstat_column_t timestamp;
+    /** Values of one record (one per field) */
+    double *values;
+};
+
 static void show_fields(char **fields) {
     size_t total;
     for (total = 0; fields[total] != NULL; total++);
@@ -33,12 +100,19 @@ static void usage(char *prog) {
     if (sep) {
         name = sep + 1;
     }
-    printf("usage: %s [OPTIONS] {FILE}\n"
-           "  -f NAME[,...]   mstat field(s) to plot (default: rss,pss,swap)\n"
+    printf("usage: %s [OPTIONS] {FILE} [FILE ...]\n"
+           "  -d METHOD       decimation: minmax, lttb or none (default: minmax)\n"
+           "  -f NAME[,...]   mstat field(s) to plot (default: rss,pss,swap. cgroup: current,anon,file)\n"
            "  -h              this help message\n"
+           "  -j JOBS         files rendered at once in batch mode (default: %ld)\n"
            "  -l              list mstat fields\n"
+           "  -n POINTS       points drawn per field (default: %d)\n"
+           "  -o OUTPUT       write an image (.png or .svg) instead of opening a window\n"
+           "                  with several files OUTPUT is a directory\n"
+           "  -T FORMAT       image format in batch mode: png or svg (default: png)\n"
            "  -v              verbose mode\n"
-           "", name);
+           "  --follow        keep plotting records appended to FILE (implies -d minmax)\n"
+           "", name, sysconf(_SC_NPROCESSORS_ONLN), PLOT_POINTS);
 }
 
 static void parse_options(int argc, char *argv[]) {
@@ -51,6 +125,15 @@ static void parse_options(int argc, char *argv[]) {
     option.fields[1] = "pss";
     option.fields[2] = "swap";
     option.fields[3] = NULL;
+    option.decimate = MSTAT_DECIMATE_MINMAX;
+    option.points = PLOT_POINTS;
+    option.format = "png";
+    option.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    option.filenames = calloc(argc, sizeof(*option.filenames));
+    if (!option.filenames) {
+        perror("Unable to allocate memory for file names");
+        exit(1);
+    }
 
     for (int x = 0, i = 1; i < argc; i++) {
         char *arg = argv[i];
@@ -62,11 +145,56 @@ static void parse_options(int argc, char *argv[]) {
             }
             if (!strcmp(arg, "l")) {
                 show_fields(&mstat_field_names[MSTAT_FIELD_RSS]);
+                printf("\ncgroup (mstat -g):\n");
+                show_fields(&mstat_cgroup_field_names[MSTAT_CGROUP_FIELD_CURRENT]);
                 exit(0);
             }
             if (!strcmp(arg, "v")) {
                 option.verbose = 1;
             }
+            if (!strcmp(arg, "d")) {
+                mstat_check_argument_str(argv, arg, i);
+                if (!strcmp(argv[i+1], "minmax")) {
+                    option.decimate = MSTAT_DECIMATE_MINMAX;
+                } else if (!strcmp(argv[i+1], "lttb")) {
+                    option.decimate = MSTAT_DECIMATE_LTTB;
+                } else if (!strcmp(argv[i+1], "none")) {
+                    option.decimate = MSTAT_DECIMATE_NONE;
+                } else {
+                    fprintf(stderr, "unknown decimation method: %s\n", argv[i+1]);
+                    exit(1);
+                }
+                i++;
+                continue;
+            }
+            if (!strcmp(arg, "-follow")) {
+                option.follow = 1;
+                continue;
+            }
+            if (!strcmp(arg, "o")) {
+                mstat_check_argument_str(argv, arg, i);
+                option.output = argv[i+1];
+                i++;
+                continue;
+            }
+            if (!strcmp(arg, "T")) {
+                mstat_check_argument_str(argv, arg, i);
+                option.format = argv[i+1];
+                i++;
+                continue;
+            }
+            if (!strcmp(arg, "j")) {
+                mstat_check_argument_int(argv, arg, i);
+                option.jobs = strtol(argv[i+1], NULL, 10);
+                i++;
+                continue;
+            }
+            if (!strcmp(arg, "n")) {
+                mstat_check_argument_int(argv, arg, i);
+                option.points = strtoul(argv[i+1], NULL, 10);
+                i++;
+                continue;
+            }
             if (!strcmp(arg, "f")) {
                 mstat_check_argument_str(argv, arg, i);
                 char *val = argv[i+1];
@@ -75,11 +203,9 @@ static void parse_options(int argc, char *argv[]) {
                     fprintf(stderr, "%s requires an argument\n", argv[i]);
                     exit(1);
                 }
+                option.fields_given = 1;
                 if (!strcmp(val, "all")) {
-                    for (x = MSTAT_FIELD_RSS; mstat_field_names[x] != NULL; x++) {
-                        option.fields[x] = strdup(mstat_field_names[x]);
-                    }
-                    option.fields[x] = NULL;
+                    option.all = 1;
                 } else {
                     while ((token = strsep(&val, ",")) != NULL) {
                         option.fields[x] = token;
@@ -89,51 +215,240 @@ static void parse_options(int argc, char *argv[]) {
                 i++;
             }
         } else {
-            strcpy(option.filename, argv[i]);
+            option.filenames[option.file_count++] = argv[i];
         }
     }
+
+    if (!option.file_count) {
+        fprintf(stderr, "No input files\n");
+        exit(1);
+    }
+    if (option.jobs < 1) {
+        option.jobs = 1;
+    }
+    if (option.follow && option.file_count > 1) {
+        fprintf(stderr, "--follow takes a single file\n");
+        exit(1);
+    }
+    if (option.file_count > 1) {
+        char probe[PATH_MAX] = {0};
+        struct stat st;
+        if (!option.output) {
+            fprintf(stderr, "Plotting several files requires an output directory (-o DIR)\n");
+            exit(1);
+        }
+        if (stat(option.output, &st) < 0 || !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "%s: not a directory\n", option.output);
+            exit(1);
+        }
+        snprintf(probe, sizeof(probe) - 1, "image.%s", option.format);
+        if (!gnuplot_terminal(probe)) {
+            fprintf(stderr, "Unsupported image format: %s\n", option.format);
+            exit(1);
+        }
+    } else if (option.output && !gnuplot_terminal(option.output)) {
+        fprintf(stderr, "%s: image name must end with .png or .svg\n", option.output);
+        exit(1);
+    }
 }
 
-int main(int argc, char *argv[]) {
+/**
+ * Return the image a file is rendered to in batch mode
+ * DIR/NAME.FORMAT, where NAME is the file name without ".mstat"
+ * @param filename input file
+ * @param output destination (modified)
+ * @param maxlen size of destination
+ */
+static void batch_output(const char *filename, char *output, size_t maxlen) {
+    char tmp[PATH_MAX] = {0};
+    char *name;
+    char *ext;
+
+    strncpy(tmp, filename, sizeof(tmp) - 1);
+    name = basename(tmp);
+    ext = strrchr(name, '.');
+    if (ext && ext != name && !strcmp(ext, ".mstat")) {
+        *ext = '\0';
+    }
+    snprintf(output, maxlen, "%s/%s.%s", option.output, name, option.format);
+}
+
+/**
+ * Find the columns of the requested fields
+ * Called again whenever the mapping changes (see mstat_map_refresh).
+ * @param in pointer to input
+ * @param field requested field names
+ */
+static void resolve_columns(struct Input *in, char **field) {
+    for (size_t i = 0; i < in->count; i++) {
+        mstat_map_column(in->map, mstat_map_find_field(in->map, field[i]), &in->series[i].column);
+    }
+    in->has_source = !mstat_map_column(in->map, mstat_map_find_field(in->map, "source"), &in->source);
+    mstat_map_column(in->map, mstat_map_find_field(in->map, "timestamp"), &in->timestamp);
+}
+
+/**
+ * Stream records through the decimator. x-axis will always be time elapsed.
+ * @param in pointer to input
+ * @param decimate pointer to decimator
+ * @param first first record
+ * @param last stop before this record
+ */
+static void push_records(struct Input *in, struct mstat_decimate_t *decimate, size_t first, size_t last) {
+    for (size_t n = first; n < last; n++) {
+        int probe = in->has_source && mstat_column_u64(&in->source, n) == MSTAT_SOURCE_STATM;
+        for (size_t i = 0; i < in->count; i++) {
+            struct Series *s = &in->series[i];
+            double value;
+            if (probe && !s->probed) {
+                value = s->held;
+            } else {
+                value = mstat_column_f64(&s->column, n) / 1024;
+                s->held = value;
+            }
+            if (value < s->min) {
+                s->min = value;
+            }
+            if (value > s->max) {
+                s->max = value;
+            }
+            in->values[i] = value;
+        }
+        mstat_decimate_push(decimate, mstat_column_f64(&in->timestamp, n) / 3600, in->values);
+    }
+}
+
+/**
+ * Print the smallest and largest value of each field
+ * @param field requested field names
+ * @param series requested fields
+ * @param count number of requested fields
+ */
+static void show_minmax(char **field, const struct Series *series, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        printf("%s min(%.2lf) max(%.2lf)\n", field[i], series[i].min, series[i].max);
+    }
+}
+
+static void follow_interrupt(int sig) {
+    (void) sig;
+    interrupted = 1;
+}
+
+/**
+ * Wait for records appended to the file and add them to the plot
+ * Returns when the writer closes the file, the file goes away, or the
+ * user interrupts. Each update only reads the new records.
+ * @param in pointer to input
+ * @param decimate pointer to live decimator
+ * @param plt pointer to gnuplot stream (NULL = no plot yet)
+ * @param gp plot configuration
+ * @param output image file (NULL = window)
+ * @return 0 on success. -1 on error
+ */
+static int follow_file(struct Input *in, const char *filename, struct mstat_decimate_t *decimate,
+                       FILE *plt, struct GNUPLOT_PLOT **gp, const char *output) {
+    struct sigaction sa;
+    int watch;
+    int gone = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = follow_interrupt;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    watch = mstat_watch_open(filename);
+    if (watch < 0) {
+        perror(filename);
+        return -1;
+    }
+    // Records written before the watch was set up are picked up first
+    while (!interrupted) {
+        size_t before = in->map->hdr.records;
+        ssize_t added = mstat_map_refresh(in->map);
+        int status;
+
+        if (added < 0) {
+            fprintf(stderr, "%s: unable to read new records\n", filename);
+            break;
+        }
+        if (added) {
+            resolve_columns(in, option.fields);
+            push_records(in, decimate, before, in->map->hdr.records);
+            if (plt) {
+                mstat_decimate_render(decimate);
+                if (gnuplot_replot(plt, gp, decimate->x, decimate->y, decimate->count, in->count, output) < 0) {
+                    break;
+                }
+            }
+            if (option.verbose) {
+                printf("Records: %zu\n", in->map->hdr.records);
+            }
+        }
+        if (gone || (in->map->hdr.flags & MSTAT_FLAG_CLOSED) || (!plt && in->map->hdr.records)) {
+            // Finished, or the first records arrived
+            break;
+        }
+
+        status = mstat_watch_wait(watch);
+        if (status < 0 && errno != EINTR) {
+            perror(filename);
+            break;
+        }
+        // The file was removed or renamed. Read what its writer left.
+        gone = !status;
+    }
+    close(watch);
+    return 0;
+}
+
+/**
+ * Plot one MSTAT file
+ * @param filename MSTAT file
+ * @param output image file (NULL opens a window)
+ * @param quiet do not print information about the file
+ * @return 0 on success. Exits on error
+ */
+static int plot_file(const char *filename, const char *output, int quiet) {
     struct mstat_record_t p;
     char **stored_fields;
     char **field;
     size_t data_total;
-    double **axis_y;
-    double *axis_x;
-    double mem_min, mem_max;
     size_t rec;
-    FILE *fp;
-
-    // Initialize options
-    memset(&option, 0, sizeof(option));
-    parse_options(argc, argv);
+    struct mstat_map_t *map;
+    struct Series *series;
+    double *values;
+    struct mstat_decimate_t decimate;
+    struct Input in;
 
     rec = 0;
-    mem_min = 0.0;
-    mem_max = 0.0;
     field = option.fields;
     stored_fields = NULL;
-    axis_x = NULL;
-    axis_y = NULL;
-    fp = NULL;
+    map = NULL;
 
-    if (access(option.filename, F_OK) < 0) {
-        perror(option.filename);
+    if (access(filename, F_OK) < 0) {
+        perror(filename);
         exit(1);
     }
 
-    fp = mstat_open(option.filename);
-    if (!fp) {
-        perror(option.filename);
+    map = mstat_map_open(filename);
+    if (!map) {
+        fprintf(stderr, "Unable to read %s\n", filename);
         exit(1);
     }
 
+    // Fields that are not requested depend on the schema of the file
+    if (option.all) {
+        field = &map->fields[MSTAT_FIELD_RSS];
+    } else if (!option.fields_given) {
+        field = mstat_map_default_fields(map);
+    }
+
     // Get total number of user-requested fields
     for (data_total = 0; field[data_total] != NULL; data_total++);
 
     // Retrieve fields from MSTAT header
-    stored_fields = mstat_read_fields(fp);
+    stored_fields = map->fields;
     for (size_t i = 0; field[i] != NULL; i++) {
         if (mstat_is_valid_field(stored_fields, field[i])) {
             fprintf(stderr, "Invalid field: '%s'\n", field[i]);
@@ -143,51 +458,90 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    // We don't store the number of records in the MSTAT data. Count them here.
-    while (!mstat_iter(fp, &p))
-        rec++;
-
-    axis_x = calloc(rec, sizeof(axis_x));
-    if (!axis_x) {
-        perror("Unable to allocate enough memory for axis_x array");
+    // The header knows how many records follow
+    rec = map->hdr.records;
+    if (!rec && !option.follow) {
+        fprintf(stderr, "MSTAT axis_y file does not have any records\n");
         exit(1);
     }
 
-    axis_y = calloc(data_total + 1, sizeof(**axis_y));
-    if (!axis_y) {
-        perror("Unable to allocate enough memory for axis_y array");
+    series = calloc(data_total + 1, sizeof(*series));
+    values = calloc(data_total + 1, sizeof(*values));
+    if (!series || !values) {
+        perror("Unable to allocate enough memory for series");
         exit(1);
     }
-
-    for (int i = 0, n = 0; field[i] != NULL; i++) {
-        axis_y[i] = calloc(rec, sizeof(*axis_y[0]));
-        n++;
+    for (size_t i = 0; i < data_total; i++) {
+        // statm probes only carry rss and vm_size. Other fields are held at
+        // the value of the last full sample (see mstat_merge_probe).
+        series[i].probed = mstat_field_is_probed(mstat_get_field_id(field[i]));
+    }
+    in.map = map;
+    in.series = series;
+    in.count = data_total;
+    in.values = values;
+    resolve_columns(&in, field);
+
+    if (option.follow) {
+        // The number of records keeps changing
+        if (mstat_decimate_init_live(&decimate, option.points ? option.points : PLOT_POINTS, data_total) < 0) {
+            perror("Unable to allocate enough memory for plot data");
+            exit(1);
+        }
+    } else if (mstat_decimate_init(&decimate, option.decimate, rec, option.points, data_total) < 0) {
+        perror("Unable to allocate enough memory for plot data");
+        exit(1);
     }
 
-    mstat_rewind(fp);
-    printf("Reading: %s\n", option.filename);
+    if (!quiet) {
+        printf("Reading: %s\n", filename);
+    }
 
-    // Assign requested MSTAT data to y-axis. x-axis will always be time elapsed.
-    rec = 0;
-    while (!mstat_iter(fp, &p)) {
-        axis_x[rec] = mstat_get_field_by_name(&p, "timestamp").d64 / 3600;
+    for (int pass = 0; pass < mstat_decimate_passes(&decimate); pass++) {
         for (size_t i = 0; i < data_total; i++) {
-            axis_y[i][rec] = (double) mstat_get_field_by_name(&p, field[i]).u64 / 1024;
+            series[i].held = 0.0;
+            series[i].min = HUGE_VAL;
+            series[i].max = -HUGE_VAL;
         }
-        rec++;
+        push_records(&in, &decimate, 0, rec);
+        mstat_decimate_end_pass(&decimate);
     }
-
+    // Wait for the first record of a file that was just created
+    if (option.follow && !rec && follow_file(&in, filename, &decimate, NULL, NULL, NULL) < 0) {
+        exit(1);
+    }
+    rec = map->hdr.records;
     if (!rec) {
         fprintf(stderr, "MSTAT axis_y file does not have any records\n");
         exit(1);
+    }
+    mstat_decimate_render(&decimate);
+    mstat_map_get(map, 0, &p);
+
+    if (quiet) {
+        // Nothing to show
+    } else if (decimate.count < rec) {
+        printf("Records: %zu (%zu points drawn)\n", rec, decimate.count);
     } else {
         printf("Records: %zu\n", rec);
     }
 
+    // Show sampler statistics stored by mstat -T
+    if (option.verbose && !quiet) {
+        char **trailer_keys;
+        double *trailer_values;
+        int trailer_total = mstat_read_trailer(map->fp, &trailer_keys, &trailer_values);
+        for (int i = 0; i < trailer_total; i++) {
+            printf("%s: %g\n", trailer_keys[i], trailer_values[i]);
+            free(trailer_keys[i]);
+        }
+        free(trailer_keys);
+        free(trailer_values);
+    }
+
     // Show min/max
-    for (size_t i = 0; axis_y[i] != NULL && i < data_total; i++) {
-        mstat_get_mmax(axis_y[i], rec, &mem_min, &mem_max);
-        printf("%s min(%.2lf) max(%.2lf)\n", field[i], mem_min, mem_max);
+    if (!quiet) {
+        show_minmax(field, series, data_total);
     }
 
     if (mstat_find_program("gnuplot", NULL)) {
@@ -210,7 +564,21 @@ int main(int argc, char *argv[]) {
     }
 
     char title[255] = {0};
-    snprintf(title, sizeof(title) - 1, "Memory Usage (PID %d)", p.pid);
+    if (!strcmp(map->fields[0], "pid")) {
+        snprintf(title, sizeof(title) - 1, "Memory Usage (PID %d)", p.pid);
+    } else {
+        // cgroup files are named after the cgroup
+        char tmpname[PATH_MAX] = {0};
+        char *name;
+        char *ext;
+        strncpy(tmpname, filename, sizeof(tmpname) - 1);
+        name = basename(tmpname);
+        ext = strstr(name, ".mstat");
+        if (ext) {
+            *ext = '\0';
+        }
+        snprintf(title, sizeof(title) - 1, "Memory Usage (cgroup %s)", name);
+    }
 
     gp[0]->xlabel = strdup("Time (HR)");
     gp[0]->ylabel = strdup("MB");
@@ -227,26 +595,158 @@ int main(int argc, char *argv[]) {
         gp[i]->line_color = 0;
     }
 
-    printf("Generating plot... ");
-    fflush(stdout);
+    if (!quiet) {
+        printf("Generating plot... ");
+        fflush(stdout);
+    }
 
     FILE *plt;
-    plt = gnuplot_open();
+    plt = output ? gnuplot_open_headless() : gnuplot_open();
     if (!plt) {
         fprintf(stderr, "Failed to open gnuplot stream\n");
         exit(1);
     }
-    gnuplot_plot(plt, gp, axis_x, axis_y, rec, data_total);
-    gnuplot_wait(plt);
-    gnuplot_close(plt);
-    printf("done!\n");
+    if (output) {
+        gnuplot_output(plt, output, PLOT_WIDTH, PLOT_HEIGHT);
+    }
+    if (gnuplot_plot(plt, gp, decimate.x, decimate.y, decimate.count, data_total) < 0) {
+        fprintf(stderr, "Failed to write plot data\n");
+        gnuplot_close(plt);
+        exit(1);
+    }
+    if (option.follow) {
+        if (output) {
+            // Complete the image now. Every update writes it again.
+            gnuplot_sh(plt, "unset output\n");
+            fflush(plt);
+        }
+        if (!quiet) {
+            printf("following (interrupt to stop)... ");
+            fflush(stdout);
+        }
+        follow_file(&in, filename, &decimate, plt, gp, output);
+        if (!quiet) {
+            printf("\nRecords: %zu\n", map->hdr.records);
+            show_minmax(field, series, data_total);
+        }
+    }
+    if (!output && !interrupted) {
+        gnuplot_wait(plt);
+    }
+    // An interrupt reaches gnuplot too
+    if (gnuplot_close(plt) && !interrupted) {
+        fprintf(stderr, "%s: gnuplot failed\n", filename);
+        gnuplot_remove_data(gp[0]);
+        exit(1);
+    }
+    gnuplot_remove_data(gp[0]);
+    if (!quiet) {
+        printf("done!\n");
+    }
 
-    free(axis_x);
     for (size_t i = 0; i < data_total; i++) {
-        free(axis_y[i]);
         free(gp[i]);
     }
-    free(axis_y);
     free(gp);
+    free(series);
+    free(values);
+    mstat_decimate_free(&decimate);
+    mstat_map_close(map);
     return 0;
 }
+
+/**
+ * Render every input file to an image
+ * Each file is plotted by a child process with its own gnuplot. At most
+ * option.jobs of them run at once.
+ * @return number of files that failed
+ */
+static size_t plot_batch() {
+    size_t next = 0;
+    size_t running = 0;
+    size_t done = 0;
+    size_t failed = 0;
+    pid_t *pids;
+
+    pids = calloc(option.file_count, sizeof(*pids));
+    if (!pids) {
+        perror("Unable to allocate memory for batch");
+        exit(1);
+    }
+
+    while (done < option.file_count) {
+        int status;
+        pid_t pid;
+
+        // Fill the pool
+        while (running < (size_t) option.jobs && next < option.file_count) {
+            char output[PATH_MAX] = {0};
+            batch_output(option.filenames[next], output, sizeof(output) - 1);
+            fflush(stdout);
+            fflush(stderr);
+            pid = fork();
+            if (pid < 0) {
+                perror("fork");
+                if (!running) {
+                    exit(1);
+                }
+                break;
+            }
+            if (pid == 0) {
+                _exit(plot_file(option.filenames[next], output, 1) ? 1 : 0);
+            }
+            pids[next] = pid;
+            next++;
+            running++;
+        }
+
+        // Reap one child
+        pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("wait");
+            exit(1);
+        }
+        for (size_t i = 0; i < next; i++) {
+            if (pids[i] != pid) {
+                continue;
+            }
+            char output[PATH_MAX] = {0};
+            batch_output(option.filenames[i], output, sizeof(output) - 1);
+            done++;
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                printf("[%zu/%zu] %s -> %s\n", done, option.file_count, option.filenames[i], output);
+            } else {
+                printf("[%zu/%zu] %s failed\n", done, option.file_count, option.filenames[i]);
+                failed++;
+            }
+            pids[i] = 0;
+            break;
+        }
+        running--;
+    }
+    free(pids);
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    int status = 0;
+
+    // Initialize options
+    memset(&option, 0, sizeof(option));
+    parse_options(argc, argv);
+
+    if (option.file_count == 1) {
+        status = plot_file(option.filenames[0], option.output, 0);
+    } else {
+        if (mstat_find_program("gnuplot", NULL)) {
+            fprintf(stderr, "To render plots please install gnuplot\n");
+            exit(1);
+        }
+        status = plot_batch() ? 1 : 0;
+    }
+    free(option.filenames);
+    return status;
+}
\ No newline at end of file
@@ -0,0 +1,402 @@
+#include <math.h>
+#include "common.h"
+
+extern char *mstat_field_names[];
+extern char *mstat_cgroup_field_names[];
+
+static struct Option {
+    /** Field(s) to summarize (NULL terminated. NULL = depends on the first file) */
+    char **fields;
+    /** Summarize every field stored in the first file (-f all) */
+    unsigned char all;
+    /** Time above this value is reported (kB. HUGE_VAL = not reported) */
+    double threshold;
+    /** Write the combined summary to this file (NULL = no summary) */
+    char *summary;
+    /** Input files (NULL terminated) */
+    char **filenames;
+    /** Number of input files */
+    size_t file_count;
+} option;
+
+static void show_fields(char **fields) {
+    size_t total;
+    for (total = 0; fields[total] != NULL; total++);
+
+    for (size_t i = 0, tokens = 0; i < total; i++) {
+        if (tokens == 4) {
+            printf("\n");
+            tokens = 0;
+        }
+        printf("%-20s", fields[i]);
+        tokens++;
+    }
+    printf("\n");
+}
+
+static void usage(char *prog) {
+    char *sep;
+    char *name;
+
+    sep = strrchr(prog, '/');
+    name = prog;
+    if (sep) {
+        name = sep + 1;
+    }
+    printf("usage: %s [OPTIONS] {FILE} [FILE ...]\n"
+           "  -a MB           report the time spent above MB\n"
+           "  -f NAME[,...]   mstat field(s) to summarize (default: rss,pss,swap. cgroup: current,anon,file)\n"
+           "  -h              this help message\n"
+           "  -l              list mstat fields\n"
+           "  -s SUMMARY      write the combined statistics to SUMMARY\n"
+           "\n"
+           "FILE is a MSTAT file, or a SUMMARY written by -s.\n"
+           "", name);
+}
+
+static void parse_options(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    option.threshold = HUGE_VAL;
+    option.filenames = calloc(argc, sizeof(*option.filenames));
+    if (!option.filenames) {
+        perror("Unable to allocate memory for file names");
+        exit(1);
+    }
+
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+        if (strlen(arg) > 1 && *arg == '-') {
+            arg = argv[i] + 1;
+            if (!strcmp(arg, "h")) {
+                usage(argv[0]);
+                exit(0);
+            } else if (!strcmp(arg, "l")) {
+                show_fields(&mstat_field_names[MSTAT_FIELD_RSS]);
+                printf("\ncgroup (mstat -g):\n");
+                show_fields(&mstat_cgroup_field_names[MSTAT_CGROUP_FIELD_CURRENT]);
+                exit(0);
+            } else if (!strcmp(arg, "a")) {
+                mstat_check_argument_double(argv, arg, i);
+                option.threshold = strtod(argv[i + 1], NULL) * 1024;
+                i++;
+            } else if (!strcmp(arg, "s")) {
+                mstat_check_argument_str(argv, arg, i);
+                option.summary = argv[i + 1];
+                i++;
+            } else if (!strcmp(arg, "f")) {
+                size_t x = 0;
+                char *val;
+                char *token;
+
+                mstat_check_argument_str(argv, arg, i);
+                val = argv[i + 1];
+                if (!strcmp(val, "all")) {
+                    option.all = 1;
+                    i++;
+                    continue;
+                }
+                option.fields = calloc(strlen(val) + 2, sizeof(*option.fields));
+                if (!option.fields) {
+                    perror("Unable to allocate memory for fields");
+                    exit(1);
+                }
+                while ((token = strsep(&val, ",")) != NULL) {
+                    if (*token) {
+                        option.fields[x++] = token;
+                    }
+                }
+                i++;
+            } else {
+                fprintf(stderr, "unknown option: %s\n", argv[i]);
+                usage(argv[0]);
+                exit(1);
+            }
+        } else {
+            option.filenames[option.file_count++] = argv[i];
+        }
+    }
+
+    if (!option.file_count) {
+        fprintf(stderr, "Missing path to *.mstat data file\n");
+        exit(1);
+    }
+}
+
+/**
+ * Return the fields summarized when none are named
+ *
+ * The schema of the first MSTAT file decides: process files default to
+ * rss, pss and swap, cgroup files (mstat -g) to current, anon and file.
+ * With -f all every field after the timestamp is used.
+ *
+ * @param filename first input file
+ * @return field names (NULL terminated)
+ */
+static char **default_fields(const char *filename) {
+    static char *process[] = {"rss", "pss", "swap", NULL};
+    char magic[MSTAT_SUMMARY_MAGIC_SIZE] = {0};
+    struct mstat_map_t *map;
+    char **result;
+    size_t total;
+    FILE *fp;
+
+    // Summaries store their own fields
+    fp = fopen(filename, "rb");
+    if (!fp) {
+        return option.all ? &mstat_field_names[MSTAT_FIELD_RSS] : process;
+    }
+    if (fread(magic, sizeof(magic), 1, fp) && !memcmp(magic, MSTAT_SUMMARY_MAGIC, sizeof(magic))) {
+        fclose(fp);
+        return option.all ? &mstat_field_names[MSTAT_FIELD_RSS] : process;
+    }
+    fclose(fp);
+
+    map = mstat_map_open(filename);
+    if (!map) {
+        return option.all ? &mstat_field_names[MSTAT_FIELD_RSS] : process;
+    }
+    if (option.all) {
+        // The map owns its names
+        for (total = 0; map->fields[MSTAT_FIELD_RSS + total] != NULL; total++);
+        result = calloc(total + 1, sizeof(*result));
+        for (size_t i = 0; result && i < total; i++) {
+            result[i] = strdup(map->fields[MSTAT_FIELD_RSS + i]);
+        }
+    } else {
+        result = mstat_map_default_fields(map);
+    }
+    mstat_map_close(map);
+    if (!result) {
+        perror("Unable to allocate memory for fields");
+        exit(1);
+    }
+    return result;
+}
+
+/**
+ * Summarize the requested fields of a MSTAT file
+ * @param filename MSTAT file
+ * @param stats one statistics structure per field (modified)
+ * @param records number of records read (modified)
+ * @return 0 on success. -1 on error
+ */
+static int summarize_file(const char *filename, struct mstat_stats_t *stats, size_t *records) {
+    struct mstat_map_t *map;
+
+    map = mstat_map_open(filename);
+    if (!map) {
+        fprintf(stderr, "Unable to read %s\n", filename);
+        return -1;
+    }
+    for (size_t i = 0; option.fields[i] != NULL; i++) {
+        int field = mstat_map_find_field(map, option.fields[i]);
+        if (field < 0) {
+            fprintf(stderr, "%s: no such field: '%s'\n", filename, option.fields[i]);
+            mstat_map_close(map);
+            return -1;
+        }
+        if (mstat_stats_map(map, field, &stats[i]) < 0) {
+            fprintf(stderr, "%s: unable to read field '%s'\n", filename, option.fields[i]);
+            mstat_map_close(map);
+            return -1;
+        }
+    }
+    *records = map->hdr.records;
+    mstat_map_close(map);
+    return 0;
+}
+
+/**
+ * Load the requested fields from a summary file
+ * @param fp pointer to summary stream (positioned at the start)
+ * @param filename name of summary file
+ * @param stats one statistics structure per field (modified)
+ * @param records number of records summarized (modified)
+ * @return 0 on success. -1 on error
+ */
+static int load_summary(FILE *fp, const char *filename, struct mstat_stats_t *stats, size_t *records) {
+    char **names;
+    struct mstat_stats_t *stored;
+    int total;
+    int status = 0;
+
+    total = mstat_read_summary(fp, &names, &stored);
+    if (total < 0) {
+        fprintf(stderr, "%s: corrupt summary\n", filename);
+        return -1;
+    }
+    *records = 0;
+    for (size_t i = 0; option.fields[i] != NULL && !status; i++) {
+        int found = 0;
+        for (int x = 0; x < total; x++) {
+            if (strcmp(names[x], option.fields[i]) != 0) {
+                continue;
+            }
+            found = 1;
+            if (mstat_stats_merge(&stats[i], &stored[x]) < 0) {
+                fprintf(stderr, "%s: summary was written with a different threshold (-a)\n", filename);
+                status = -1;
+            }
+            *records = stored[x].count;
+            break;
+        }
+        if (!found) {
+            fprintf(stderr, "%s: no such field: '%s'\n", filename, option.fields[i]);
+            status = -1;
+        }
+    }
+    for (int x = 0; x < total; x++) {
+        mstat_stats_free(&stored[x]);
+        free(names[x]);
+    }
+    free(names);
+    free(stored);
+    return status;
+}
+
+/**
+ * Print statistics of the requested fields
+ * @param title first line
+ * @param stats one statistics structure per field
+ * @param records number of records
+ */
+static void show_stats(const char *title, const struct mstat_stats_t *stats, size_t records) {
+    int above = option.threshold != HUGE_VAL;
+
+    printf("%s: %zu records, %.2lf s\n", title, records, stats[0].duration);
+    printf("%-20s %12s %12s %12s %12s %12s", "field", "peak(MB)", "mean(MB)", "p50(MB)", "p95(MB)", "p99(MB)");
+    if (above) {
+        printf(" %12s", "above(s)");
+    }
+    printf("\n");
+    for (size_t i = 0; option.fields[i] != NULL; i++) {
+        const struct mstat_stats_t *s = &stats[i];
+        double mean = s->count ? s->sum / (double) s->count : 0.0;
+        printf("%-20s %12.2lf %12.2lf %12.2lf %12.2lf %12.2lf", option.fields[i],
+               s->count ? s->max / 1024 : 0.0, mean / 1024,
+               mstat_stats_quantile(s, 0.50) / 1024,
+               mstat_stats_quantile(s, 0.95) / 1024,
+               mstat_stats_quantile(s, 0.99) / 1024);
+        if (above) {
+            printf(" %12.2lf", s->above);
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct mstat_stats_t *stats;
+    struct mstat_stats_t *combined;
+    size_t field_count;
+    size_t combined_records = 0;
+    int status = 0;
+
+    memset(&option, 0, sizeof(option));
+    parse_options(argc, argv);
+    if (!option.fields || option.all) {
+        option.fields = default_fields(option.filenames[0]);
+    }
+
+    for (field_count = 0; option.fields[field_count] != NULL; field_count++);
+    if (!field_count) {
+        fprintf(stderr, "No fields requested\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < field_count; i++) {
+        if (mstat_get_field_id(option.fields[i]) < 0
+            && mstat_is_valid_field(mstat_cgroup_field_names, option.fields[i])) {
+            fprintf(stderr, "Invalid field: '%s'\n", option.fields[i]);
+            printf("requested field must be one or more of...\n");
+            show_fields(&mstat_field_names[MSTAT_FIELD_RSS]);
+            printf("\ncgroup (mstat -g):\n");
+            show_fields(&mstat_cgroup_field_names[MSTAT_CGROUP_FIELD_CURRENT]);
+            exit(1);
+        }
+    }
+
+    stats = calloc(field_count, sizeof(*stats));
+    combined = calloc(field_count, sizeof(*combined));
+    if (!stats || !combined) {
+        perror("Unable to allocate memory for statistics");
+        exit(1);
+    }
+    for (size_t i = 0; i < field_count; i++) {
+        if (mstat_stats_init(&combined[i], option.threshold) < 0) {
+            perror("Unable to allocate memory for statistics");
+            exit(1);
+        }
+    }
+
+    for (size_t f = 0; f < option.file_count; f++) {
+        const char *filename = option.filenames[f];
+        char magic[MSTAT_SUMMARY_MAGIC_SIZE] = {0};
+        size_t records = 0;
+        int result;
+        FILE *fp;
+
+        for (size_t i = 0; i < field_count; i++) {
+            if (mstat_stats_init(&stats[i], option.threshold) < 0) {
+                perror("Unable to allocate memory for statistics");
+                exit(1);
+            }
+        }
+
+        fp = fopen(filename, "rb");
+        if (!fp) {
+            perror(filename);
+            status = 1;
+            continue;
+        }
+        if (fread(magic, sizeof(magic), 1, fp) && !memcmp(magic, MSTAT_SUMMARY_MAGIC, sizeof(magic))) {
+            rewind(fp);
+            result = load_summary(fp, filename, stats, &records);
+        } else {
+            result = summarize_file(filename, stats, &records);
+        }
+        fclose(fp);
+
+        if (!result) {
+            show_stats(filename, stats, records);
+            printf("\n");
+            for (size_t i = 0; i < field_count; i++) {
+                mstat_stats_merge(&combined[i], &stats[i]);
+            }
+            combined_records += records;
+        } else {
+            status = 1;
+        }
+        for (size_t i = 0; i < field_count; i++) {
+            mstat_stats_free(&stats[i]);
+        }
+    }
+
+    if (option.file_count > 1) {
+        show_stats("combined", combined, combined_records);
+    }
+
+    if (option.summary) {
+        FILE *fp = fopen(option.summary, "wb");
+        if (!fp) {
+            perror(option.summary);
+            exit(1);
+        }
+        if (mstat_write_summary(fp, option.fields, combined, field_count) < 0) {
+            perror(option.summary);
+            fclose(fp);
+            exit(1);
+        }
+        fclose(fp);
+    }
+
+    for (size_t i = 0; i < field_count; i++) {
+        mstat_stats_free(&combined[i]);
+    }
+    free(stats);
+    free(combined);
+    free(option.filenames);
+    return status;
+}
@@ -0,0 +1,93 @@
+#include <errno.h>
+#include <fcntl.h>
+#include "psi.h"
+
+/**
+ * Register a PSI trigger on a pressure file
+ *
+ * Writing "some STALL WINDOW" to the file asks the kernel to signal the
+ * descriptor (POLLPRI) whenever tasks stalled on memory for STALL
+ * microseconds within WINDOW. The check costs nothing until memory is
+ * short, so an idle recording does no extra work.
+ *
+ * @param p pointer to PSI monitor
+ * @param path pressure file (MSTAT_PSI_SYSTEM or a cgroup's memory.pressure)
+ * @param stall stall time that fires the trigger (microseconds)
+ * @param window tracking window (microseconds, 500 ms to 10 s)
+ * @return 0 on success. -1 on error (errno is set, ENOENT/EOPNOTSUPP = no PSI)
+ */
+int mstat_psi_open(struct mstat_psi_t *p, const char *path, unsigned stall, unsigned window) {
+    char request[64] = {0};
+    size_t len;
+
+    memset(p, 0, sizeof(*p));
+    p->fd = -1;
+    p->trigger = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (p->trigger < 0) {
+        return -1;
+    }
+    len = (size_t) snprintf(request, sizeof(request) - 1, "some %u %u", stall, window);
+    // The terminating NUL is part of the request
+    if (write(p->trigger, request, len + 1) < 0) {
+        int error = errno;
+        mstat_psi_close(p);
+        errno = error;
+        return -1;
+    }
+    // The trigger descriptor is only polled. The values are read from another.
+    p->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (p->fd < 0) {
+        int error = errno;
+        mstat_psi_close(p);
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read the current memory pressure
+ *
+ * Format:
+ *   some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+ *   full avg10=0.00 avg60=0.00 avg300=0.00 total=0
+ *
+ * @param p pointer to PSI monitor
+ * @param v pointer to pressure values (modified)
+ * @return 0 on success. -1 on error
+ */
+int mstat_psi_read(struct mstat_psi_t *p, struct mstat_pressure_t *v) {
+    char data[256] = {0};
+    const char *full;
+    ssize_t len;
+
+    len = pread(p->fd, data, sizeof(data) - 1, 0);
+    if (len <= 0) {
+        return -1;
+    }
+    memset(v, 0, sizeof(*v));
+    if (sscanf(data, "some avg10=%lf avg60=%*f avg300=%*f total=%zu", &v->some, &v->some_total) != 2) {
+        return -1;
+    }
+    // Without a "full" line (CPU pressure of older kernels) it stays zero
+    full = strstr(data, "full ");
+    if (full) {
+        sscanf(full, "full avg10=%lf avg60=%*f avg300=%*f total=%zu", &v->full, &v->full_total);
+    }
+    return 0;
+}
+
+/**
+ * Remove the trigger
+ * @param p pointer to PSI monitor
+ */
+void mstat_psi_close(struct mstat_psi_t *p) {
+    if (p->trigger >= 0) {
+        close(p->trigger);
+    }
+    if (p->fd >= 0) {
+        close(p->fd);
+    }
+    p->trigger = -1;
+    p->fd = -1;
+}
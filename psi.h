@@ -0,0 +1,42 @@
+#ifndef MSTAT_PSI_H
+#define MSTAT_PSI_H
+#include "common.h"
+
+// System-wide memory pressure (the cgroup equivalent is DIR/memory.pressure)
+#define MSTAT_PSI_SYSTEM "/proc/pressure/memory"
+// The trigger fires when tasks stall on memory this long (microseconds)...
+#define MSTAT_PSI_STALL 100000
+// ...within this window (microseconds, unprivileged users are held to multiples of 2 s)
+#define MSTAT_PSI_WINDOW 2000000
+
+/*
+ * Pressure stall information. Recorded as the psi_* fields of a record:
+ *
+ *   psi_some        share of time at least one task stalled on memory (percent, 10 s average)
+ *   psi_full        share of time every task stalled on memory (percent, 10 s average)
+ *   psi_some_total  time at least one task stalled on memory (microseconds, since boot)
+ *   psi_full_total  time every task stalled on memory (microseconds, since boot)
+ *
+ * The totals give the exact stall between any two records.
+ */
+struct mstat_pressure_t {
+    double some;
+    double full;
+    size_t some_total;
+    size_t full_total;
+};
+
+struct mstat_psi_t {
+    /** Pressure file with a trigger (becomes readable with EPOLLPRI when it fires) */
+    int trigger;
+    /** Pressure file read by each sample */
+    int fd;
+    /** Times the trigger fired */
+    size_t events;
+};
+
+int mstat_psi_open(struct mstat_psi_t *p, const char *path, unsigned stall, unsigned window);
+int mstat_psi_read(struct mstat_psi_t *p, struct mstat_pressure_t *v);
+void mstat_psi_close(struct mstat_psi_t *p);
+
+#endif //MSTAT_PSI_H
@@ -0,0 +1,449 @@
+#include <errno.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include "system.h"
+
+/**
+ * Compare PIDs (ascending)
+ */
+static int mstat_compare_pid(const void *a, const void *b) {
+    pid_t x = *(const pid_t *) a;
+    pid_t y = *(const pid_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Open the sampler of a process seen for the first time
+ * @param p pointer to process (modified)
+ * @return 0 when the process can be sampled. -1 if not
+ */
+static int mstat_proc_open(struct mstat_proc_t *p) {
+    if (p->state == MSTAT_PROC_SKIP) {
+        return -1;
+    }
+    if (p->state == MSTAT_PROC_NEW) {
+        if (mstat_sampler_open(&p->sampler, p->pid) < 0) {
+            // Out of descriptors: try again next tick
+            if (errno != EMFILE && errno != ENFILE) {
+                p->state = MSTAT_PROC_SKIP;
+            }
+            return -1;
+        }
+        p->state = MSTAT_PROC_OPEN;
+        p->start_time = mstat_get_start_time(p->pid);
+    }
+    return 0;
+}
+
+/**
+ * Sample one process
+ *
+ * The sampler is opened the first time the process is seen. Processes
+ * that cannot be read (kernel threads have no address space, other
+ * users' processes need privileges) are skipped until they leave /proc.
+ *
+ * @param p pointer to process (modified)
+ * @param tick values shared by every record of the tick
+ */
+static void mstat_proc_sample(struct mstat_proc_t *p, const struct mstat_record_t *tick) {
+    struct mstat_record_t probe;
+    int fd;
+
+    p->status = -1;
+    if (mstat_proc_open(p) < 0) {
+        return;
+    }
+
+    p->record = *tick;
+    p->record.pid = p->pid;
+    p->record.source = p->sampler.source;
+    fd = p->sampler.fd;
+    if (mstat_sampler_read(&p->sampler, &p->record) < 0) {
+        mstat_sampler_close(&p->sampler);
+        p->state = MSTAT_PROC_SKIP;
+        return;
+    }
+    if (p->sampler.fd != fd) {
+        // smaps_rollup was reopened: the process called exec(), or the pid was reused
+        p->start_time = mstat_get_start_time(p->pid);
+    }
+    // VM size is not part of smaps_rollup
+    if (!mstat_sampler_probe(&p->sampler, &probe)) {
+        p->record.vm_size = probe.vm_size;
+    }
+    p->record.start_time = p->start_time;
+    p->status = 0;
+}
+
+/**
+ * Sample processes until none are left in the current tick
+ * @param s pointer to system sampler
+ */
+static void mstat_system_work(struct mstat_system_t *s) {
+    size_t i;
+
+    // Sampling costs differ widely between processes, so they are handed
+    // out one at a time rather than in fixed shares
+    while ((i = __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED)) < s->count) {
+        mstat_proc_sample(&s->procs[i], &s->tick);
+    }
+}
+
+/**
+ * Worker thread: sample processes each time a tick starts
+ * @param arg pointer to system sampler
+ * @return NULL
+ */
+static void *mstat_system_main(void *arg) {
+    struct mstat_system_t *s = arg;
+    size_t seen = 0;
+
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        while (!s->stop && s->generation == seen) {
+            pthread_cond_wait(&s->start, &s->lock);
+        }
+        if (s->stop) {
+            break;
+        }
+        seen = s->generation;
+        pthread_mutex_unlock(&s->lock);
+
+        mstat_system_work(s);
+
+        pthread_mutex_lock(&s->lock);
+        if (!--s->running) {
+            pthread_cond_signal(&s->done);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/**
+ * Start sampling every process on the host
+ *
+ * Each process keeps two descriptors open (smaps_rollup and statm), so the
+ * soft limit on open files is raised to the hard limit.
+ *
+ * With `uring` set reads are batched through io_uring when the kernel
+ * allows it, and no worker threads are started. Otherwise (or when
+ * io_uring is unavailable) the workers pread() every process.
+ *
+ * @param s pointer to system sampler
+ * @param workers threads sampling processes, counting the caller of mstat_system_sample (at least 1)
+ * @param uring try io_uring
+ * @return 0 on success. -1 on error (errno is set)
+ */
+int mstat_system_open(struct mstat_system_t *s, size_t workers, int uring) {
+    struct rlimit limit;
+    sigset_t all, orig;
+
+    memset(s, 0, sizeof(*s));
+    s->uring.fd = -1;
+    if (uring && !mstat_uring_open(&s->uring, MSTAT_URING_ENTRIES)) {
+        workers = 1;
+    }
+    if (!getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    // The smaps key table is built once, before workers parse in parallel
+    mstat_smaps_init();
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->start, NULL);
+    pthread_cond_init(&s->done, NULL);
+    if (workers > 1) {
+        s->threads = calloc(workers - 1, sizeof(*s->threads));
+        if (!s->threads) {
+            return -1;
+        }
+    }
+
+    // Signals are handled by the sampler thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &orig);
+    for (size_t i = 0; i + 1 < workers; i++) {
+        int status = pthread_create(&s->threads[i], NULL, mstat_system_main, s);
+        if (status) {
+            pthread_sigmask(SIG_SETMASK, &orig, NULL);
+            mstat_system_close(s);
+            errno = status;
+            return -1;
+        }
+        s->workers++;
+    }
+    pthread_sigmask(SIG_SETMASK, &orig, NULL);
+    return 0;
+}
+
+/**
+ * Replace the processes to sample
+ *
+ * Processes in the previous list keep their open sampler. New processes
+ * are opened by the next mstat_system_sample. Samplers of processes that
+ * are no longer listed are closed.
+ *
+ * @param s pointer to system sampler
+ * @param pids processes to sample (sorted, no duplicates)
+ * @param count number of processes
+ * @return number of processes. -1 on error
+ */
+int mstat_system_set(struct mstat_system_t *s, const pid_t *pids, size_t count) {
+    struct mstat_proc_t *procs;
+    size_t x = 0;
+
+    procs = calloc(count ? count : 1, sizeof(*procs));
+    if (!procs) {
+        return -1;
+    }
+
+    // Both lists are sorted: walk them side by side
+    for (size_t i = 0; i < count; i++) {
+        while (x < s->count && s->procs[x].pid < pids[i]) {
+            if (s->procs[x].state == MSTAT_PROC_OPEN) {
+                mstat_sampler_close(&s->procs[x].sampler);
+            }
+            x++;
+        }
+        if (x < s->count && s->procs[x].pid == pids[i]) {
+            procs[i] = s->procs[x++];
+        } else {
+            procs[i].pid = pids[i];
+            procs[i].state = MSTAT_PROC_NEW;
+        }
+    }
+    for (; x < s->count; x++) {
+        if (s->procs[x].state == MSTAT_PROC_OPEN) {
+            mstat_sampler_close(&s->procs[x].sampler);
+        }
+    }
+
+    free(s->procs);
+    s->procs = procs;
+    s->count = count;
+    return (int) count;
+}
+
+/**
+ * Sample every process in /proc (see mstat_system_set)
+ * @param s pointer to system sampler
+ * @return number of processes. -1 on error
+ */
+int mstat_system_scan(struct mstat_system_t *s) {
+    struct dirent *entry;
+    size_t count = 0;
+    DIR *dir;
+
+    dir = opendir("/proc");
+    if (!dir) {
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        char *end;
+        long pid;
+
+        if ((unsigned) (entry->d_name[0] - '0') >= 10) {
+            continue;
+        }
+        pid = strtol(entry->d_name, &end, 10);
+        if (*end != '\0' || pid <= 0) {
+            continue;
+        }
+        if (count == s->scan_size) {
+            size_t size = s->scan_size ? s->scan_size * 2 : 256;
+            pid_t *tmp = realloc(s->scan, size * sizeof(*s->scan));
+            if (!tmp) {
+                closedir(dir);
+                return -1;
+            }
+            s->scan = tmp;
+            s->scan_size = size;
+        }
+        s->scan[count++] = (pid_t) pid;
+    }
+    closedir(dir);
+    qsort(s->scan, count, sizeof(*s->scan), mstat_compare_pid);
+    return mstat_system_set(s, s->scan, count);
+}
+
+/**
+ * Sample every process found by the last scan with one io_uring batch
+ *
+ * smaps_rollup and statm of every open process are read together. A
+ * process seen for the first time, a truncated read (the buffer is too
+ * small) or a failed one (exec(), exit) is sampled with pread() instead,
+ * which grows the buffer or reopens the file as needed.
+ *
+ * @param s pointer to system sampler
+ */
+static void mstat_system_sample_batch(struct mstat_system_t *s) {
+    struct timespec t0, t1;
+    size_t count = 0;
+
+    if (s->reads_size < s->count * 2) {
+        struct mstat_uring_read_t *reads = realloc(s->reads, s->count * 2 * sizeof(*reads));
+        size_t *batch = realloc(s->batch, s->count * sizeof(*batch));
+        if (reads) {
+            s->reads = reads;
+        }
+        if (batch) {
+            s->batch = batch;
+        }
+        if (!reads || !batch) {
+            // Without room for a batch every process is read with pread()
+            for (size_t i = 0; i < s->count; i++) {
+                mstat_proc_sample(&s->procs[i], &s->tick);
+            }
+            return;
+        }
+        s->reads_size = s->count * 2;
+    }
+
+    for (size_t i = 0; i < s->count; i++) {
+        struct mstat_proc_t *p = &s->procs[i];
+        int is_new = p->state == MSTAT_PROC_NEW;
+
+        p->status = -1;
+        if (mstat_proc_open(p) < 0) {
+            continue;
+        }
+        if (is_new || p->sampler.fd_statm < 0) {
+            // The first sample opens statm
+            mstat_proc_sample(p, &s->tick);
+            continue;
+        }
+        s->reads[count * 2].fd = p->sampler.fd;
+        s->reads[count * 2].buf = p->sampler.data;
+        s->reads[count * 2].size = p->sampler.size;
+        s->reads[count * 2 + 1].fd = p->sampler.fd_statm;
+        s->reads[count * 2 + 1].buf = p->statm;
+        s->reads[count * 2 + 1].size = sizeof(p->statm) - 1;
+        s->batch[count++] = i;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (count && mstat_uring_read(&s->uring, s->reads, count * 2) < 0) {
+        // The ring is unusable. Sample with pread() from now on.
+        mstat_uring_close(&s->uring);
+        for (size_t n = 0; n < count; n++) {
+            mstat_proc_sample(&s->procs[s->batch[n]], &s->tick);
+        }
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    s->batch_time = count ? mstat_difftimespec_ns(t1, t0) : 0;
+
+    for (size_t n = 0; n < count; n++) {
+        struct mstat_proc_t *p = &s->procs[s->batch[n]];
+        ssize_t len = s->reads[n * 2].result;
+        ssize_t statm = s->reads[n * 2 + 1].result;
+        struct timespec p0, p1;
+
+        if (len <= 0 || (size_t) len == p->sampler.size) {
+            mstat_proc_sample(p, &s->tick);
+            continue;
+        }
+        p->record = s->tick;
+        p->record.pid = p->pid;
+        p->record.source = p->sampler.source;
+        clock_gettime(CLOCK_MONOTONIC, &p0);
+        mstat_parse_smaps(&p->record, p->sampler.data, (size_t) len);
+        clock_gettime(CLOCK_MONOTONIC, &p1);
+        p->sampler.read_time = 0;
+        p->sampler.parse_time = mstat_difftimespec_ns(p1, p0);
+        if (statm > 0) {
+            struct mstat_record_t probe;
+            p->statm[statm] = '\0';
+            if (!mstat_sampler_parse_statm(&p->sampler, &probe, p->statm)) {
+                p->record.vm_size = probe.vm_size;
+            }
+        }
+        p->record.start_time = p->start_time;
+        p->status = 0;
+    }
+}
+
+/**
+ * Sample every process found by the last scan
+ *
+ * The caller works alongside the worker threads and returns when every
+ * process is sampled. The record of each process is in procs[i].record
+ * when procs[i].status is 0.
+ *
+ * @param s pointer to system sampler
+ * @param tick values shared by every record (timestamp and rate)
+ */
+void mstat_system_sample(struct mstat_system_t *s, const struct mstat_record_t *tick) {
+    s->tick = *tick;
+    s->next = 0;
+    s->batch_time = 0;
+
+    if (s->uring.fd >= 0) {
+        mstat_system_sample_batch(s);
+    } else {
+        pthread_mutex_lock(&s->lock);
+        s->generation++;
+        s->running = s->workers;
+        pthread_cond_broadcast(&s->start);
+        pthread_mutex_unlock(&s->lock);
+
+        mstat_system_work(s);
+
+        pthread_mutex_lock(&s->lock);
+        while (s->running) {
+            pthread_cond_wait(&s->done, &s->lock);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    s->skipped = 0;
+    for (size_t i = 0; i < s->count; i++) {
+        if (s->procs[i].status < 0) {
+            s->skipped++;
+        }
+    }
+}
+
+/**
+ * Stop the workers and release every sampler
+ * @param s pointer to system sampler
+ */
+void mstat_system_close(struct mstat_system_t *s) {
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->start);
+    pthread_mutex_unlock(&s->lock);
+    for (size_t i = 0; i < s->workers; i++) {
+        pthread_join(s->threads[i], NULL);
+    }
+    free(s->threads);
+    s->threads = NULL;
+    s->workers = 0;
+
+    for (size_t i = 0; i < s->count; i++) {
+        if (s->procs[i].state == MSTAT_PROC_OPEN) {
+            mstat_sampler_close(&s->procs[i].sampler);
+        }
+    }
+    if (s->uring.fd >= 0) {
+        mstat_uring_close(&s->uring);
+    }
+    free(s->procs);
+    free(s->scan);
+    free(s->reads);
+    free(s->batch);
+    s->procs = NULL;
+    s->scan = NULL;
+    s->reads = NULL;
+    s->batch = NULL;
+    s->reads_size = 0;
+    s->count = 0;
+    s->scan_size = 0;
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->start);
+    pthread_cond_destroy(&s->done);
+}
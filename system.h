@@ -0,0 +1,92 @@
+#ifndef MSTAT_SYSTEM_H
+#define MSTAT_SYSTEM_H
+#include <pthread.h>
+#include "common.h"
+#include "uring.h"
+
+enum {
+    /** Found by the last /proc scan, not opened yet */
+    MSTAT_PROC_NEW = 0,
+    /** Sampler open */
+    MSTAT_PROC_OPEN,
+    /** Cannot be sampled (kernel thread, no permission). Skipped until it leaves /proc */
+    MSTAT_PROC_SKIP,
+};
+
+struct mstat_proc_t {
+    /** PID of the process */
+    pid_t pid;
+    /** Start time of the process (clock ticks since boot) */
+    size_t start_time;
+    /** MSTAT_PROC_* */
+    int state;
+    /** Result of the last sample (0 = record is valid) */
+    int status;
+    /** smaps_rollup and statm of the process */
+    struct mstat_sampler_t sampler;
+    /** Last sample */
+    struct mstat_record_t record;
+    /** statm read buffer (io_uring batches) */
+    char statm[256];
+};
+
+/*
+ * Samples every process on the host. The main thread lists /proc on
+ * each tick (or is handed the processes to sample, see
+ * mstat_system_set), then it and the workers take processes from a shared
+ * cursor until all of them are sampled. Samplers stay open between
+ * ticks like they do for a single process.
+ *
+ * Where io_uring is available the reads of a tick are submitted as one
+ * batch instead, and the kernel performs them in parallel.
+ */
+struct mstat_system_t {
+    /** Processes found by the last scan (sorted by pid) */
+    struct mstat_proc_t *procs;
+    /** Number of processes */
+    size_t count;
+    /** PIDs listed by the scan in progress */
+    pid_t *scan;
+    /** Capacity of scan */
+    size_t scan_size;
+    /** Threads sampling processes (the main thread makes one more) */
+    pthread_t *threads;
+    /** Number of threads */
+    size_t workers;
+    /** Guards generation, running and stop */
+    pthread_mutex_t lock;
+    /** Signals a new tick to the workers */
+    pthread_cond_t start;
+    /** Signals the end of a tick to the main thread */
+    pthread_cond_t done;
+    /** Ticks started */
+    size_t generation;
+    /** Workers busy with the current tick */
+    size_t running;
+    /** Next process to sample (taken atomically) */
+    size_t next;
+    /** Request the workers to exit */
+    int stop;
+    /** Values shared by every record of the tick (timestamp and rate) */
+    struct mstat_record_t tick;
+    /** Processes that could not be sampled by the last tick */
+    size_t skipped;
+    /** Batched reads (uring.fd < 0 = sample with pread) */
+    struct mstat_uring_t uring;
+    /** Reads of the current batch */
+    struct mstat_uring_read_t *reads;
+    /** Capacity of reads */
+    size_t reads_size;
+    /** Processes in the current batch (indexes into procs) */
+    size_t *batch;
+    /** Nanoseconds the last batch took to complete (0 = no batch) */
+    unsigned long long batch_time;
+};
+
+int mstat_system_open(struct mstat_system_t *s, size_t workers, int uring);
+int mstat_system_set(struct mstat_system_t *s, const pid_t *pids, size_t count);
+int mstat_system_scan(struct mstat_system_t *s);
+void mstat_system_sample(struct mstat_system_t *s, const struct mstat_record_t *tick);
+void mstat_system_close(struct mstat_system_t *s);
+
+#endif //MSTAT_SYSTEM_H
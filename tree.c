@@ -0,0 +1,429 @@
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include "tree.h"
+
+const char *mstat_tree_methods[] = {
+        "netlink proc connector",
+        "children files",
+        "/proc scan",
+};
+
+/**
+ * Compare PIDs (ascending)
+ */
+static int mstat_tree_compare(const void *a, const void *b) {
+    pid_t x = *(const pid_t *) a;
+    pid_t y = *(const pid_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Determine whether a process belongs to the tree
+ * @param t pointer to tree
+ * @param pid process
+ * @return 1 if it does. 0 if not
+ */
+static int mstat_tree_contains(const struct mstat_tree_t *t, pid_t pid) {
+    return t->count && bsearch(&pid, t->pids, t->count, sizeof(*t->pids), mstat_tree_compare) != NULL;
+}
+
+/**
+ * Add a process to the tree (kept sorted)
+ * @param t pointer to tree
+ * @param pid process
+ * @return 1 if the process joined. 0 if it was in the tree. -1 on error
+ */
+static int mstat_tree_add(struct mstat_tree_t *t, pid_t pid) {
+    size_t at = t->count;
+
+    if (mstat_tree_contains(t, pid)) {
+        return 0;
+    }
+    if (t->count == t->size) {
+        size_t size = t->size ? t->size * 2 : 64;
+        pid_t *tmp = realloc(t->pids, size * sizeof(*t->pids));
+        if (!tmp) {
+            return -1;
+        }
+        t->pids = tmp;
+        t->size = size;
+    }
+    while (at > 0 && t->pids[at - 1] > pid) {
+        at--;
+    }
+    memmove(&t->pids[at + 1], &t->pids[at], (t->count - at) * sizeof(*t->pids));
+    t->pids[at] = pid;
+    t->count++;
+    return 1;
+}
+
+/**
+ * Remove a process from the tree
+ * @param t pointer to tree
+ * @param pid process
+ */
+static void mstat_tree_remove(struct mstat_tree_t *t, pid_t pid) {
+    pid_t *found;
+    size_t at;
+
+    if (!t->count) {
+        return;
+    }
+    found = bsearch(&pid, t->pids, t->count, sizeof(*t->pids), mstat_tree_compare);
+    if (!found) {
+        return;
+    }
+    at = (size_t) (found - t->pids);
+    memmove(&t->pids[at], &t->pids[at + 1], (t->count - at - 1) * sizeof(*t->pids));
+    t->count--;
+}
+
+/**
+ * Add the children of every thread of a process to the tree
+ * @param t pointer to tree
+ * @param pid process
+ * @param queue pointer to processes left to visit (processes that join are appended)
+ * @param queued pointer to number of processes in queue (modified)
+ * @param size pointer to capacity of queue (modified)
+ * @return 0 on success. -1 on error
+ */
+static int mstat_tree_add_children(struct mstat_tree_t *t, pid_t pid, pid_t **queue, size_t *queued, size_t *size) {
+    char path[PATH_MAX] = {0};
+    struct dirent *entry;
+    DIR *dir;
+    int status = 0;
+
+    snprintf(path, sizeof(path) - 1, "/proc/%d/task", pid);
+    dir = opendir(path);
+    if (!dir) {
+        // The process exited
+        return 0;
+    }
+    while ((entry = readdir(dir)) != NULL && !status) {
+        FILE *fp;
+        int child;
+
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(path, sizeof(path) - 1, "/proc/%d/task/%s/children", pid, entry->d_name);
+        fp = fopen(path, "r");
+        if (!fp) {
+            continue;
+        }
+        while (fscanf(fp, "%d", &child) == 1) {
+            int added = mstat_tree_add(t, (pid_t) child);
+            if (added < 0) {
+                status = -1;
+                break;
+            }
+            if (added && *queued == *size) {
+                pid_t *tmp = realloc(*queue, *size * 2 * sizeof(**queue));
+                if (!tmp) {
+                    status = -1;
+                    break;
+                }
+                *queue = tmp;
+                *size *= 2;
+            }
+            if (added) {
+                (*queue)[(*queued)++] = (pid_t) child;
+            }
+        }
+        fclose(fp);
+    }
+    closedir(dir);
+    return status;
+}
+
+/**
+ * Rebuild the tree from the children files (breadth first)
+ * @param t pointer to tree
+ * @return 0 on success. -1 on error
+ */
+static int mstat_tree_walk_children(struct mstat_tree_t *t) {
+    size_t size = 64;
+    size_t queued = 0;
+    int status = 0;
+    pid_t *queue;
+
+    t->count = 0;
+    if (mstat_tree_add(t, t->root) < 0) {
+        return -1;
+    }
+    // Every process joins the tree, and the queue, once
+    queue = malloc(size * sizeof(*queue));
+    if (!queue) {
+        return -1;
+    }
+    queue[queued++] = t->root;
+    for (size_t i = 0; i < queued && !status; i++) {
+        status = mstat_tree_add_children(t, queue[i], &queue, &queued, &size);
+    }
+    free(queue);
+    return status;
+}
+
+/**
+ * Return the parent of a process
+ * @param pid process
+ * @return parent pid. -1 on error
+ */
+static pid_t mstat_tree_parent(pid_t pid) {
+    char path[PATH_MAX] = {0};
+    char data[512] = {0};
+    const char *pos;
+    int ppid = -1;
+    ssize_t len;
+    int fd;
+
+    snprintf(path, sizeof(path) - 1, "/proc/%d/stat", pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    len = read(fd, data, sizeof(data) - 1);
+    close(fd);
+    if (len <= 0) {
+        return -1;
+    }
+    // Format: pid (comm) state ppid ...
+    pos = strrchr(data, ')');
+    if (!pos || sscanf(pos + 1, " %*c %d", &ppid) != 1) {
+        return -1;
+    }
+    return (pid_t) ppid;
+}
+
+/**
+ * Rebuild the tree from the parent of every process in /proc
+ * @param t pointer to tree
+ * @return 0 on success. -1 on error
+ */
+static int mstat_tree_walk_proc(struct mstat_tree_t *t) {
+    pid_t *pairs = NULL;
+    size_t count = 0;
+    size_t size = 0;
+    size_t added;
+    struct dirent *entry;
+    DIR *dir;
+
+    dir = opendir("/proc");
+    if (!dir) {
+        return -1;
+    }
+    // (pid, parent) of every process
+    while ((entry = readdir(dir)) != NULL) {
+        char *end;
+        long pid;
+        pid_t ppid;
+
+        if ((unsigned) (entry->d_name[0] - '0') >= 10) {
+            continue;
+        }
+        pid = strtol(entry->d_name, &end, 10);
+        if (*end != '\0' || pid <= 0 || (ppid = mstat_tree_parent((pid_t) pid)) <= 0) {
+            continue;
+        }
+        if (count + 2 > size) {
+            pid_t *tmp;
+            size = size ? size * 2 : 512;
+            tmp = realloc(pairs, size * sizeof(*pairs));
+            if (!tmp) {
+                free(pairs);
+                closedir(dir);
+                return -1;
+            }
+            pairs = tmp;
+        }
+        pairs[count++] = (pid_t) pid;
+        pairs[count++] = ppid;
+    }
+    closedir(dir);
+
+    t->count = 0;
+    if (mstat_tree_add(t, t->root) < 0) {
+        free(pairs);
+        return -1;
+    }
+    // One generation joins per pass
+    do {
+        added = 0;
+        for (size_t i = 0; i < count; i += 2) {
+            if (mstat_tree_contains(t, pairs[i + 1]) && !mstat_tree_contains(t, pairs[i])) {
+                if (mstat_tree_add(t, pairs[i]) < 0) {
+                    free(pairs);
+                    return -1;
+                }
+                added++;
+            }
+        }
+    } while (added);
+    free(pairs);
+    return 0;
+}
+
+/**
+ * Rebuild the tree from /proc
+ * @param t pointer to tree
+ * @return 0 on success. -1 on error
+ */
+static int mstat_tree_walk(struct mstat_tree_t *t) {
+    return t->walk == MSTAT_TREE_CHILDREN ? mstat_tree_walk_children(t) : mstat_tree_walk_proc(t);
+}
+
+/**
+ * Subscribe to the fork and exit events of the proc connector
+ * @return socket. -1 on error (no permission, no connector)
+ */
+static int mstat_tree_listen() {
+    struct sockaddr_nl addr;
+    struct {
+        struct nlmsghdr hdr;
+        struct cn_msg msg;
+        enum proc_cn_mcast_op op;
+    } __attribute__((packed)) request;
+    int nl;
+
+    nl = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (nl < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = CN_IDX_PROC;
+    if (bind(nl, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(nl);
+        return -1;
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.hdr.nlmsg_len = sizeof(request);
+    request.hdr.nlmsg_type = NLMSG_DONE;
+    request.hdr.nlmsg_pid = (unsigned) getpid();
+    request.msg.id.idx = CN_IDX_PROC;
+    request.msg.id.val = CN_VAL_PROC;
+    request.msg.len = sizeof(request.op);
+    request.op = PROC_CN_MCAST_LISTEN;
+    if (send(nl, &request, sizeof(request), 0) < 0) {
+        close(nl);
+        return -1;
+    }
+    return nl;
+}
+
+/**
+ * Track a process and its descendants
+ *
+ * The proc connector is used when `netlink` is set and permitted.
+ * Otherwise the tree is walked through the children files, or the
+ * parent of every process where the kernel has no children files.
+ *
+ * @param t pointer to tree
+ * @param root process at the top of the tree
+ * @param netlink try the proc connector
+ * @return 0 on success. -1 on error
+ */
+int mstat_tree_open(struct mstat_tree_t *t, pid_t root, int netlink) {
+    memset(t, 0, sizeof(*t));
+    t->root = root;
+    t->nl = -1;
+    // Kernels without CONFIG_PROC_CHILDREN have no children files
+    t->walk = access("/proc/thread-self/children", R_OK) == 0 ? MSTAT_TREE_CHILDREN : MSTAT_TREE_PROC;
+    t->method = t->walk;
+    if (netlink) {
+        // Subscribe before the first walk, so no fork falls in between
+        t->nl = mstat_tree_listen();
+    }
+    if (mstat_tree_walk(t) < 0) {
+        mstat_tree_close(t);
+        return -1;
+    }
+    if (t->nl >= 0) {
+        t->method = MSTAT_TREE_NETLINK;
+    }
+    return 0;
+}
+
+/**
+ * Bring the tree up to date
+ *
+ * With the proc connector the pending events are applied. If the socket
+ * overflowed (events were lost) the tree is walked again.
+ *
+ * @param t pointer to tree
+ * @return number of processes in the tree. -1 on error
+ */
+int mstat_tree_update(struct mstat_tree_t *t) {
+    char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+
+    if (t->nl < 0) {
+        return mstat_tree_walk(t) < 0 ? -1 : (int) t->count;
+    }
+
+    while (1) {
+        struct sockaddr_nl from;
+        socklen_t from_len = sizeof(from);
+        int len;
+
+        len = (int) recvfrom(t->nl, buf, sizeof(buf), 0, (struct sockaddr *) &from, &from_len);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == ENOBUFS) {
+                t->resyncs++;
+                if (mstat_tree_walk(t) < 0) {
+                    return -1;
+                }
+                continue;
+            }
+            return -1;
+        }
+        // Only the kernel sends events
+        if (from.nl_pid != 0) {
+            continue;
+        }
+        for (struct nlmsghdr *hdr = (struct nlmsghdr *) buf; NLMSG_OK(hdr, len);
+             hdr = NLMSG_NEXT(hdr, len)) {
+            const struct cn_msg *msg = NLMSG_DATA(hdr);
+            const struct proc_event *event = (const struct proc_event *) msg->data;
+
+            if (msg->id.idx != CN_IDX_PROC || msg->id.val != CN_VAL_PROC) {
+                continue;
+            }
+            // New threads are reported as forks too (child_pid != child_tgid)
+            if (event->what == PROC_EVENT_FORK
+                && event->event_data.fork.child_pid == event->event_data.fork.child_tgid
+                && mstat_tree_contains(t, event->event_data.fork.parent_tgid)) {
+                if (mstat_tree_add(t, event->event_data.fork.child_tgid) < 0) {
+                    return -1;
+                }
+            } else if (event->what == PROC_EVENT_EXIT
+                       && event->event_data.exit.process_pid == event->event_data.exit.process_tgid) {
+                mstat_tree_remove(t, event->event_data.exit.process_tgid);
+            }
+        }
+    }
+    return (int) t->count;
+}
+
+/**
+ * Stop tracking a tree
+ * @param t pointer to tree
+ */
+void mstat_tree_close(struct mstat_tree_t *t) {
+    if (t->nl >= 0) {
+        close(t->nl);
+    }
+    free(t->pids);
+    t->pids = NULL;
+    t->count = 0;
+    t->size = 0;
+    t->nl = -1;
+}
@@ -0,0 +1,45 @@
+#ifndef MSTAT_TREE_H
+#define MSTAT_TREE_H
+#include "common.h"
+
+// How descendants are discovered
+enum {
+    /** Fork and exit events of the netlink proc connector (needs CAP_NET_ADMIN) */
+    MSTAT_TREE_NETLINK = 0,
+    /** /proc/PID/task/TID/children (CONFIG_PROC_CHILDREN) */
+    MSTAT_TREE_CHILDREN,
+    /** Parent pid of every process in /proc */
+    MSTAT_TREE_PROC,
+};
+
+/*
+ * A process and its descendants. With the proc connector every fork and
+ * exit is seen as it happens, so processes that are orphaned (their
+ * parent exited) stay in the tree. The /proc walks only find processes
+ * still connected to the root.
+ */
+struct mstat_tree_t {
+    /** Root of the tree */
+    pid_t root;
+    /** MSTAT_TREE_* */
+    int method;
+    /** How the tree is walked when there are no events (MSTAT_TREE_CHILDREN or MSTAT_TREE_PROC) */
+    int walk;
+    /** Proc connector socket (-1 = walk /proc on every update) */
+    int nl;
+    /** Processes in the tree (sorted) */
+    pid_t *pids;
+    /** Number of processes */
+    size_t count;
+    /** Capacity of pids */
+    size_t size;
+    /** Times connector events were lost and the tree was walked again */
+    size_t resyncs;
+};
+
+extern const char *mstat_tree_methods[];
+int mstat_tree_open(struct mstat_tree_t *t, pid_t root, int netlink);
+int mstat_tree_update(struct mstat_tree_t *t);
+void mstat_tree_close(struct mstat_tree_t *t);
+
+#endif //MSTAT_TREE_H
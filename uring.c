@@ -0,0 +1,210 @@
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+/**
+ * io_uring_setup(2)
+ */
+static int mstat_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+/**
+ * io_uring_enter(2)
+ */
+static int mstat_uring_enter(int fd, unsigned submit, unsigned complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+/**
+ * io_uring_register(2)
+ */
+static int mstat_uring_register(int fd, unsigned opcode, void *arg, unsigned count) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+/**
+ * Check that a ring supports IORING_OP_READ
+ *
+ * The opcode and IORING_REGISTER_PROBE both appeared in Linux 5.6, so a
+ * kernel that cannot be probed cannot read either.
+ *
+ * @param fd io_uring descriptor
+ * @return 1 if supported. 0 if not
+ */
+static int mstat_uring_probe_read(int fd) {
+    struct io_uring_probe *probe;
+    int supported = 0;
+
+    probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+    if (!probe) {
+        return 0;
+    }
+    if (mstat_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0
+        && probe->last_op >= IORING_OP_READ) {
+        supported = (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+    free(probe);
+    return supported;
+}
+
+/**
+ * Set up an io_uring instance
+ *
+ * Fails on kernels without io_uring (before 5.1), without IORING_OP_READ
+ * (before 5.6) and where it is disabled (kernel.io_uring_disabled,
+ * seccomp filters of containers). Callers fall back to pread().
+ *
+ * @param u pointer to ring
+ * @param entries size of the submission queue
+ * @return 0 on success. -1 on error (errno is set)
+ */
+int mstat_uring_open(struct mstat_uring_t *u, unsigned entries) {
+    struct io_uring_params params;
+    char *sq, *cq;
+
+    memset(u, 0, sizeof(*u));
+    memset(&params, 0, sizeof(params));
+    u->fd = mstat_uring_setup(entries, &params);
+    if (u->fd < 0) {
+        u->fd = -1;
+        return -1;
+    }
+    if (!mstat_uring_probe_read(u->fd)) {
+        mstat_uring_close(u);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    u->entries = params.sq_entries;
+
+    u->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        // One mapping holds both rings
+        if (u->cq_ring_size > u->sq_ring_size) {
+            u->sq_ring_size = u->cq_ring_size;
+        }
+        u->cq_ring_size = u->sq_ring_size;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        mstat_uring_close(u);
+        return -1;
+    }
+    u->cq_ring = u->sq_ring;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) {
+            u->cq_ring = NULL;
+            mstat_uring_close(u);
+            return -1;
+        }
+    }
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        mstat_uring_close(u);
+        return -1;
+    }
+
+    sq = u->sq_ring;
+    u->sq_head = (unsigned *) (sq + params.sq_off.head);
+    u->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    u->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    u->sq_array = (unsigned *) (sq + params.sq_off.array);
+    cq = u->cq_ring;
+    u->cq_head = (unsigned *) (cq + params.cq_off.head);
+    u->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    u->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * Read many descriptors from offset zero
+ *
+ * Reads are queued as IORING_OP_READ and submitted together. Procfs
+ * files cannot be read without blocking, so the kernel runs them on its
+ * own worker threads: one system call replaces a pread() per file and
+ * the reads overlap.
+ *
+ * @param u pointer to ring
+ * @param reads reads to perform (result is set for each)
+ * @param count number of reads
+ * @return 0 on success (a read may still have failed, see result). -1 on error
+ */
+int mstat_uring_read(struct mstat_uring_t *u, struct mstat_uring_read_t *reads, size_t count) {
+    size_t queued = 0;
+    size_t completed = 0;
+
+    while (completed < count) {
+        unsigned tail = *u->sq_tail;
+        unsigned head;
+
+        // The completion queue holds twice the submission queue, so
+        // keeping at most `entries` reads in flight never overflows it
+        while (queued < count && queued - completed < u->entries) {
+            struct io_uring_sqe *sqe = &u->sqes[tail & *u->sq_mask];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = reads[queued].fd;
+            sqe->addr = (unsigned long long) (uintptr_t) reads[queued].buf;
+            sqe->len = (unsigned) reads[queued].size;
+            sqe->off = 0;
+            sqe->user_data = queued;
+            u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+            tail++;
+            queued++;
+        }
+        __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+
+        // Submit the entries the kernel has not consumed yet (a signal may
+        // interrupt a submission) and wait for everything in flight: waking
+        // up per completion would cost a system call per read again
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (mstat_uring_enter(u->fd, tail - head, (unsigned) (queued - completed),
+                              IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            return -1;
+        }
+
+        head = *u->cq_head;
+        while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            if (cqe->user_data < count) {
+                reads[cqe->user_data].result = cqe->res;
+            }
+            head++;
+            completed++;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/**
+ * Release an io_uring instance
+ * @param u pointer to ring
+ */
+void mstat_uring_close(struct mstat_uring_t *u) {
+    if (u->sqes) {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->cq_ring && u->cq_ring != u->sq_ring) {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    if (u->sq_ring) {
+        munmap(u->sq_ring, u->sq_ring_size);
+    }
+    if (u->fd >= 0) {
+        close(u->fd);
+    }
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
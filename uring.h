@@ -0,0 +1,63 @@
+#ifndef MSTAT_URING_H
+#define MSTAT_URING_H
+#include <linux/io_uring.h>
+#include "common.h"
+
+// Submission queue entries (completion queue is twice as large)
+#define MSTAT_URING_ENTRIES 256
+
+/*
+ * Minimal io_uring used to issue many pread()s with one system call.
+ * The rings are set up with raw system calls, so no library is needed.
+ */
+struct mstat_uring_t {
+    /** io_uring descriptor (-1 = unavailable) */
+    int fd;
+    /** Size of the submission queue */
+    unsigned entries;
+    /** Submission ring mapping */
+    void *sq_ring;
+    /** Size of sq_ring */
+    size_t sq_ring_size;
+    /** Completion ring mapping (same as sq_ring with IORING_FEAT_SINGLE_MMAP) */
+    void *cq_ring;
+    /** Size of cq_ring */
+    size_t cq_ring_size;
+    /** Submission queue entries */
+    struct io_uring_sqe *sqes;
+    /** Size of sqes */
+    size_t sqes_size;
+    /** Submission ring: consumer index (kernel) */
+    unsigned *sq_head;
+    /** Submission ring: producer index */
+    unsigned *sq_tail;
+    /** Submission ring: index mask */
+    unsigned *sq_mask;
+    /** Submission ring: slot to entry map */
+    unsigned *sq_array;
+    /** Completion ring: consumer index */
+    unsigned *cq_head;
+    /** Completion ring: producer index (kernel) */
+    unsigned *cq_tail;
+    /** Completion ring: index mask */
+    unsigned *cq_mask;
+    /** Completion queue entries */
+    struct io_uring_cqe *cqes;
+};
+
+struct mstat_uring_read_t {
+    /** Descriptor to read from offset zero */
+    int fd;
+    /** Destination */
+    char *buf;
+    /** Size of buf */
+    size_t size;
+    /** Bytes read. -errno on error */
+    ssize_t result;
+};
+
+int mstat_uring_open(struct mstat_uring_t *u, unsigned entries);
+int mstat_uring_read(struct mstat_uring_t *u, struct mstat_uring_read_t *reads, size_t count);
+void mstat_uring_close(struct mstat_uring_t *u);
+
+#endif //MSTAT_URING_H
@@ -0,0 +1,360 @@
+#include <errno.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include "writer.h"
+#include "codec.h"
+
+// Records serialized per fwrite()
+#define MSTAT_WRITER_BATCH 512
+// Largest ring (in bytes). Records beyond it are dropped and counted.
+#define MSTAT_WRITER_RING_MAX (64UL << 20)
+
+/**
+ * Record a failed write. Only the first error is kept.
+ *
+ * The sampler thread reads the error while the writer runs, so it is
+ * stored atomically (see mstat_writer_error).
+ *
+ * @param w pointer to writer
+ * @param error errno of the failure (0 = EIO)
+ */
+static void mstat_writer_fail(struct mstat_writer_t *w, int error) {
+    if (!__atomic_load_n(&w->error, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&w->error, error ? error : EIO, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Wake the writer thread
+ * @param w pointer to writer
+ * @return 0 on success. -1 on error
+ */
+static int mstat_writer_wake(struct mstat_writer_t *w) {
+    unsigned long long one = 1;
+
+    if (write(w->wake, &one, sizeof(one)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Wait until the sampler queues a record, or asks for a flush or stop
+ *
+ * The writer announces it is idle, then looks at the ring once more. A
+ * record pushed in between is either seen here or finds the idle flag set
+ * and signals the eventfd, so no record waits for the next one.
+ *
+ * @param w pointer to writer
+ */
+static void mstat_writer_wait(struct mstat_writer_t *w) {
+    unsigned long long count;
+
+    __atomic_store_n(&w->idle, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&w->head, __ATOMIC_ACQUIRE) != w->tail
+        || __atomic_load_n(&w->flush, __ATOMIC_ACQUIRE) || __atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&w->idle, 0, __ATOMIC_RELAXED);
+        return;
+    }
+    while (read(w->wake, &count, sizeof(count)) < 0 && errno == EINTR);
+    __atomic_store_n(&w->idle, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Write a batch of packed records
+ * @param w pointer to writer
+ * @param buf packed records
+ * @param count number of records
+ * @param scratch compression buffer (compressed output only)
+ * @return 0 on success. -1 on error
+ */
+static int mstat_writer_emit(struct mstat_writer_t *w, const char *buf, size_t count, char *scratch) {
+    struct timespec t0, t1;
+
+    if (!count) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (w->flags & MSTAT_FLAG_COMPRESSED) {
+        long offset = ftell(w->fp);
+        if (offset < 0) {
+            return -1;
+        }
+        if (w->index_count == w->index_size) {
+            size_t *tmp = realloc(w->index, (w->index_size ? w->index_size * 2 : 64) * 2 * sizeof(*w->index));
+            if (!tmp) {
+                return -1;
+            }
+            w->index = tmp;
+            w->index_size = w->index_size ? w->index_size * 2 : 64;
+        }
+        w->index[w->index_count * 2] = (size_t) offset;
+        w->index[w->index_count * 2 + 1] = w->written;
+        w->index_count++;
+        if (mstat_write_block(w->fp, buf, count, w->fields, w->types, scratch) < 0) {
+            return -1;
+        }
+    } else if (!fwrite(buf, count * w->record_size, 1, w->fp)) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    mstat_hist_add(&w->write_time, mstat_difftimespec_ns(t1, t0));
+    w->written += count;
+    return 0;
+}
+
+/**
+ * Move every record currently in the ring to the pending batch, writing
+ * each batch as it fills
+ * @param w pointer to writer
+ * @param buf pending batch of packed records
+ * @param pending pointer to number of records in buf (modified)
+ * @param batch capacity of buf (in records)
+ * @param scratch compression buffer (compressed output only)
+ * @return number of records drained
+ */
+static size_t mstat_writer_drain(struct mstat_writer_t *w, char *buf, size_t *pending, size_t batch, char *scratch) {
+    size_t head, tail, total;
+
+    total = 0;
+    head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+    tail = w->tail;
+    while (tail != head) {
+        while (tail != head && *pending < batch) {
+            memcpy(buf + *pending * w->record_size, w->ring + (tail & (w->capacity - 1)) * w->record_size,
+                   w->record_size);
+            tail++;
+            total++;
+            (*pending)++;
+        }
+        // Hand the slots back before the (possibly slow) write
+        __atomic_store_n(&w->tail, tail, __ATOMIC_RELEASE);
+
+        if (*pending == batch) {
+            if (!__atomic_load_n(&w->error, __ATOMIC_RELAXED)
+                && mstat_writer_emit(w, buf, *pending, scratch) < 0) {
+                mstat_writer_fail(w, errno);
+            }
+            *pending = 0;
+        }
+        head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+    }
+    return total;
+}
+
+/**
+ * Writer thread. Drains the ring in batches until asked to stop.
+ *
+ * Uncompressed batches are written as soon as the ring runs dry.
+ * Compressed output holds records until a full block is collected, a
+ * flush is requested or the writer stops. Whatever was written is
+ * handed to the kernel before the writer goes idle, so readers following
+ * the file (mstat_export --follow) see it promptly. An idle writer
+ * blocks on an eventfd until a record, a flush or stop request arrives.
+ *
+ * @param arg pointer to writer
+ * @return NULL
+ */
+static void *mstat_writer_main(void *arg) {
+    struct mstat_writer_t *w = arg;
+    int compress = (w->flags & MSTAT_FLAG_COMPRESSED) != 0;
+    size_t batch = compress ? MSTAT_CODEC_BLOCK : MSTAT_WRITER_BATCH;
+    size_t pending = 0;
+    int dirty = 0;
+    char *scratch = NULL;
+    char *buf;
+
+    buf = malloc(batch * w->record_size);
+    if (compress) {
+        scratch = malloc(mstat_codec_bound(MSTAT_CODEC_BLOCK, w->fields));
+    }
+    if (!buf || (compress && !scratch)) {
+        mstat_writer_fail(w, ENOMEM);
+        free(buf);
+        return NULL;
+    }
+
+    while (1) {
+        int stop = __atomic_load_n(&w->stop, __ATOMIC_ACQUIRE);
+        int flush = __atomic_exchange_n(&w->flush, 0, __ATOMIC_ACQ_REL);
+        size_t count = mstat_writer_drain(w, buf, &pending, batch, scratch);
+
+        if (pending && (!compress || flush || stop)) {
+            if (!__atomic_load_n(&w->error, __ATOMIC_RELAXED)
+                && mstat_writer_emit(w, buf, pending, scratch) < 0) {
+                mstat_writer_fail(w, errno);
+            }
+            pending = 0;
+            dirty = 1;
+        }
+        if (flush) {
+            mstat_set_record_count(w->fp, w->written, w->flags);
+        }
+        if (stop) {
+            break;
+        }
+        if (!count) {
+            if (dirty) {
+                fflush(w->fp);
+                dirty = 0;
+            }
+            mstat_writer_wait(w);
+        }
+    }
+
+    if (compress && !__atomic_load_n(&w->error, __ATOMIC_RELAXED)
+        && mstat_write_index(w->fp, w->index, w->index_count) < 0) {
+        mstat_writer_fail(w, errno);
+    }
+    if (mstat_set_record_count(w->fp, w->written, w->flags | MSTAT_FLAG_CLOSED) < 0) {
+        mstat_writer_fail(w, errno);
+    }
+    free(scratch);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Start a writer thread
+ *
+ * The sampler hands records over through a single-producer/single-consumer
+ * ring, so a stalled disk never delays the next sample. The writer collects
+ * records into large batches before writing them, and keeps the record
+ * count in the header current on flush and close.
+ *
+ * @param w pointer to writer
+ * @param fp pointer to MSTAT file stream (positioned after the header)
+ * @param capacity number of records the ring should hold (rounded up to a
+ *        power of two, at most MSTAT_WRITER_RING_MAX bytes)
+ * @param fields fields per record (MSTAT_FIELD_MAX, or the schema written to the header)
+ * @param types storage type of each field (as written to the header)
+ * @param flags MSTAT_FLAG_COMPRESSED to write compressed blocks
+ * @return 0 on success. -1 on error
+ */
+int mstat_writer_open(struct mstat_writer_t *w, FILE *fp, size_t capacity, int fields, const char *types,
+                      unsigned long long flags) {
+    sigset_t all, orig;
+    int status;
+
+    memset(w, 0, sizeof(*w));
+    w->fp = fp;
+    w->flags = flags;
+    w->fields = fields;
+    w->types = types;
+    w->record_size = (size_t) fields * sizeof(size_t);
+    w->capacity = 1;
+    while (w->capacity < capacity && w->capacity * 2 * w->record_size <= MSTAT_WRITER_RING_MAX) {
+        w->capacity <<= 1;
+    }
+
+    w->wake = eventfd(0, EFD_CLOEXEC);
+    if (w->wake < 0) {
+        return -1;
+    }
+    w->ring = calloc(w->capacity, w->record_size);
+    if (!w->ring) {
+        close(w->wake);
+        return -1;
+    }
+    if (mstat_hist_init(&w->write_time) < 0) {
+        close(w->wake);
+        free(w->ring);
+        w->ring = NULL;
+        return -1;
+    }
+
+    // Readers must know how records are stored before the first one lands
+    if (mstat_set_record_count(fp, 0, flags) < 0) {
+        close(w->wake);
+        mstat_hist_free(&w->write_time);
+        free(w->ring);
+        w->ring = NULL;
+        return -1;
+    }
+
+    // Signals are handled by the sampler thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &orig);
+    status = pthread_create(&w->thread, NULL, mstat_writer_main, w);
+    pthread_sigmask(SIG_SETMASK, &orig, NULL);
+    if (status) {
+        close(w->wake);
+        mstat_hist_free(&w->write_time);
+        free(w->ring);
+        w->ring = NULL;
+        errno = status;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Queue a record for writing. Never blocks.
+ *
+ * The writer is only signalled when it went idle on an empty ring, so a
+ * steady stream of records costs no system calls.
+ *
+ * @param w pointer to writer
+ * @param record record in its on-disk layout (see mstat_pack)
+ * @return 0 on success. -1 if the ring is full and the record was dropped
+ */
+int mstat_writer_push(struct mstat_writer_t *w, const char *record) {
+    size_t head = w->head;
+
+    if (head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) >= w->capacity) {
+        w->dropped++;
+        return -1;
+    }
+    memcpy(w->ring + (head & (w->capacity - 1)) * w->record_size, record, w->record_size);
+    __atomic_store_n(&w->head, head + 1, __ATOMIC_RELEASE);
+    // Pairs with the fence in mstat_writer_wait
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&w->idle, __ATOMIC_RELAXED) && __atomic_exchange_n(&w->idle, 0, __ATOMIC_RELAXED)) {
+        mstat_writer_wake(w);
+    }
+    return 0;
+}
+
+/**
+ * Ask the writer to flush the output file after its next batch
+ * @param w pointer to writer
+ */
+void mstat_writer_flush(struct mstat_writer_t *w) {
+    __atomic_store_n(&w->flush, 1, __ATOMIC_RELEASE);
+    mstat_writer_wake(w);
+}
+
+/**
+ * Write all queued records and stop the writer thread
+ * write_time stays valid, so the cost of the final batches can be reported.
+ * @param w pointer to writer
+ * @return 0 on success. -1 if any write failed (errno is set)
+ */
+int mstat_writer_close(struct mstat_writer_t *w) {
+    if (!w->ring) {
+        return 0;
+    }
+    __atomic_store_n(&w->stop, 1, __ATOMIC_RELEASE);
+    mstat_writer_wake(w);
+    pthread_join(w->thread, NULL);
+    close(w->wake);
+    free(w->ring);
+    free(w->index);
+    w->ring = NULL;
+    w->index = NULL;
+    if (w->error) {
+        errno = w->error;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Check whether a write failed. Safe to call while the writer runs.
+ * @param w pointer to writer
+ * @return errno of the first failed write. 0 if every write succeeded
+ */
+int mstat_writer_error(struct mstat_writer_t *w) {
+    return __atomic_load_n(&w->error, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,58 @@
+#ifndef MSTAT_WRITER_H
+#define MSTAT_WRITER_H
+#include <pthread.h>
+#include "common.h"
+
+struct mstat_writer_t {
+    /** Output file handle */
+    FILE *fp;
+    /** Ring of packed records waiting to be written (see mstat_pack) */
+    char *ring;
+    /** Fields per record */
+    int fields;
+    /** Storage type of each field (MSTAT_TYPE_*) */
+    const char *types;
+    /** Bytes per record */
+    size_t record_size;
+    /** Number of slots in ring (power of two) */
+    size_t capacity;
+    /** Next slot the sampler fills (written by the sampler only) */
+    size_t head;
+    /** Next slot the writer drains (written by the writer only) */
+    size_t tail;
+    /** Records discarded because the ring was full */
+    size_t dropped;
+    /** Records written to fp */
+    size_t written;
+    /** Request the writer to flush fp */
+    int flush;
+    /** Request the writer to drain the ring and exit */
+    int stop;
+    /** eventfd the writer blocks on while the ring is empty */
+    int wake;
+    /** The writer found the ring empty and waits on wake (cleared by whoever signals it) */
+    int idle;
+    /** errno of the first failed write (0 = no error. Written by the writer thread, see mstat_writer_error) */
+    int error;
+    /** MSTAT_FLAG_* bits describing the output (MSTAT_FLAG_COMPRESSED) */
+    unsigned long long flags;
+    /** Block offset and first record of each compressed block */
+    size_t *index;
+    /** Compressed blocks written */
+    size_t index_count;
+    /** Capacity of index (in blocks) */
+    size_t index_size;
+    /** Nanoseconds spent writing each batch (updated by the writer thread, kept after close) */
+    struct mstat_hist_t write_time;
+    /** Writer thread */
+    pthread_t thread;
+};
+
+int mstat_writer_open(struct mstat_writer_t *w, FILE *fp, size_t capacity, int fields, const char *types,
+                      unsigned long long flags);
+int mstat_writer_push(struct mstat_writer_t *w, const char *record);
+void mstat_writer_flush(struct mstat_writer_t *w);
+int mstat_writer_close(struct mstat_writer_t *w);
+int mstat_writer_error(struct mstat_writer_t *w);
+
+#endif //MSTAT_WRITER_H